@@ -0,0 +1,164 @@
+#include "admission.h"
+
+#include <sstream>
+
+AdmissionController::AdmissionController(std::size_t inflight_cap,
+                                         std::size_t queue_cap,
+                                         std::size_t dests,
+                                         std::size_t per_dest,
+                                         std::chrono::milliseconds t,
+                                         std::chrono::milliseconds i) :
+  max_inflight(inflight_cap), max_queue(queue_cap), max_per_dest(per_dest),
+  target(t), interval(i), inflight(0), connections(0),
+  dest_inflight(dests, 0), dropping(false), admitted(0), queued(0), shed(0),
+  expired(0), refused(0), dest_rejects(0) {}
+
+bool AdmissionController::overloaded(Clock::duration sojourn,
+                                     Clock::time_point now) {
+  if (sojourn < target) {
+    first_above = Clock::time_point();
+    dropping = false;
+  }
+  else if (first_above == Clock::time_point()) {
+    first_above = now + interval;
+  }
+  else if (now >= first_above) {
+    dropping = true;
+  }
+  return dropping;
+}
+
+void AdmissionController::dispatch(Clock::time_point now) {
+  bool woke = false;
+  while (inflight < max_inflight && !(hits.empty() && misses.empty())) {
+    auto& queue = hits.empty() ? misses : hits;
+    std::shared_ptr<Waiter> waiter = queue.front();
+    queue.pop_front();
+    woke = true;
+    if (overloaded(now - waiter->enqueued, now) &&
+        waiter->priority == Priority::MISS) {
+      waiter->shed = true;
+      ++shed;
+      continue;
+    }
+    waiter->granted = true;
+    ++inflight;
+    ++admitted;
+  }
+  if (woke) {
+    granted.notify_all();
+  }
+}
+
+bool AdmissionController::enter() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (connections >= max_inflight + max_queue) {
+    ++refused;
+    return false;
+  }
+  ++connections;
+  return true;
+}
+
+void AdmissionController::leave() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (connections > 0) {
+    --connections;
+  }
+}
+
+bool AdmissionController::admit(Priority priority,
+                                std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (inflight < max_inflight && hits.empty() && misses.empty()) {
+    overloaded(Clock::duration(), Clock::now());
+    ++inflight;
+    ++admitted;
+    return true;
+  }
+  // while overloaded a miss would only be shed later, answer it now
+  if (hits.size() + misses.size() >= max_queue ||
+      (dropping && priority == Priority::MISS)) {
+    ++shed;
+    return false;
+  }
+  std::shared_ptr<Waiter> waiter{new Waiter{priority, Clock::now(), false,
+                                            false}};
+  (priority == Priority::HIT ? hits : misses).push_back(waiter);
+  ++queued;
+  auto done = [&waiter] { return waiter->granted || waiter->shed; };
+  if (timeout.count() == 0) {
+    granted.wait(lock, done);
+  }
+  else if (!granted.wait_for(lock, timeout, done)) {
+    // still queued, give up its place
+    auto& queue = priority == Priority::HIT ? hits : misses;
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+      if (*it == waiter) {
+        queue.erase(it);
+        break;
+      }
+    }
+    ++shed;
+    ++expired;
+    return false;
+  }
+  return waiter->granted;
+}
+
+bool AdmissionController::try_admit() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (dropping || inflight >= max_inflight || !hits.empty() ||
+      !misses.empty()) {
+    return false;
+  }
+  ++inflight;
+  return true;
+}
+
+void AdmissionController::release() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (inflight > 0) {
+    --inflight;
+  }
+  dispatch(Clock::now());
+}
+
+bool AdmissionController::acquire_dest(std::size_t i) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (max_per_dest == 0 || i >= dest_inflight.size()) {
+    return true;
+  }
+  if (dest_inflight[i] >= max_per_dest) {
+    ++dest_rejects;
+    return false;
+  }
+  ++dest_inflight[i];
+  return true;
+}
+
+void AdmissionController::release_dest(std::size_t i) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (max_per_dest != 0 && i < dest_inflight.size() && dest_inflight[i] > 0) {
+    --dest_inflight[i];
+  }
+}
+
+std::string AdmissionController::report() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::ostringstream oss;
+  oss << "{\"inflight\":" << inflight << ",\"max_inflight\":" << max_inflight
+      << ",\"queued_hits\":" << hits.size()
+      << ",\"queued_misses\":" << misses.size()
+      << ",\"overloaded\":" << (dropping ? "true" : "false")
+      << ",\"admitted\":" << admitted << ",\"waited\":" << queued
+      << ",\"shed\":" << shed << ",\"expired\":" << expired
+      << ",\"connections\":" << connections << ",\"refused\":" << refused
+      << ",\"dest_rejects\":" << dest_rejects
+      << ",\"dest_inflight\":[";
+  for (std::size_t i = 0; i < dest_inflight.size(); ++i) {
+    oss << (i ? "," : "") << dest_inflight[i];
+  }
+  oss << "]}";
+  return oss.str();
+}
@@ -0,0 +1,87 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Admission control.  At most max_inflight requests are served at once; the
+// rest wait in a small queue where likely cache hits go ahead of misses.
+// Overload is detected CoDel style: once the time spent in the queue stays
+// above target for a whole interval, waiting misses are shed until it drops
+// below target again.  Shed requests get a 503 with Retry-After.  A miss
+// releases its slot before going upstream, where it is capped per
+// destination instead, so a saturated upstream only holds back misses and
+// cached traffic keeps flowing.  Connections are
+// capped too: beyond max_inflight + max_queue of them, accept answers with
+// the 503 itself instead of spawning a thread for the request.
+class AdmissionController {
+  public:
+    enum class Priority {HIT, MISS};
+
+    AdmissionController(std::size_t max_inflight, std::size_t max_queue,
+                        std::size_t dests, std::size_t max_per_dest,
+                        std::chrono::milliseconds target,
+                        std::chrono::milliseconds interval);
+
+    // a thread for one more connection, false when accept should shed it
+    bool enter();
+    void leave();
+
+    // may block in the queue for up to timeout (0 waits forever), false
+    // when the request is shed
+    bool admit(Priority priority, std::chrono::milliseconds timeout);
+    void release();
+
+    // background work: only takes a free slot, never queues
+    bool try_admit();
+
+    // never blocks, false when destination i is at its cap
+    bool acquire_dest(std::size_t i);
+    void release_dest(std::size_t i);
+
+    std::string report() const;
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Waiter {
+      Priority priority;
+      Clock::time_point enqueued;
+      bool granted;
+      bool shed;
+    };
+
+    // hand freed slots to waiters, shedding misses while overloaded
+    void dispatch(Clock::time_point now);
+    bool overloaded(Clock::duration sojourn, Clock::time_point now);
+
+    mutable std::mutex mutex;
+    std::condition_variable granted;
+    std::size_t max_inflight;
+    std::size_t max_queue;
+    std::size_t max_per_dest;
+    Clock::duration target;
+    Clock::duration interval;
+    std::size_t inflight;
+    std::size_t connections;
+    std::deque<std::shared_ptr<Waiter> > hits;
+    std::deque<std::shared_ptr<Waiter> > misses;
+    std::vector<std::size_t> dest_inflight;
+    Clock::time_point first_above; // zero while below target
+    bool dropping;
+    uint64_t admitted;
+    uint64_t queued;
+    uint64_t shed;
+    uint64_t expired;
+    uint64_t refused;
+    uint64_t dest_rejects;
+};
+
+#endif
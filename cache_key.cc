@@ -0,0 +1,446 @@
+#include "cache_key.h"
+#include "cache_store.h"
+#include "seastate.h"
+
+#include <algorithm>
+#include <cctype>
+#include <functional>
+#include <sstream>
+
+static const char HEX[] = "0123456789ABCDEF";
+
+static std::string lower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+  return s;
+}
+
+static std::string trim(const std::string& s) {
+  auto begin = s.find_first_not_of(" \t");
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  auto end = s.find_last_not_of(" \t\r");
+  return s.substr(begin, end - begin + 1);
+}
+
+static bool unreserved(char c) {
+  return isalnum(static_cast<unsigned char>(c)) || c == '-' || c == '.' ||
+    c == '_' || c == '~';
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+// decode %XX of unreserved characters, upper case the hex of the rest
+static std::string normalize_encoding(const std::string& s) {
+  std::string out;
+  out.reserve(s.size());
+  for (std::string::size_type i = 0; i < s.size(); ++i) {
+    int hi, lo;
+    if (s[i] == '%' && i + 2 < s.size() &&
+        (hi = hex_value(s[i + 1])) >= 0 && (lo = hex_value(s[i + 2])) >= 0) {
+      char c = static_cast<char>(hi * 16 + lo);
+      if (unreserved(c)) {
+        out += c;
+      }
+      else {
+        out += '%';
+        out += HEX[hi];
+        out += HEX[lo];
+      }
+      i += 2;
+    }
+    else {
+      out += s[i];
+    }
+  }
+  return out;
+}
+
+void VaryIndex::load() {
+  std::map<uint64_t, std::vector<std::string> > stored = load_cached_varies();
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& entry : stored) {
+    index[entry.first] = entry.second;
+  }
+}
+
+bool VaryIndex::contains(uint64_t base) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return index.count(base) != 0;
+}
+
+bool VaryIndex::lookup(uint64_t base, std::vector<std::string>& names) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = index.find(base);
+  if (it == index.end()) {
+    return false;
+  }
+  names = it->second;
+  return true;
+}
+
+void VaryIndex::remember(uint64_t base, const std::vector<std::string>& names) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(base);
+    if (it != index.end() && it->second == names) {
+      return;
+    }
+    index[base] = names;
+  }
+  store_cached_vary(base, names);
+}
+
+void VaryIndex::forget(uint64_t base) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index.erase(base) == 0) {
+      return;
+    }
+  }
+  store_cached_vary(base, std::vector<std::string>());
+}
+
+CacheKeyBuilder::CacheKeyBuilder(const std::vector<std::string>& drop,
+                                 const std::vector<std::string>& post) :
+  drop_params(drop), post_prefixes(post) {}
+
+bool CacheKeyBuilder::cacheable(Method method, const std::string& target) const {
+  if (method == Method::GET) {
+    return true;
+  }
+  if (method != Method::POST) {
+    return false;
+  }
+  std::string path = canonical_target(target);
+  for (auto& prefix : post_prefixes) {
+    if (path.compare(0, prefix.size(), prefix) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CacheKeyBuilder::dropped(const std::string& name) const {
+  for (auto& drop : drop_params) {
+    if (!drop.empty() && drop.back() == '*') {
+      if (name.compare(0, drop.size() - 1, drop, 0, drop.size() - 1) == 0) {
+        return true;
+      }
+    }
+    else if (name == drop) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// sorted, deduplicated name=value pairs of a query string or form body
+static std::string canonical_params(const std::string& params_str,
+    const std::function<bool(const std::string&)>& dropped) {
+  std::vector<std::pair<std::string, std::string> > params;
+  std::istringstream query(params_str);
+  std::string param;
+  while (std::getline(query, param, '&')) {
+    if (param.empty()) {
+      continue;
+    }
+    auto equals = param.find('=');
+    std::string name = normalize_encoding(param.substr(0, equals));
+    if (dropped && dropped(name)) {
+      continue;
+    }
+    std::string value = equals == std::string::npos ? std::string() :
+      "=" + normalize_encoding(param.substr(equals + 1));
+    params.push_back(std::make_pair(name, value));
+  }
+  std::sort(params.begin(), params.end());
+  params.erase(std::unique(params.begin(), params.end()), params.end());
+  std::string canonical;
+  for (auto& p : params) {
+    canonical += (canonical.empty() ? "" : "&") + p.first + p.second;
+  }
+  return canonical;
+}
+
+std::string CacheKeyBuilder::canonical_target(const std::string& target) const {
+  std::string t = target.substr(0, target.find('#'));
+  auto question = t.find('?');
+  std::string path = normalize_encoding(t.substr(0, question));
+  if (question == std::string::npos) {
+    return path;
+  }
+  std::string query = canonical_params(t.substr(question + 1),
+    [this](const std::string& name) { return dropped(name); });
+  return query.empty() ? path : path + "?" + query;
+}
+
+uint64_t CacheKeyBuilder::base_key(Method method, const std::string& target,
+                                   const std::string& body,
+                                   const std::string& content_type) const {
+  SeaState state;
+  // nothing to normalise: hashed as it is, without a copy
+  if (method == Method::GET &&
+      target.find_first_of("#%?") == std::string::npos) {
+    return state.hash(target);
+  }
+  std::string canonical = canonical_target(target);
+  if (method != Method::GET) {
+    SeaState body_state;
+    uint64_t body_hash = body_state.hash(canonical_body(content_type, body));
+    canonical = method_name(method) + " " + canonical + "\n" +
+      cache_key_name(body_hash);
+  }
+  return state.hash(canonical);
+}
+
+uint64_t CacheKeyBuilder::variant_key(uint64_t base,
+    const std::vector<std::string>& names,
+    const std::map<std::string, std::string>& headers) const {
+  static const std::vector<std::string> LISTS = {
+    "accept", "accept-charset", "accept-encoding", "accept-language" };
+  std::ostringstream oss;
+  oss << cache_key_name(base);
+  for (auto& name : names) {
+    auto it = headers.find(name);
+    std::string value = it == headers.end() ? std::string() : it->second;
+    if (std::find(LISTS.begin(), LISTS.end(), name) != LISTS.end()) {
+      // list valued negotiation headers: order and case don't matter
+      std::vector<std::string> items;
+      std::istringstream iss(lower(value));
+      std::string item;
+      while (std::getline(iss, item, ',')) {
+        item = trim(item);
+        item.erase(std::remove(item.begin(), item.end(), ' '), item.end());
+        if (!item.empty()) {
+          items.push_back(item);
+        }
+      }
+      std::sort(items.begin(), items.end());
+      value.clear();
+      for (auto& i : items) {
+        value += (value.empty() ? "" : ",") + i;
+      }
+    }
+    oss << '\n' << name << ':' << value;
+  }
+  SeaState state;
+  return state.hash(oss.str());
+}
+
+uint64_t CacheKeyBuilder::key(Method method, const std::string& target,
+                              const std::map<std::string, std::string>& headers,
+                              const std::string& body, uint64_t& base) const {
+  auto content_type = headers.find("content-type");
+  base = base_key(method, target, body, content_type == headers.end() ?
+                  std::string() : content_type->second);
+  std::vector<std::string> names;
+  if (!vary_index.lookup(base, names)) {
+    return base;
+  }
+  return variant_key(base, names, headers);
+}
+
+namespace {
+
+// Minimal JSON reader that writes its input back in canonical form.
+class JsonCanonicalizer {
+  public:
+    explicit JsonCanonicalizer(const std::string& text) : in(text), pos(0) {}
+
+    bool run(std::string& out) {
+      if (!value(out)) {
+        return false;
+      }
+      skip_space();
+      return pos == in.size();
+    }
+
+  private:
+    void skip_space() {
+      while (pos < in.size() && isspace(static_cast<unsigned char>(in[pos]))) {
+        ++pos;
+      }
+    }
+
+    bool string(std::string& out) {
+      if (pos >= in.size() || in[pos] != '"') {
+        return false;
+      }
+      auto start = pos++;
+      while (pos < in.size() && in[pos] != '"') {
+        pos += in[pos] == '\\' ? 2 : 1;
+      }
+      if (pos >= in.size()) {
+        return false;
+      }
+      ++pos;
+      out.append(in, start, pos - start);
+      return true;
+    }
+
+    bool object(std::string& out) {
+      ++pos;
+      std::vector<std::pair<std::string, std::string> > members;
+      skip_space();
+      if (pos < in.size() && in[pos] == '}') {
+        ++pos;
+        out += "{}";
+        return true;
+      }
+      while (true) {
+        std::string name, member;
+        skip_space();
+        if (!string(name)) {
+          return false;
+        }
+        skip_space();
+        if (pos >= in.size() || in[pos++] != ':' || !value(member)) {
+          return false;
+        }
+        members.push_back(std::make_pair(name, member));
+        skip_space();
+        if (pos < in.size() && in[pos] == ',') {
+          ++pos;
+          continue;
+        }
+        if (pos < in.size() && in[pos] == '}') {
+          ++pos;
+          break;
+        }
+        return false;
+      }
+      std::stable_sort(members.begin(), members.end(),
+                       [](const std::pair<std::string, std::string>& a,
+                          const std::pair<std::string, std::string>& b) {
+                         return a.first < b.first;
+                       });
+      out += '{';
+      for (std::size_t i = 0; i < members.size(); ++i) {
+        out += (i ? "," : "") + members[i].first + ":" + members[i].second;
+      }
+      out += '}';
+      return true;
+    }
+
+    bool array(std::string& out) {
+      ++pos;
+      out += '[';
+      skip_space();
+      if (pos < in.size() && in[pos] == ']') {
+        ++pos;
+        out += ']';
+        return true;
+      }
+      for (bool first = true; ; first = false) {
+        if (!first) {
+          out += ',';
+        }
+        if (!value(out)) {
+          return false;
+        }
+        skip_space();
+        if (pos < in.size() && in[pos] == ',') {
+          ++pos;
+          continue;
+        }
+        if (pos < in.size() && in[pos] == ']') {
+          ++pos;
+          out += ']';
+          return true;
+        }
+        return false;
+      }
+    }
+
+    bool value(std::string& out) {
+      skip_space();
+      if (pos >= in.size()) {
+        return false;
+      }
+      switch (in[pos]) {
+      case '{': return object(out);
+      case '[': return array(out);
+      case '"': return string(out);
+      default:
+        break;
+      }
+      // number, true, false or null
+      auto start = pos;
+      while (pos < in.size() && (isalnum(static_cast<unsigned char>(in[pos])) ||
+                                 in[pos] == '-' || in[pos] == '+' ||
+                                 in[pos] == '.')) {
+        ++pos;
+      }
+      if (pos == start) {
+        return false;
+      }
+      out.append(in, start, pos - start);
+      return true;
+    }
+
+    const std::string& in;
+    std::string::size_type pos;
+};
+
+}
+
+std::string canonical_body(const std::string& content_type,
+                           const std::string& body) {
+  std::string type = lower(content_type);
+  if (type.find("application/x-www-form-urlencoded") != std::string::npos) {
+    return canonical_params(body, nullptr);
+  }
+  std::string canonical;
+  if (JsonCanonicalizer(body).run(canonical)) {
+    return canonical;
+  }
+  return body;
+}
+
+std::map<std::string, std::string> parse_header_fields(const std::string& message) {
+  std::map<std::string, std::string> fields;
+  auto end = message.find("\r\n\r\n");
+  std::istringstream iss(message.substr(0, end));
+  std::string line;
+  std::getline(iss, line); // request or status line
+  while (std::getline(iss, line)) {
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string name = lower(trim(line.substr(0, colon)));
+    std::string value = trim(line.substr(colon + 1));
+    auto it = fields.find(name);
+    if (it != fields.end()) {
+      it->second += ", " + value;
+    }
+    else {
+      fields[name] = value;
+    }
+  }
+  return fields;
+}
+
+std::vector<std::string> parse_vary(const std::string& value) {
+  std::vector<std::string> names;
+  std::istringstream iss(lower(value));
+  std::string name;
+  while (std::getline(iss, name, ',')) {
+    name = trim(name);
+    if (name == "*") {
+      return std::vector<std::string>(1, name);
+    }
+    if (!name.empty()) {
+      names.push_back(name);
+    }
+  }
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+  return names;
+}
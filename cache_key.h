@@ -0,0 +1,83 @@
+#ifndef CACHE_KEY_H
+#define CACHE_KEY_H
+
+#include "http_caching_proxy.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Header names listed in the Vary of stored responses, by base key.  Kept
+// in memory and persisted next to the entries as <hash>.vary.
+class VaryIndex {
+  public:
+    void load();
+    bool contains(uint64_t base) const;
+    bool lookup(uint64_t base, std::vector<std::string>& names) const;
+    void remember(uint64_t base, const std::vector<std::string>& names);
+    void forget(uint64_t base);
+
+  private:
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, std::vector<std::string> > index;
+};
+
+// Turns a request into its cache key.  The request target is normalised
+// first: percent-encoding of unreserved characters is decoded and the rest
+// upper cased, the fragment dropped, and query parameters sorted with
+// duplicates and configured tracking parameters removed ("utm_*" drops
+// every parameter starting with utm_).  Methods other than GET are folded
+// into the key together with a hash of the canonical body, GET keys stay
+// SeaState::hash(path) so existing data_dirs keep working.  If a stored
+// response for that key carried a Vary, the named request header values
+// are folded in as well.
+//
+// Only GET is cached by default; POST is cached for targets starting with
+// one of the configured prefixes.
+class CacheKeyBuilder {
+  public:
+    CacheKeyBuilder(const std::vector<std::string>& drop_params,
+                    const std::vector<std::string>& post_prefixes);
+
+    bool cacheable(Method method, const std::string& target) const;
+
+    std::string canonical_target(const std::string& target) const;
+
+    uint64_t base_key(Method method, const std::string& target,
+                      const std::string& body = std::string(),
+                      const std::string& content_type = std::string()) const;
+
+    uint64_t variant_key(uint64_t base, const std::vector<std::string>& names,
+                         const std::map<std::string, std::string>& headers) const;
+
+    // key of a request, taking the known Vary of its base key into account
+    uint64_t key(Method method, const std::string& target,
+                 const std::map<std::string, std::string>& headers,
+                 const std::string& body, uint64_t& base) const;
+
+    VaryIndex& vary() const { return vary_index; }
+
+  private:
+    bool dropped(const std::string& name) const;
+
+    std::vector<std::string> drop_params;
+    std::vector<std::string> post_prefixes;
+    mutable VaryIndex vary_index;
+};
+
+// body in a form where equivalent requests compare equal: JSON with object
+// members sorted and insignificant whitespace removed, form data with its
+// fields sorted, anything else as is
+std::string canonical_body(const std::string& content_type,
+                           const std::string& body);
+
+// header fields of a request or response, names lower cased
+std::map<std::string, std::string> parse_header_fields(const std::string& message);
+
+// names listed in a Vary header, lower cased; "*" when it can't be cached
+std::vector<std::string> parse_vary(const std::string& value);
+
+#endif
@@ -0,0 +1,635 @@
+#include "cache_store.h"
+#include "cuckoo_filter.h"
+#include "shm_cache.h"
+#include "cache_writer.h"
+#include "http_caching_proxy.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+static const std::string RES = ".res";
+static const std::string REQ = ".req";
+static const std::string VARY = ".vary";
+static const std::string HDR = ".hdr";
+static const std::string BODY = ".body";
+static const std::string BLOB = ".blob";
+
+static std::shared_ptr<CuckooFilter> cache_filter;
+
+static std::shared_ptr<ShmCache> hot_cache;
+
+static std::shared_ptr<CacheWriter> cache_writer;
+
+static bool cache_sync = false;
+
+static std::atomic<unsigned> temp_counter(0);
+
+// serializes linking blobs against releasing them
+static std::mutex blob_mutex;
+
+// the .hdr of the entries stored or loaded lately, so a disk hit opens
+// only the body like a single .res did.  Entries are never dropped, only
+// replaced: one whose body is gone or resized, rewritten by another
+// process, has its .hdr read again.
+struct IndexedHead {
+  std::string head;
+  uint64_t body;
+  std::size_t length;
+};
+
+static const std::size_t HEAD_INDEX_SIZE = 16384;
+
+static std::mutex head_mutex;
+
+static std::unordered_map<uint64_t, IndexedHead> head_index;
+
+static std::deque<uint64_t> head_order;
+
+void set_cache_sync(bool sync) {
+  cache_sync = sync;
+}
+
+void set_cache_writer(const std::shared_ptr<CacheWriter>& writer) {
+  cache_writer = writer;
+}
+
+void flush_cache_writer() {
+  if (cache_writer) {
+    cache_writer->flush();
+  }
+}
+
+void set_hot_cache(const std::shared_ptr<ShmCache>& hot) {
+  hot_cache = hot;
+}
+
+void set_cache_filter(const std::shared_ptr<CuckooFilter>& filter) {
+  cache_filter = filter;
+}
+
+bool may_be_cached(uint64_t hash) {
+  return !cache_filter || cache_filter->contains(hash);
+}
+
+std::string cache_key_name(uint64_t hash) {
+  std::ostringstream oss;
+  oss << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return oss.str();
+}
+
+std::string cache_file_name(uint64_t hash, const std::string& ext) {
+  return cache_key_name(hash) + ext;
+}
+
+// <hash>.<body hash>.body in a buffer of its own, for the hit path
+struct BodyFileName {
+  BodyFileName(uint64_t hash, uint64_t body) {
+    snprintf(name, sizeof(name), "%016llx.%016llx.body",
+             static_cast<unsigned long long>(hash),
+             static_cast<unsigned long long>(body));
+  }
+  char name[48];
+};
+
+static std::string body_file_name(uint64_t hash, uint64_t body) {
+  return BodyFileName(hash, body).name;
+}
+
+std::size_t body_offset(const std::string& response) {
+  std::size_t line = 0;
+  while (true) {
+    std::size_t eol = response.find('\n', line);
+    if (eol == std::string::npos) {
+      return response.size();
+    }
+    if (eol == line || (eol == line + 1 && response[line] == '\r')) {
+      return eol + 1;
+    }
+    line = eol + 1;
+  }
+}
+
+static uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15LLU;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9LLU;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebLLU;
+  return x ^ (x >> 31);
+}
+
+uint64_t content_hash(const char* data, std::size_t size) {
+  uint64_t h = mix(size);
+  std::size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0x9fb21c651e98df25LLU;
+    h ^= h >> 29;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, size - i);
+  return mix(h ^ tail);
+}
+
+bool dechunk_body(const std::string& chunked, std::string& body) {
+  std::size_t pos = 0;
+  while (true) {
+    std::size_t eol = chunked.find("\r\n", pos);
+    if (eol == std::string::npos) {
+      return false;
+    }
+    std::size_t size = std::strtoul(chunked.c_str() + pos, nullptr, 16);
+    pos = eol + 2;
+    if (size == 0) {
+      return true;
+    }
+    if (pos + size > chunked.size()) {
+      return false;
+    }
+    body.append(chunked, pos, size);
+    pos += size + 2;
+  }
+}
+
+bool dechunk_response(std::string& response) {
+  static const char NAME[] = "transfer-encoding:";
+  std::size_t offset = body_offset(response);
+  std::size_t line = response.find('\n');
+  if (line == std::string::npos) {
+    return true;
+  }
+  bool chunked = false;
+  for (++line; line < offset;) {
+    std::size_t eol = response.find('\n', line);
+    if (strncasecmp(response.c_str() + line, NAME, sizeof(NAME) - 1) != 0) {
+      line = eol + 1;
+      continue;
+    }
+    std::string value = response.substr(line, eol - line);
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    chunked = chunked || value.find("chunked") != std::string::npos;
+    response.erase(line, eol + 1 - line);
+    offset -= eol + 1 - line;
+  }
+  if (!chunked) {
+    return true;
+  }
+  std::string body;
+  if (!dechunk_body(response.substr(offset), body)) {
+    return false;
+  }
+  response.resize(offset);
+  response += body;
+  return true;
+}
+
+// appends the whole of file to data
+static bool read_file(const std::string& file, std::string& data) {
+  std::ifstream in(file, std::ios::binary);
+  if (!in.is_open()) {
+    return false;
+  }
+  in.seekg(0, std::ios::end);
+  std::streamoff size = in.tellg();
+  in.seekg(0, std::ios::beg);
+  if (size < 0) {
+    return false;
+  }
+  std::size_t at = data.size();
+  data.resize(at + static_cast<std::size_t>(size));
+  if (size > 0) {
+    in.read(&data[at], size);
+  }
+  return static_cast<bool>(in);
+}
+
+// for the small files read on every hit: open, read and close, where a
+// short read of a regular file is its end
+static bool read_small_file(const std::string& file, std::string& data) {
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  char buffer[4096];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+    data.append(buffer, n);
+    if (static_cast<std::size_t>(n) < sizeof(buffer)) {
+      break;
+    }
+  }
+  close(fd);
+  return n >= 0;
+}
+
+// <hash>.hdr: "<body hash> <body length>\n" then the head of the response
+static bool load_header(uint64_t hash, std::string& head, uint64_t& body,
+                        std::size_t& length) {
+  head.clear();
+  if (!read_small_file(cache_file_name(hash, HDR), head)) {
+    return false;
+  }
+  auto eol = head.find('\n');
+  if (eol == std::string::npos) {
+    return false;
+  }
+  std::istringstream line(head.substr(0, eol));
+  if (!(line >> std::hex >> body >> std::dec >> length)) {
+    return false;
+  }
+  head.erase(0, eol + 1);
+  return true;
+}
+
+static void index_head(uint64_t hash, const char* head, std::size_t size,
+                       uint64_t body, std::size_t length) {
+  std::lock_guard<std::mutex> lock(head_mutex);
+  auto it = head_index.find(hash);
+  if (it == head_index.end()) {
+    if (head_index.size() >= HEAD_INDEX_SIZE) {
+      head_index.erase(head_order.front());
+      head_order.pop_front();
+    }
+    head_order.push_back(hash);
+    it = head_index.insert(std::make_pair(hash, IndexedHead())).first;
+  }
+  it->second.head.assign(head, size);
+  it->second.body = body;
+  it->second.length = length;
+}
+
+static bool indexed_head(uint64_t hash, std::string& head, uint64_t& body,
+                         std::size_t& length) {
+  std::lock_guard<std::mutex> lock(head_mutex);
+  auto it = head_index.find(hash);
+  if (it == head_index.end()) {
+    return false;
+  }
+  head = it->second.head;
+  body = it->second.body;
+  length = it->second.length;
+  return true;
+}
+
+// the head of a split entry and an fd on its body, length bytes long; -1
+// on a miss, with split false when there is no .hdr at all
+static int open_split_entry(uint64_t hash, std::string& head,
+                            std::size_t& length, bool& split) {
+  uint64_t body = 0;
+  bool indexed = indexed_head(hash, head, body, length);
+  while (true) {
+    split = indexed || load_header(hash, head, body, length);
+    if (!split) {
+      head.clear();
+      return -1;
+    }
+    if (!indexed) {
+      index_head(hash, head.data(), head.size(), body, length);
+    }
+    int fd = open(BodyFileName(hash, body).name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 &&
+        static_cast<std::size_t>(st.st_size) == length) {
+      return fd;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (!indexed) {
+      return -1;
+    }
+    indexed = false;
+  }
+}
+
+// appends the size bytes left in fd to data
+static bool read_fd(int fd, std::size_t size, std::string& data) {
+  std::size_t at = data.size();
+  data.resize(at + size);
+  std::size_t done = 0;
+  ssize_t n = 0;
+  while (done < size && (n = read(fd, &data[at + done], size - done)) > 0) {
+    done += n;
+  }
+  data.resize(at + done);
+  return done == size;
+}
+
+bool load_hot_response(uint64_t hash, std::string& response) {
+  return hot_cache && hot_cache->lookup(hash, response);
+}
+
+int open_cached_response(uint64_t hash, std::string& head,
+                         std::size_t& size) {
+  if (!may_be_cached(hash)) {
+    return -1;
+  }
+  bool split;
+  int fd = open_split_entry(hash, head, size, split);
+  if (split) {
+    return fd;
+  }
+  // written before bodies were split out
+  fd = open(cache_file_name(hash, RES).c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  size = fd < 0 ? 0 : st.st_size;
+  return fd;
+}
+
+void promote_cached_response(uint64_t hash, const std::string& response) {
+  if (hot_cache) {
+    hot_cache->insert(hash, response);
+  }
+}
+
+bool is_cached(uint64_t hash) {
+  if ((hot_cache && hot_cache->contains(hash)) ||
+      (cache_writer && cache_writer->pending(hash))) {
+    return true;
+  }
+  struct stat st;
+  return may_be_cached(hash) &&
+    (stat(cache_file_name(hash, HDR).c_str(), &st) == 0 ||
+     stat(cache_file_name(hash, RES).c_str(), &st) == 0);
+}
+
+bool load_cached_response(uint64_t hash, std::string& response) {
+  if (load_hot_response(hash, response)) {
+    return true;
+  }
+  if (cache_writer && cache_writer->pending(hash, response)) {
+    return true;
+  }
+  if (!may_be_cached(hash)) {
+    return false;
+  }
+  std::size_t length = 0;
+  bool split;
+  int fd = open_split_entry(hash, response, length, split);
+  if (split) {
+    bool read = fd >= 0 && read_fd(fd, length, response);
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (!read) {
+      return false;
+    }
+  }
+  else {
+    // written before bodies were split out
+    response.clear();
+    if (!read_file(cache_file_name(hash, RES), response)) {
+      return false;
+    }
+  }
+  promote_cached_response(hash, response);
+  return true;
+}
+
+static std::string temp_name(const std::string& file) {
+  std::ostringstream oss;
+  oss << file << ".tmp." << getpid() << '.' << temp_counter++;
+  return oss.str();
+}
+
+static bool write_file(const std::string& file, const char* data,
+                       std::size_t size, bool sync) {
+  std::string temp = temp_name(file);
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  std::size_t done = 0;
+  while (done < size) {
+    ssize_t n = write(fd, data + done, size - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  bool ok = done == size && (!sync || fsync(fd) == 0);
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(temp.c_str(), file.c_str()) != 0) {
+    unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+static bool same_contents(const std::string& file, const char* data,
+                          std::size_t size) {
+  struct stat st;
+  std::string existing;
+  return stat(file.c_str(), &st) == 0 &&
+    static_cast<std::size_t>(st.st_size) == size &&
+    read_file(file, existing) && existing.size() == size &&
+    memcmp(existing.data(), data, size) == 0;
+}
+
+// <hash>.<body>.body becomes a link to <body>.blob, writing the blob first
+// if this is the first entry with that body
+static bool link_body(uint64_t hash, uint64_t body, const char* data,
+                      std::size_t size, bool sync) {
+  std::lock_guard<std::mutex> lock(blob_mutex);
+  std::string name = body_file_name(hash, body);
+  if (same_contents(name, data, size)) {
+    return true;
+  }
+  std::string blob = cache_file_name(body, BLOB);
+  struct stat st;
+  bool shared = stat(blob.c_str(), &st) == 0;
+  if (shared && !same_contents(blob, data, size)) {
+    // two bodies with one hash: this entry keeps a copy of its own
+    return write_file(name, data, size, sync);
+  }
+  if (!shared && !write_file(blob, data, size, sync)) {
+    return false;
+  }
+  std::string temp = temp_name(name);
+  if (link(blob.c_str(), temp.c_str()) != 0) {
+    return false;
+  }
+  if (rename(temp.c_str(), name.c_str()) != 0) {
+    unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+// a blob only linked from its own name is no longer referenced
+static bool release_blob(uint64_t body) {
+  std::string blob = cache_file_name(body, BLOB);
+  struct stat st;
+  return stat(blob.c_str(), &st) == 0 && st.st_nlink == 1 &&
+    unlink(blob.c_str()) == 0;
+}
+
+bool write_cache_entry(uint64_t hash, const std::string& request,
+                       const std::string& response, bool sync) {
+  std::size_t offset = body_offset(response);
+  std::size_t length = response.size() - offset;
+  uint64_t body = content_hash(response.data() + offset, length);
+  std::string old_head;
+  uint64_t old_body = 0;
+  std::size_t old_length = 0;
+  bool replaced = load_header(hash, old_head, old_body, old_length) &&
+    old_body != body;
+  std::ostringstream hdr;
+  hdr << cache_key_name(body) << ' ' << length << '\n';
+  hdr.write(response.data(), offset);
+  std::string header = hdr.str();
+  // the .hdr is what makes the entry visible, so it goes last
+  bool ok = write_file(cache_file_name(hash, REQ), request.data(),
+                       request.size(), sync) &&
+    link_body(hash, body, response.data() + offset, length, sync) &&
+    write_file(cache_file_name(hash, HDR), header.data(), header.size(), sync);
+  if (ok) {
+    index_head(hash, response.data(), offset, body, length);
+    unlink(cache_file_name(hash, RES).c_str());
+    if (replaced) {
+      std::lock_guard<std::mutex> lock(blob_mutex);
+      unlink(body_file_name(hash, old_body).c_str());
+      release_blob(old_body);
+    }
+  }
+  if (ok && sync) {
+    int dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir >= 0) {
+      fsync(dir);
+      close(dir);
+    }
+  }
+  return ok;
+}
+
+void store_cached_response(uint64_t hash, const std::string& request,
+                           const std::string& response) {
+  if (cache_writer) {
+    cache_writer->enqueue(hash, request, response);
+  }
+  else {
+    write_cache_entry(hash, request, response, cache_sync);
+  }
+  if (cache_filter && !cache_filter->overflowed() &&
+      !cache_filter->insert(hash)) {
+    logger(LOG, "cache_store",
+           "existence filter full, misses go to the disk from now on", 0);
+  }
+  if (hot_cache) {
+    hot_cache->insert(hash, response);
+  }
+}
+
+static std::vector<uint64_t> list_keys(const std::string& ext) {
+  std::vector<uint64_t> keys;
+  DIR* dir = opendir(".");
+  if (dir == nullptr) {
+    return keys;
+  }
+  while (dirent* entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.size() != 16 + ext.size() ||
+        name.compare(16, ext.size(), ext) != 0) {
+      continue;
+    }
+    char* end = nullptr;
+    uint64_t key = std::strtoull(name.substr(0, 16).c_str(), &end, 16);
+    if (end != nullptr && *end == '\0') {
+      keys.push_back(key);
+    }
+  }
+  closedir(dir);
+  return keys;
+}
+
+std::vector<uint64_t> list_cached_keys() {
+  std::vector<uint64_t> keys = list_keys(HDR);
+  std::vector<uint64_t> legacy = list_keys(RES);
+  keys.insert(keys.end(), legacy.begin(), legacy.end());
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+std::size_t collect_cache_garbage() {
+  std::vector<std::string> links;
+  std::vector<uint64_t> blobs;
+  DIR* dir = opendir(".");
+  if (dir == nullptr) {
+    return 0;
+  }
+  while (dirent* entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.size() == 33 + BODY.size() && name[16] == '.' &&
+        name.compare(33, BODY.size(), BODY) == 0) {
+      links.push_back(name);
+    }
+    else if (name.size() == 16 + BLOB.size() &&
+             name.compare(16, BLOB.size(), BLOB) == 0) {
+      blobs.push_back(std::strtoull(name.substr(0, 16).c_str(), nullptr, 16));
+    }
+  }
+  closedir(dir);
+  std::size_t removed = 0;
+  std::lock_guard<std::mutex> lock(blob_mutex);
+  // links left behind by an entry rewritten while the process died
+  for (auto& name : links) {
+    uint64_t hash = std::strtoull(name.substr(0, 16).c_str(), nullptr, 16);
+    std::string head;
+    uint64_t body = 0;
+    std::size_t length = 0;
+    if (!load_header(hash, head, body, length) ||
+        body_file_name(hash, body) != name) {
+      removed += unlink(name.c_str()) == 0;
+    }
+  }
+  for (auto body : blobs) {
+    removed += release_blob(body);
+  }
+  return removed;
+}
+
+void store_cached_vary(uint64_t hash, const std::vector<std::string>& names) {
+  std::string file = cache_file_name(hash, VARY);
+  if (names.empty()) {
+    unlink(file.c_str());
+    return;
+  }
+  std::ofstream vary(file);
+  for (auto& name : names) {
+    vary << name << '\n';
+  }
+}
+
+std::map<uint64_t, std::vector<std::string> > load_cached_varies() {
+  std::map<uint64_t, std::vector<std::string> > varies;
+  for (auto key : list_keys(VARY)) {
+    std::ifstream vary(cache_file_name(key, VARY));
+    std::string name;
+    while (std::getline(vary, name)) {
+      if (!name.empty()) {
+        varies[key].push_back(name);
+      }
+    }
+  }
+  return varies;
+}
@@ -0,0 +1,98 @@
+#ifndef CACHE_STORE_H
+#define CACHE_STORE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class CuckooFilter;
+class ShmCache;
+class CacheWriter;
+
+// On disk layout of the cache: every entry is named after the 16 hex digit
+// SeaState hash of its key.  <hash>.req is the request that produced it and
+// <hash>.hdr starts with "<body hash> <body length>" on a line of its own,
+// followed by the status line and headers of the response.  Bodies are
+// stored once, in <body hash>.blob, and every entry holding one links it as
+// <hash>.<body hash>.body, so the blob's link count is its reference count.
+// The heads of recent entries are also kept in memory, so a hit on one
+// opens only its body.  Entries from older versions, the whole response in
+// <hash>.res, are still read.  Responses with a Vary are stored under a
+// variant key, see cache_key.h.
+
+std::string cache_key_name(uint64_t hash);
+
+std::string cache_file_name(uint64_t hash, const std::string& ext);
+
+bool load_cached_response(uint64_t hash, std::string& response);
+
+// some tier has hash: the hot tier, the writer's queue or the disk
+bool is_cached(uint64_t hash);
+
+// where the body of a raw response starts, after the empty line
+std::size_t body_offset(const std::string& response);
+
+// content hash the bodies are stored under, on disk and in the hot tier
+uint64_t content_hash(const char* data, std::size_t size);
+
+// the body of a chunked message, false if it is malformed or cut short
+bool dechunk_body(const std::string& chunked, std::string& body);
+
+// a whole upstream response in the form the cache keeps: a chunked body
+// decoded and the Transfer-Encoding line dropped
+bool dechunk_response(std::string& response);
+
+// the pieces of load_cached_response for callers doing their own file I/O:
+// the hot tier, the head and an fd on the body (-1 on a miss) and the hot
+// tier insert
+bool load_hot_response(uint64_t hash, std::string& response);
+
+int open_cached_response(uint64_t hash, std::string& head, std::size_t& size);
+
+void promote_cached_response(uint64_t hash, const std::string& response);
+
+// with a writer installed the files are written behind, see cache_writer.h
+void store_cached_response(uint64_t hash, const std::string& request,
+                           const std::string& response);
+
+// <hash>.req, the body link and then <hash>.hdr, each through a temp file
+// renamed into place so readers never see a partial entry; sync fsyncs them
+// first
+bool write_cache_entry(uint64_t hash, const std::string& request,
+                       const std::string& response, bool sync);
+
+void set_cache_writer(const std::shared_ptr<CacheWriter>& writer);
+
+// blocks until the writer, if any, has written out what it holds; called on
+// the way out, after SIGTERM or a SIGUSR2 handover
+void flush_cache_writer();
+
+// without a writer, fsync every entry stored
+void set_cache_sync(bool sync);
+
+// keys of every entry in the current (data) directory
+std::vector<uint64_t> list_cached_keys();
+
+// remove blobs no entry links any more and links no .hdr names, returns
+// how many files went
+std::size_t collect_cache_garbage();
+
+// <hash>.vary lists the request headers named by the Vary of the responses
+// stored under base key hash, one per line; no names removes the file
+void store_cached_vary(uint64_t hash, const std::vector<std::string>& names);
+
+std::map<uint64_t, std::vector<std::string> > load_cached_varies();
+
+// with a filter installed, keys it has never seen are reported as misses
+// without opening their files; stores keep the filter up to date
+void set_cache_filter(const std::shared_ptr<CuckooFilter>& filter);
+
+bool may_be_cached(uint64_t hash);
+
+// with a hot tier installed, loads try it before the filter and the disk,
+// and responses loaded from disk or stored are copied into it
+void set_hot_cache(const std::shared_ptr<ShmCache>& hot);
+
+#endif
@@ -0,0 +1,127 @@
+#include "cache_writer.h"
+#include "cache_store.h"
+#include "http_caching_proxy.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <vector>
+
+bool CacheWriter::parse_sync(const std::string& name, Sync& sync) {
+  if (name == "none") {
+    sync = Sync::NONE;
+  }
+  else if (name == "batch") {
+    sync = Sync::BATCH;
+  }
+  else if (name == "always") {
+    sync = Sync::ALWAYS;
+  }
+  else {
+    return false;
+  }
+  return true;
+}
+
+CacheWriter::CacheWriter(std::size_t max, Sync s) :
+  max_bytes(max), sync(s), queued_bytes(0), writing(false), stopping(false),
+  shed(0) {}
+
+CacheWriter::~CacheWriter() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+bool CacheWriter::enqueue(uint64_t hash, const std::string& request,
+                          const std::string& response) {
+  std::size_t bytes = request.size() + response.size();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queued_bytes + bytes > max_bytes) {
+      // log the first one and then every 1000th, not every request
+      if (shed++ % 1000 == 0) {
+        std::ostringstream oss;
+        oss << "writer behind, " << queued_bytes << " bytes queued, "
+            << shed << " entries shed";
+        logger(LOG, "cache_writer", oss, 0);
+      }
+      return false;
+    }
+    std::shared_ptr<Entry> entry{new Entry{hash, request, response}};
+    queue.push_back(entry);
+    latest[hash] = entry;
+    queued_bytes += bytes;
+    if (!thread.joinable()) {
+      thread = std::thread(&CacheWriter::run, this);
+    }
+  }
+  wake.notify_one();
+  return true;
+}
+
+bool CacheWriter::pending(uint64_t hash, std::string& response) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = latest.find(hash);
+  if (it == latest.end()) {
+    return false;
+  }
+  response = it->second->response;
+  return true;
+}
+
+bool CacheWriter::pending(uint64_t hash) const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return latest.count(hash) != 0;
+}
+
+void CacheWriter::flush() {
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this] { return queue.empty() && !writing; });
+}
+
+void CacheWriter::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (queue.empty()) {
+      break; // stopping and nothing left
+    }
+    std::deque<std::shared_ptr<Entry> > batch;
+    batch.swap(queue);
+    writing = true;
+    lock.unlock();
+    for (auto& entry : batch) {
+      write_cache_entry(entry->hash, entry->request, entry->response,
+                        sync == Sync::ALWAYS);
+    }
+    if (sync == Sync::BATCH) {
+      int dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (dir >= 0) {
+        syncfs(dir);
+        close(dir);
+      }
+    }
+    lock.lock();
+    for (auto& entry : batch) {
+      queued_bytes -= entry->request.size() + entry->response.size();
+      auto it = latest.find(entry->hash);
+      // only forget it if it was not queued again meanwhile
+      if (it != latest.end() && it->second == entry) {
+        latest.erase(it);
+      }
+    }
+    writing = false;
+    if (queue.empty()) {
+      idle.notify_all();
+    }
+  }
+  writing = false;
+  idle.notify_all();
+}
@@ -0,0 +1,70 @@
+#ifndef CACHE_WRITER_H
+#define CACHE_WRITER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+// Write behind persistence of cache entries.  Requests only queue the entry;
+// a background thread writes the queue out in batches through temp files
+// renamed into place.  The queue is bounded in bytes, when the disk falls
+// behind new entries are shed (they are still in the hot tier, if any)
+// rather than making requests wait.  Queued entries are served from memory
+// until they are on disk.
+class CacheWriter {
+  public:
+    enum class Sync {
+      NONE,   // leave it to the kernel
+      BATCH,  // one syncfs after every batch
+      ALWAYS  // fsync every file before it is renamed into place
+    };
+
+    static bool parse_sync(const std::string& name, Sync& sync);
+
+    CacheWriter(std::size_t max_bytes, Sync sync);
+    ~CacheWriter(); // writes out what is queued
+
+    // false when the entry was shed; the thread is started by the first
+    // entry, so it is created after the daemon has forked
+    bool enqueue(uint64_t hash, const std::string& request,
+                 const std::string& response);
+
+    bool pending(uint64_t hash, std::string& response) const;
+    bool pending(uint64_t hash) const;
+
+    // wait until everything queued so far is written
+    void flush();
+
+  private:
+    CacheWriter(const CacheWriter&) = delete;
+    CacheWriter& operator=(const CacheWriter&) = delete;
+
+    struct Entry {
+      uint64_t hash;
+      std::string request;
+      std::string response;
+    };
+
+    void run();
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::size_t max_bytes;
+    Sync sync;
+    std::size_t queued_bytes;
+    bool writing;
+    bool stopping;
+    uint64_t shed;
+    std::deque<std::shared_ptr<Entry> > queue;
+    std::unordered_map<uint64_t, std::shared_ptr<Entry> > latest;
+    std::thread thread;
+};
+
+#endif
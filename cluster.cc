@@ -0,0 +1,223 @@
+#include "cluster.h"
+#include "cache_key.h"
+#include "cache_store.h"
+#include "http_caching_proxy.h"
+#include "memory_pool.h"
+#include "seastate.h"
+#include "timer_wheel.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+const std::string CLUSTER_PREFIX = "/_cluster/";
+
+void HashRing::add(const std::string& name, std::size_t node) {
+  for (int i = 0; i < VIRTUAL_NODES; ++i) {
+    std::ostringstream oss;
+    oss << name << '#' << i;
+    SeaState state;
+    points.push_back(std::make_pair(state.hash(oss.str()), node));
+  }
+  std::sort(points.begin(), points.end());
+}
+
+std::size_t HashRing::owner(uint64_t key) const {
+  auto it = std::lower_bound(points.begin(), points.end(),
+                             std::make_pair(key, std::size_t(0)));
+  if (it == points.end()) {
+    it = points.begin();
+  }
+  return it->second;
+}
+
+Cluster::Cluster(const std::vector<std::pair<std::string, std::string> >& list,
+                 const std::string& self, bool replicate) :
+  self_index(list.size()), replicate_entries(replicate) {
+  for (auto& p : list) {
+    Peer peer;
+    peer.host = p.first;
+    peer.port = p.second;
+    peer.name = p.first + ":" + p.second;
+    memset(&peer.addr, 0, sizeof(peer.addr));
+    peer.resolved = false;
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(p.first.c_str(), p.second.c_str(), &hints, &result) == 0 &&
+        result != nullptr) {
+      memcpy(&peer.addr, result->ai_addr, sizeof(peer.addr));
+      peer.resolved = true;
+      freeaddrinfo(result);
+    }
+    else {
+      logger(LOG, "cluster", "can't resolve peer " + peer.name, 0);
+    }
+    if (peer.name == self) {
+      self_index = peers.size();
+    }
+    ring.add(peer.name, peers.size());
+    peers.push_back(peer);
+  }
+}
+
+const Peer* Cluster::owner(uint64_t key) const {
+  if (ring.empty()) {
+    return nullptr;
+  }
+  std::size_t node = ring.owner(key);
+  return node == self_index ? nullptr : &peers[node];
+}
+
+int Cluster::connect(const Peer& peer, int hit,
+                     std::chrono::milliseconds timeout) const {
+  if (!peer.resolved) {
+    return -1;
+  }
+  int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0) {
+    logger(ERROR, "cluster", "socket", sock, hit);
+    return -1;
+  }
+  bool connected;
+  {
+    // gone before the close below, or it could shut down a reused fd
+    SocketDeadline deadline(sock, SHUT_RDWR, timeout);
+    connected = ::connect(sock, reinterpret_cast<const sockaddr*>(&peer.addr),
+                          sizeof(peer.addr)) == 0;
+  }
+  if (!connected) {
+    logger(LOG, "cluster", "can't connect to peer " + peer.name, sock, hit);
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+static bool send_all(int sock, const std::string& data) {
+  std::string::size_type sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(sock, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+bool Cluster::fetch(const Peer& peer, uint64_t key, std::string& response,
+                    int hit, std::chrono::milliseconds timeout) const {
+  int sock = connect(peer, hit, timeout);
+  if (sock < 0) {
+    return false;
+  }
+  std::string req = "GET " + CLUSTER_PREFIX + cache_key_name(key) +
+    " HTTP/1.0\r\n\r\n";
+  response.clear();
+  bool received = false;
+  {
+    SocketDeadline deadline(sock, SHUT_RDWR, timeout);
+    if (send_all(sock, req)) {
+      PooledBuffer buffer;
+      ssize_t n;
+      while ((n = recv(sock, buffer.data(), PooledBuffer::size(), 0)) > 0) {
+        response.append(buffer.data(), n);
+      }
+      // a close, not the deadline shutting the socket down, ends the reply
+      received = n == 0 && !deadline.expired();
+    }
+  }
+  close(sock);
+  // the owner answers with the stored response verbatim or a 404; anything
+  // short of a complete 2xx or 3xx is a miss, it would end up in the cache
+  int code = 0;
+  if (received && response.compare(0, 5, "HTTP/") == 0) {
+    std::istringstream status(response);
+    std::string version;
+    status >> version >> code;
+  }
+  bool found = code >= 200 && code < 400;
+  if (found) {
+    auto fields = parse_header_fields(response);
+    auto length = fields.find("content-length");
+    found = length == fields.end() ||
+      response.size() - body_offset(response) >=
+      std::strtoull(length->second.c_str(), nullptr, 10);
+  }
+  std::ostringstream oss;
+  oss << "peer " << peer.name << (found ? " hit " : " miss ")
+      << cache_key_name(key);
+  logger(LOG, "cluster", oss, 0, hit);
+  if (!found) {
+    response.clear();
+  }
+  return found;
+}
+
+void Cluster::push(const Peer& peer, uint64_t key, const std::string& response,
+                   int hit, std::chrono::milliseconds timeout) const {
+  int sock = connect(peer, hit, timeout);
+  if (sock < 0) {
+    return;
+  }
+  std::ostringstream req;
+  req << "POST " << CLUSTER_PREFIX << cache_key_name(key) << " HTTP/1.0\r\n"
+      << "Content-Length: " << response.size() << "\r\n\r\n";
+  {
+    SocketDeadline deadline(sock, SHUT_RDWR, timeout);
+    if (send_all(sock, req.str()) && send_all(sock, response)) {
+      shutdown(sock, SHUT_WR);
+      char ack[64];
+      while (recv(sock, ack, sizeof(ack), 0) > 0) {
+      }
+      logger(LOG, "cluster", "replicated " + cache_key_name(key) + " to " +
+             peer.name, sock, hit);
+    }
+  }
+  close(sock);
+}
+
+bool Cluster::is_peer(const sockaddr* addr) const {
+  in_addr ip;
+  if (addr->sa_family == AF_INET) {
+    ip = reinterpret_cast<const sockaddr_in*>(addr)->sin_addr;
+  }
+  else if (addr->sa_family == AF_INET6) {
+    const in6_addr& ip6 = reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr;
+    if (!IN6_IS_ADDR_V4MAPPED(&ip6)) {
+      return false;
+    }
+    memcpy(&ip, &ip6.s6_addr[12], sizeof(ip));
+  }
+  else {
+    return false;
+  }
+  for (std::size_t i = 0; i < peers.size(); ++i) {
+    const Peer& peer = peers[i];
+    if (i != self_index && peer.resolved &&
+        peer.addr.sin_addr.s_addr == ip.s_addr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_cluster_path(const std::string& path, uint64_t& key) {
+  if (path.compare(0, CLUSTER_PREFIX.size(), CLUSTER_PREFIX) != 0 ||
+      path.size() != CLUSTER_PREFIX.size() + 16) {
+    return false;
+  }
+  std::string hex = path.substr(CLUSTER_PREFIX.size());
+  char* end = nullptr;
+  key = std::strtoull(hex.c_str(), &end, 16);
+  return end != nullptr && *end == '\0';
+}
@@ -0,0 +1,81 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Peer to peer cache sharing between proxy nodes.  Every node is given the
+// same static peer list; a consistent hash ring over the SeaState key picks
+// the node that owns an entry.  On a local miss the owner is asked first
+// with
+//   GET /_cluster/<hash> HTTP/1.0
+// and answers with the stored response or a 404, never going upstream
+// itself; only a complete 2xx or 3xx answer counts as a hit.  With
+// replication on, entries fetched from a --dest are pushed to their owner
+// with
+//   POST /_cluster/<hash> HTTP/1.0 + Content-Length + the stored response
+// which a node accepts only from the addresses of its peers.
+
+extern const std::string CLUSTER_PREFIX;
+
+struct Peer {
+  std::string host;
+  std::string port;
+  std::string name; // host:port as given on the command line
+  sockaddr_in addr;
+  bool resolved;
+};
+
+class HashRing {
+  public:
+    static const int VIRTUAL_NODES = 64;
+
+    void add(const std::string& name, std::size_t node);
+    // index of the node owning key, ring must not be empty
+    std::size_t owner(uint64_t key) const;
+    bool empty() const { return points.empty(); }
+
+  private:
+    std::vector<std::pair<uint64_t, std::size_t> > points;
+};
+
+class Cluster {
+  public:
+    Cluster(const std::vector<std::pair<std::string, std::string> >& peers,
+            const std::string& self, bool replicate);
+
+    bool valid() const { return self_index < peers.size(); }
+    bool replicate() const { return replicate_entries; }
+
+    // owner of key, nullptr when that is this node
+    const Peer* owner(uint64_t key) const;
+
+    bool fetch(const Peer& peer, uint64_t key, std::string& response,
+               int hit, std::chrono::milliseconds timeout) const;
+
+    void push(const Peer& peer, uint64_t key, const std::string& response,
+              int hit, std::chrono::milliseconds timeout) const;
+
+    // addr is one of the other peers, the only senders replicas are taken
+    // from
+    bool is_peer(const sockaddr* addr) const;
+
+  private:
+    int connect(const Peer& peer, int hit,
+                std::chrono::milliseconds timeout) const;
+
+    std::vector<Peer> peers;
+    std::size_t self_index;
+    bool replicate_entries;
+    HashRing ring;
+};
+
+// parse the <hash> out of a /_cluster/<hash> path
+bool parse_cluster_path(const std::string& path, uint64_t& key);
+
+#endif
@@ -0,0 +1,105 @@
+#include "cuckoo_filter.h"
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdLLU;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53LLU;
+  return x ^ (x >> 33);
+}
+
+CuckooFilter::CuckooFilter(std::size_t capacity) :
+  mask(0), count(0), full(false), victim_state(0x2545f4914f6cdd1dLLU) {
+  std::size_t buckets = 1;
+  while (buckets * SLOTS_PER_BUCKET < capacity) {
+    buckets <<= 1;
+  }
+  mask = buckets - 1;
+  table.assign(buckets * SLOTS_PER_BUCKET, 0);
+}
+
+void CuckooFilter::locate(uint64_t key, Fingerprint& fp, std::size_t& i1,
+                          std::size_t& i2) const {
+  uint64_t h = mix(key);
+  fp = static_cast<Fingerprint>(h >> 48);
+  if (fp == 0) {
+    fp = 1; // 0 marks an empty slot
+  }
+  i1 = static_cast<std::size_t>(h) & mask;
+  i2 = alternate(i1, fp);
+}
+
+std::size_t CuckooFilter::alternate(std::size_t index, Fingerprint fp) const {
+  return (index ^ static_cast<std::size_t>(mix(fp))) & mask;
+}
+
+bool CuckooFilter::add_to_bucket(std::size_t index, Fingerprint fp) {
+  Fingerprint* bucket = &table[index * SLOTS_PER_BUCKET];
+  for (std::size_t i = 0; i < SLOTS_PER_BUCKET; ++i) {
+    if (bucket[i] == 0) {
+      bucket[i] = fp;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CuckooFilter::in_bucket(std::size_t index, Fingerprint fp) const {
+  const Fingerprint* bucket = &table[index * SLOTS_PER_BUCKET];
+  for (std::size_t i = 0; i < SLOTS_PER_BUCKET; ++i) {
+    if (bucket[i] == fp) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CuckooFilter::insert(uint64_t key) {
+  Fingerprint fp;
+  std::size_t i1, i2;
+  locate(key, fp, i1, i2);
+  std::lock_guard<std::mutex> lock(mutex);
+  if (full) {
+    return false;
+  }
+  if (in_bucket(i1, fp) || in_bucket(i2, fp)) {
+    return true;
+  }
+  if (add_to_bucket(i1, fp) || add_to_bucket(i2, fp)) {
+    ++count;
+    return true;
+  }
+  std::size_t index = (victim_state & 1) ? i1 : i2;
+  for (int kick = 0; kick < MAX_KICKS; ++kick) {
+    victim_state = mix(victim_state);
+    std::size_t slot = victim_state % SLOTS_PER_BUCKET;
+    std::swap(fp, table[index * SLOTS_PER_BUCKET + slot]);
+    index = alternate(index, fp);
+    if (add_to_bucket(index, fp)) {
+      ++count;
+      return true;
+    }
+  }
+  // the displaced fingerprint has nowhere to go: from now on every key
+  // might be present
+  full = true;
+  return false;
+}
+
+bool CuckooFilter::contains(uint64_t key) const {
+  Fingerprint fp;
+  std::size_t i1, i2;
+  locate(key, fp, i1, i2);
+  std::lock_guard<std::mutex> lock(mutex);
+  return full || in_bucket(i1, fp) || in_bucket(i2, fp);
+}
+
+std::size_t CuckooFilter::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return count;
+}
+
+bool CuckooFilter::overflowed() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return full;
+}
@@ -0,0 +1,46 @@
+#ifndef CUCKOO_FILTER_H
+#define CUCKOO_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Approximate set of cached keys, answers "definitely not cached" without
+// touching the filesystem.  A cuckoo filter rather than a Bloom filter for
+// the lower false positive rate in the same space.  Cache entries are never
+// removed, so keys aren't either: a key whose fingerprint is already in one
+// of its buckets isn't stored again.  If an insert ever fails the filter
+// stops answering negatively instead of producing false negatives.
+class CuckooFilter {
+  public:
+    static const std::size_t SLOTS_PER_BUCKET = 4;
+    static const int MAX_KICKS = 500;
+
+    explicit CuckooFilter(std::size_t capacity);
+
+    // false once the filter is full
+    bool insert(uint64_t key);
+    bool contains(uint64_t key) const;
+
+    std::size_t size() const;
+    bool overflowed() const;
+
+  private:
+    typedef uint16_t Fingerprint;
+
+    void locate(uint64_t key, Fingerprint& fp, std::size_t& i1,
+                std::size_t& i2) const;
+    std::size_t alternate(std::size_t index, Fingerprint fp) const;
+    bool add_to_bucket(std::size_t index, Fingerprint fp);
+    bool in_bucket(std::size_t index, Fingerprint fp) const;
+
+    mutable std::mutex mutex;
+    std::vector<Fingerprint> table;
+    std::size_t mask;
+    std::size_t count;
+    bool full;
+    uint64_t victim_state;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#include "dest_health.h"
+#include "http_caching_proxy.h"
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+
+constexpr double DestinationHealth::TRIP_ERROR_RATE;
+constexpr double DestinationHealth::ALPHA;
+
+static const char* breaker_name(DestinationHealth::Breaker b) {
+  switch (b) {
+  case DestinationHealth::Breaker::CLOSED: return "closed";
+  case DestinationHealth::Breaker::OPEN: return "open";
+  case DestinationHealth::Breaker::HALF_OPEN: return "half_open";
+  }
+  return "";
+}
+
+DestinationHealth::DestinationHealth(
+    const std::vector<std::pair<std::string, std::string> >& list,
+    std::chrono::milliseconds c) : cooldown(c) {
+  for (auto& dest : list) {
+    Dest d;
+    d.name = dest.first + ":" + dest.second;
+    d.latency_ms = 0;
+    d.error_rate = 0;
+    d.in_flight = 0;
+    d.consecutive_failures = 0;
+    d.samples = 0;
+    d.breaker = Breaker::CLOSED;
+    d.probing = false;
+    dests.push_back(d);
+  }
+}
+
+bool DestinationHealth::usable(const Dest& d, Clock::time_point now) const {
+  switch (d.breaker) {
+  case Breaker::CLOSED: return true;
+  case Breaker::OPEN: return now >= d.retry_at;
+  case Breaker::HALF_OPEN: return !d.probing;
+  }
+  return false;
+}
+
+// expected wait: latency grows with the queue in front of us and errors
+// cost a retry on the next destination
+double DestinationHealth::score(const Dest& d) const {
+  return (d.latency_ms + 1.0) * (1 + d.in_flight) * (1.0 + 20.0 * d.error_rate);
+}
+
+std::vector<std::size_t> DestinationHealth::order() {
+  static thread_local std::minstd_rand rng(std::random_device{}());
+  Clock::time_point now = Clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<std::size_t> candidates;
+  std::vector<std::size_t> rest;
+  for (std::size_t i = 0; i < dests.size(); ++i) {
+    (usable(dests[i], now) ? candidates : rest).push_back(i);
+  }
+  auto better = [this](std::size_t a, std::size_t b) {
+    return score(dests[a]) < score(dests[b]);
+  };
+  std::vector<std::size_t> result;
+  if (candidates.size() >= 2) {
+    std::size_t a = rng() % candidates.size();
+    std::size_t b = rng() % (candidates.size() - 1);
+    if (b >= a) {
+      ++b;
+    }
+    std::size_t first = better(candidates[b], candidates[a]) ? b : a;
+    result.push_back(candidates[first]);
+    candidates.erase(candidates.begin() + first);
+  }
+  std::stable_sort(candidates.begin(), candidates.end(), better);
+  result.insert(result.end(), candidates.begin(), candidates.end());
+  // broken destinations last, acquire() will normally skip them
+  result.insert(result.end(), rest.begin(), rest.end());
+  return result;
+}
+
+bool DestinationHealth::acquire(std::size_t i) {
+  Clock::time_point now = Clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  Dest& d = dests[i];
+  if (!usable(d, now)) {
+    return false;
+  }
+  if (d.breaker == Breaker::OPEN) {
+    d.breaker = Breaker::HALF_OPEN;
+  }
+  if (d.breaker == Breaker::HALF_OPEN) {
+    d.probing = true;
+  }
+  ++d.in_flight;
+  return true;
+}
+
+void DestinationHealth::release(std::size_t i, bool ok,
+                                std::chrono::microseconds latency) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Dest& d = dests[i];
+  --d.in_flight;
+  double ms = latency.count() / 1000.0;
+  d.latency_ms = d.samples == 0 ? ms : (1 - ALPHA) * d.latency_ms + ALPHA * ms;
+  d.error_rate = (1 - ALPHA) * d.error_rate + ALPHA * (ok ? 0.0 : 1.0);
+  ++d.samples;
+  d.consecutive_failures = ok ? 0 : d.consecutive_failures + 1;
+
+  Breaker before = d.breaker;
+  if (d.breaker == Breaker::HALF_OPEN) {
+    d.probing = false;
+    if (ok) {
+      d.breaker = Breaker::CLOSED;
+      d.error_rate = 0;
+    }
+    else {
+      d.breaker = Breaker::OPEN;
+      d.retry_at = Clock::now() + cooldown;
+    }
+  }
+  else if (d.breaker == Breaker::CLOSED && !ok &&
+           (d.consecutive_failures >= TRIP_FAILURES ||
+            (d.samples >= MIN_SAMPLES && d.error_rate > TRIP_ERROR_RATE))) {
+    d.breaker = Breaker::OPEN;
+    d.retry_at = Clock::now() + cooldown;
+  }
+  if (before != d.breaker) {
+    logger(LOG, "circuit breaker", d.name + " " + breaker_name(before) +
+           " -> " + breaker_name(d.breaker), 0);
+  }
+}
+
+std::string DestinationHealth::report() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::ostringstream oss;
+  oss << "[";
+  for (std::size_t i = 0; i < dests.size(); ++i) {
+    const Dest& d = dests[i];
+    oss << (i ? "," : "") << "{\"dest\":\"" << d.name << "\""
+        << ",\"latency_ms\":" << d.latency_ms
+        << ",\"error_rate\":" << d.error_rate
+        << ",\"in_flight\":" << d.in_flight
+        << ",\"breaker\":\"" << breaker_name(d.breaker) << "\"}";
+  }
+  oss << "]";
+  return oss.str();
+}
@@ -0,0 +1,58 @@
+#ifndef DEST_HEALTH_H
+#define DEST_HEALTH_H
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Health of every --dest: EWMA latency and error rate, requests in flight
+// and a circuit breaker.  order() picks the first destination with the
+// power of two choices over the usable ones and lists the rest best first;
+// acquire() refuses destinations whose breaker is open, letting a single
+// probe through once the cooldown has passed (half open).
+class DestinationHealth {
+  public:
+    enum class Breaker {CLOSED, OPEN, HALF_OPEN};
+
+    static const int TRIP_FAILURES = 5;     // consecutive failures
+    static const int MIN_SAMPLES = 10;      // before error_rate can trip
+    static constexpr double TRIP_ERROR_RATE = 0.5;
+    static constexpr double ALPHA = 0.2;    // EWMA weight of a new sample
+
+    DestinationHealth(const std::vector<std::pair<std::string, std::string> >& dests,
+                      std::chrono::milliseconds cooldown);
+
+    std::vector<std::size_t> order();
+    bool acquire(std::size_t dest);
+    void release(std::size_t dest, bool ok, std::chrono::microseconds latency);
+
+    // JSON array with the state of every destination
+    std::string report() const;
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Dest {
+      std::string name;
+      double latency_ms;
+      double error_rate;
+      int in_flight;
+      int consecutive_failures;
+      long samples;
+      Breaker breaker;
+      bool probing;
+      Clock::time_point retry_at;
+    };
+
+    bool usable(const Dest& d, Clock::time_point now) const;
+    double score(const Dest& d) const;
+
+    mutable std::mutex mutex;
+    std::vector<Dest> dests;
+    std::chrono::milliseconds cooldown;
+};
+
+#endif
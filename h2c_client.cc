@@ -0,0 +1,1107 @@
+#include "h2c_client.h"
+#include "cache_store.h"
+#include "timer_wheel.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <thread>
+
+enum FrameType : uint8_t {
+  DATA = 0x0, HEADERS = 0x1, PRIORITY = 0x2, RST_STREAM = 0x3, SETTINGS = 0x4,
+  PUSH_PROMISE = 0x5, PING = 0x6, GOAWAY = 0x7, WINDOW_UPDATE = 0x8,
+  CONTINUATION = 0x9
+};
+
+static const uint8_t END_STREAM = 0x1;
+static const uint8_t ACK = 0x1;
+static const uint8_t END_HEADERS = 0x4;
+static const uint8_t PADDED = 0x8;
+static const uint8_t PRIORITY_FLAG = 0x20;
+
+enum Setting : uint16_t {
+  HEADER_TABLE_SIZE = 0x1, ENABLE_PUSH = 0x2, MAX_CONCURRENT_STREAMS = 0x3,
+  INITIAL_WINDOW_SIZE = 0x4, MAX_FRAME_SIZE = 0x5, MAX_HEADER_LIST_SIZE = 0x6
+};
+
+enum ErrorCode : uint32_t {
+  NO_ERROR = 0x0, PROTOCOL_ERROR = 0x1, FLOW_CONTROL_ERROR = 0x3,
+  FRAME_SIZE_ERROR = 0x6, REFUSED_STREAM = 0x7, CANCEL = 0x8,
+  COMPRESSION_ERROR = 0x9
+};
+
+static const std::string PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static const std::size_t FRAME_HEADER = 9;
+
+// what we accept, the protocol's defaults apart from the windows
+static const uint32_t FRAME_SIZE = 16384;
+static const uint32_t TABLE_SIZE = 4096;
+static const uint32_t HEADER_LIST_SIZE = 64 << 10;
+static const int64_t STREAM_WINDOW = 1 << 20;
+static const int64_t CONNECTION_WINDOW = 16 << 20;
+
+static const int64_t DEFAULT_WINDOW = 65535;
+static const int64_t MAX_WINDOW = 0x7fffffff;
+static const uint32_t MAX_STREAM_ID = 0x7fffffff;
+
+// streams per connection when the peer sets no limit
+static const std::size_t MAX_STREAMS = 100;
+
+static const int WRITE_TIMEOUT_SECONDS = 10;
+
+// times a stream the peer refused is sent again
+static const int MAX_RETRIES = 3;
+
+typedef std::chrono::steady_clock Clock;
+
+static uint32_t get32(const char* p) {
+  const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+  return uint32_t(u[0]) << 24 | uint32_t(u[1]) << 16 | uint32_t(u[2]) << 8 |
+    u[3];
+}
+
+static void put32(std::string& out, uint32_t v) {
+  out += static_cast<char>(v >> 24);
+  out += static_cast<char>(v >> 16);
+  out += static_cast<char>(v >> 8);
+  out += static_cast<char>(v);
+}
+
+static void put_setting(std::string& out, uint16_t id, uint32_t value) {
+  out += static_cast<char>(id >> 8);
+  out += static_cast<char>(id);
+  put32(out, value);
+}
+
+struct H2Stream {
+  H2Stream() : id(0), status(0), headers_done(false), ended(false),
+               failed(false), refused(false), send_window(0), unacked(0) {}
+
+  uint32_t id;
+  int status;
+  HeaderList headers;
+  bool headers_done;
+  std::string data; // received, not yet read
+  bool ended;
+  bool failed;
+  bool refused; // the peer didn't process it, it may be sent again
+  int64_t send_window;
+  int64_t unacked; // read since the last WINDOW_UPDATE
+  std::condition_variable changed;
+};
+
+class H2Connection : public std::enable_shared_from_this<H2Connection> {
+  public:
+    explicit H2Connection(int sock);
+    ~H2Connection();
+
+    // preface and settings, then the reader thread
+    bool start(const std::string& name);
+
+    // HEADERS (and CONTINUATIONs) of a new stream, nullptr when the
+    // connection can't take one
+    std::shared_ptr<H2Stream> open(const HeaderList& headers, bool end_stream);
+
+    bool send_data(H2Stream& stream, const std::string& body,
+                   std::chrono::milliseconds timeout, bool& expired);
+
+    bool wait_headers(H2Stream& stream, std::chrono::milliseconds timeout,
+                      int& status, HeaderList& headers, bool& expired);
+
+    bool read(H2Stream& stream, std::chrono::milliseconds timeout,
+              std::string& data, bool& expired);
+
+    bool complete(const H2Stream& stream);
+
+    bool refused(const H2Stream& stream);
+
+    // forget the stream, resetting it if it isn't complete
+    void finish(H2Stream& stream);
+
+    // takes new streams
+    bool usable();
+
+    std::size_t max_streams() const { return peer_max_streams.load(); }
+
+    void close();
+
+  private:
+    H2Connection(const H2Connection&) = delete;
+    H2Connection& operator=(const H2Connection&) = delete;
+
+    void run();
+    bool read_exact(char* buffer, std::size_t length);
+    bool handle(uint8_t type, uint8_t flags, uint32_t id,
+                const std::string& payload);
+    bool handle_data(uint8_t flags, uint32_t id, const std::string& payload);
+    bool handle_headers(uint8_t flags, uint32_t id, const std::string& payload);
+    bool headers_complete();
+    bool handle_settings(uint8_t flags, const std::string& payload);
+    bool handle_window_update(uint32_t id, const std::string& payload);
+    bool write_frame(uint8_t type, uint8_t flags, uint32_t id,
+                     const char* payload, std::size_t length);
+    bool fail(uint32_t error);
+    void fail_streams(uint32_t above, bool refused);
+
+    template <typename Ready>
+    bool wait(std::unique_lock<std::mutex>& lock, std::condition_variable& cv,
+              std::chrono::milliseconds timeout, Ready ready);
+
+    int sock;
+    std::string name;
+
+    // socket writes and the encoder, taken before mutex when both are
+    std::mutex write_mutex;
+    HpackEncoder encoder;
+
+    // everything below
+    std::mutex mutex;
+    std::condition_variable window_changed;
+    std::map<uint32_t, std::shared_ptr<H2Stream> > streams;
+    uint32_t next_id;
+    bool dead;
+    bool going_away;
+    int64_t send_window;
+    int64_t peer_initial_window;
+    uint32_t peer_max_frame;
+    int64_t unacked;
+    std::atomic<std::size_t> peer_max_streams;
+
+    // reader thread only
+    HpackDecoder decoder;
+    uint32_t block_stream;
+    bool block_end_stream;
+    std::string block;
+    bool in_block;
+};
+
+H2Connection::H2Connection(int s) :
+  sock(s), next_id(1), dead(false), going_away(false),
+  send_window(DEFAULT_WINDOW), peer_initial_window(DEFAULT_WINDOW),
+  peer_max_frame(FRAME_SIZE), unacked(0), peer_max_streams(MAX_STREAMS),
+  decoder(TABLE_SIZE, HEADER_LIST_SIZE), block_stream(0),
+  block_end_stream(false), in_block(false) {}
+
+H2Connection::~H2Connection() {
+  ::close(sock);
+}
+
+bool H2Connection::start(const std::string& n) {
+  name = n;
+  std::string settings;
+  put_setting(settings, ENABLE_PUSH, 0);
+  put_setting(settings, INITIAL_WINDOW_SIZE, STREAM_WINDOW);
+  put_setting(settings, MAX_HEADER_LIST_SIZE, HEADER_LIST_SIZE);
+  std::string increment;
+  put32(increment, CONNECTION_WINDOW - DEFAULT_WINDOW);
+  {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    if (send(sock, PREFACE.data(), PREFACE.size(), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(PREFACE.size()) ||
+        !write_frame(SETTINGS, 0, 0, settings.data(), settings.size()) ||
+        !write_frame(WINDOW_UPDATE, 0, 0, increment.data(), increment.size())) {
+      return false;
+    }
+  }
+  std::shared_ptr<H2Connection> self = shared_from_this();
+  std::thread([self] { self->run(); }).detach();
+  return true;
+}
+
+void H2Connection::close() {
+  shutdown(sock, SHUT_RDWR);
+}
+
+bool H2Connection::usable() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return !dead && !going_away && next_id < MAX_STREAM_ID;
+}
+
+bool H2Connection::write_frame(uint8_t type, uint8_t flags, uint32_t id,
+                               const char* payload, std::size_t length) {
+  std::string frame;
+  frame.reserve(FRAME_HEADER + length);
+  frame += static_cast<char>(length >> 16);
+  frame += static_cast<char>(length >> 8);
+  frame += static_cast<char>(length);
+  frame += static_cast<char>(type);
+  frame += static_cast<char>(flags);
+  put32(frame, id);
+  frame.append(payload, length);
+  std::size_t done = 0;
+  while (done < frame.size()) {
+    ssize_t n = send(sock, frame.data() + done, frame.size() - done,
+                     MSG_NOSIGNAL);
+    if (n <= 0) {
+      logger(ERROR, "h2c", "send to " + name, sock);
+      shutdown(sock, SHUT_RDWR); // the reader fails the streams
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+template <typename Ready>
+bool H2Connection::wait(std::unique_lock<std::mutex>& lock,
+                        std::condition_variable& cv,
+                        std::chrono::milliseconds timeout, Ready ready) {
+  if (timeout.count() == 0) {
+    cv.wait(lock, ready);
+    return true;
+  }
+  return cv.wait_for(lock, timeout, ready);
+}
+
+std::shared_ptr<H2Stream> H2Connection::open(const HeaderList& headers,
+                                             bool end_stream) {
+  std::shared_ptr<H2Stream> stream = std::make_shared<H2Stream>();
+  // ids have to go out in order, so they are handed out under write_mutex
+  std::lock_guard<std::mutex> write_lock(write_mutex);
+  uint32_t max_frame;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (dead || going_away || next_id >= MAX_STREAM_ID) {
+      return nullptr;
+    }
+    stream->id = next_id;
+    next_id += 2;
+    stream->send_window = peer_initial_window;
+    streams[stream->id] = stream;
+    max_frame = peer_max_frame;
+  }
+  std::string block;
+  encoder.encode(headers, block);
+  std::size_t pos = 0;
+  do {
+    std::size_t n = std::min<std::size_t>(max_frame, block.size() - pos);
+    uint8_t flags = pos + n == block.size() ? END_HEADERS : 0;
+    if (pos == 0 && end_stream) {
+      flags |= END_STREAM;
+    }
+    if (!write_frame(pos == 0 ? HEADERS : CONTINUATION, flags, stream->id,
+                     block.data() + pos, n)) {
+      return nullptr;
+    }
+    pos += n;
+  } while (pos < block.size());
+  return stream;
+}
+
+bool H2Connection::send_data(H2Stream& stream, const std::string& body,
+                             std::chrono::milliseconds timeout,
+                             bool& expired) {
+  std::size_t pos = 0;
+  while (pos < body.size()) {
+    std::size_t n;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!wait(lock, window_changed, timeout, [&] {
+            return dead || stream.failed ||
+              (send_window > 0 && stream.send_window > 0);
+          })) {
+        expired = true;
+        return false;
+      }
+      if (dead || stream.failed) {
+        return false;
+      }
+      n = std::min<int64_t>(std::min<int64_t>(send_window, stream.send_window),
+                            std::min<std::size_t>(peer_max_frame,
+                                                  body.size() - pos));
+      send_window -= n;
+      stream.send_window -= n;
+    }
+    std::lock_guard<std::mutex> write_lock(write_mutex);
+    if (!write_frame(DATA, pos + n == body.size() ? END_STREAM : 0, stream.id,
+                     body.data() + pos, n)) {
+      return false;
+    }
+    pos += n;
+  }
+  return true;
+}
+
+bool H2Connection::wait_headers(H2Stream& stream,
+                                std::chrono::milliseconds timeout, int& status,
+                                HeaderList& headers, bool& expired) {
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!wait(lock, stream.changed, timeout,
+            [&] { return stream.headers_done || stream.failed; })) {
+    expired = true;
+    return false;
+  }
+  if (stream.failed) {
+    return false;
+  }
+  status = stream.status;
+  headers.swap(stream.headers);
+  return true;
+}
+
+bool H2Connection::read(H2Stream& stream, std::chrono::milliseconds timeout,
+                        std::string& data, bool& expired) {
+  uint32_t update = 0;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!wait(lock, stream.changed, timeout, [&] {
+          return !stream.data.empty() || stream.ended || stream.failed;
+        })) {
+      expired = true;
+      return false;
+    }
+    if (stream.data.empty()) {
+      return false;
+    }
+    data.clear();
+    data.swap(stream.data);
+    stream.unacked += data.size();
+    // top the stream's window up once half of it has been read
+    if (!stream.ended && stream.unacked >= STREAM_WINDOW / 2) {
+      update = stream.unacked;
+      stream.unacked = 0;
+    }
+  }
+  if (update > 0) {
+    std::string increment;
+    put32(increment, update);
+    std::lock_guard<std::mutex> write_lock(write_mutex);
+    write_frame(WINDOW_UPDATE, 0, stream.id, increment.data(),
+                increment.size());
+  }
+  return true;
+}
+
+bool H2Connection::complete(const H2Stream& stream) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stream.ended && !stream.failed && stream.data.empty();
+}
+
+bool H2Connection::refused(const H2Stream& stream) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return stream.refused;
+}
+
+void H2Connection::finish(H2Stream& stream) {
+  bool reset;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    reset = !dead && !stream.ended && !stream.failed;
+    streams.erase(stream.id);
+  }
+  if (reset) {
+    std::string error;
+    put32(error, CANCEL);
+    std::lock_guard<std::mutex> write_lock(write_mutex);
+    write_frame(RST_STREAM, 0, stream.id, error.data(), error.size());
+  }
+}
+
+bool H2Connection::read_exact(char* buffer, std::size_t length) {
+  std::size_t done = 0;
+  while (done < length) {
+    ssize_t n = recv(sock, buffer + done, length - done, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+void H2Connection::run() {
+  char header[FRAME_HEADER];
+  std::string payload;
+  while (read_exact(header, sizeof(header))) {
+    const unsigned char* h = reinterpret_cast<const unsigned char*>(header);
+    uint32_t length = uint32_t(h[0]) << 16 | uint32_t(h[1]) << 8 | h[2];
+    uint8_t type = h[3];
+    uint8_t flags = h[4];
+    uint32_t id = get32(header + 5) & MAX_STREAM_ID;
+    if (length > FRAME_SIZE) {
+      fail(FRAME_SIZE_ERROR);
+      break;
+    }
+    payload.resize(length);
+    if (length > 0 && !read_exact(&payload[0], length)) {
+      break;
+    }
+    // a header block may only be interrupted by its own CONTINUATIONs
+    if (in_block != (type == CONTINUATION) ||
+        (in_block && id != block_stream)) {
+      fail(PROTOCOL_ERROR);
+      break;
+    }
+    if (!handle(type, flags, id, payload)) {
+      break;
+    }
+  }
+  logger(LOG, "h2c", "connection to " + name + " closed", sock);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    dead = true;
+  }
+  fail_streams(0, false);
+  window_changed.notify_all();
+}
+
+// takes write_mutex, so never call it holding mutex
+bool H2Connection::fail(uint32_t error) {
+  std::ostringstream oss;
+  oss << "protocol error " << error << " from " << name;
+  logger(LOG, "h2c", oss, sock);
+  std::string goaway;
+  put32(goaway, 0);
+  put32(goaway, error);
+  std::lock_guard<std::mutex> write_lock(write_mutex);
+  write_frame(GOAWAY, 0, 0, goaway.data(), goaway.size());
+  shutdown(sock, SHUT_RDWR);
+  return false;
+}
+
+// fail the streams with ids above above, still waiting for their response
+void H2Connection::fail_streams(uint32_t above, bool refused) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& entry : streams) {
+    H2Stream& stream = *entry.second;
+    if (entry.first > above && !stream.ended) {
+      stream.failed = true;
+      stream.refused = refused;
+      stream.changed.notify_all();
+    }
+  }
+}
+
+bool H2Connection::handle(uint8_t type, uint8_t flags, uint32_t id,
+                          const std::string& payload) {
+  switch (type) {
+  case DATA:
+    return handle_data(flags, id, payload);
+  case HEADERS:
+  case CONTINUATION:
+    return handle_headers(flags, id, payload);
+  case RST_STREAM: {
+    if (id == 0 || payload.size() != 4) {
+      return fail(PROTOCOL_ERROR);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = streams.find(id);
+    if (it != streams.end()) {
+      it->second->failed = true;
+      it->second->refused = get32(payload.data()) == REFUSED_STREAM;
+      it->second->changed.notify_all();
+    }
+    window_changed.notify_all();
+    return true;
+  }
+  case SETTINGS:
+    return handle_settings(flags, payload);
+  case PUSH_PROMISE:
+    return fail(PROTOCOL_ERROR); // we sent ENABLE_PUSH 0
+  case PING: {
+    if (payload.size() != 8) {
+      return fail(FRAME_SIZE_ERROR);
+    }
+    if ((flags & ACK) != 0) {
+      return true;
+    }
+    std::lock_guard<std::mutex> write_lock(write_mutex);
+    return write_frame(PING, ACK, 0, payload.data(), payload.size());
+  }
+  case GOAWAY: {
+    if (payload.size() < 8) {
+      return fail(FRAME_SIZE_ERROR);
+    }
+    uint32_t last = get32(payload.data()) & MAX_STREAM_ID;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      going_away = true;
+    }
+    std::ostringstream oss;
+    oss << "GOAWAY from " << name << ", last stream " << last << " error "
+        << get32(payload.data() + 4);
+    logger(LOG, "h2c", oss, sock);
+    // streams the peer never saw can go elsewhere
+    fail_streams(last, true);
+    return true;
+  }
+  case WINDOW_UPDATE:
+    return handle_window_update(id, payload);
+  default:
+    return true; // PRIORITY and unknown types are ignored
+  }
+}
+
+bool H2Connection::handle_data(uint8_t flags, uint32_t id,
+                               const std::string& payload) {
+  if (id == 0) {
+    return fail(PROTOCOL_ERROR);
+  }
+  std::size_t start = 0;
+  std::size_t length = payload.size();
+  if ((flags & PADDED) != 0) {
+    std::size_t pad = payload.empty() ? 0 :
+      static_cast<unsigned char>(payload[0]);
+    if (payload.empty() || pad >= payload.size()) {
+      return fail(PROTOCOL_ERROR);
+    }
+    start = 1;
+    length -= 1 + pad;
+  }
+  uint32_t update = 0;
+  bool overflow;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // the whole frame counts against the windows, padding included
+    unacked += payload.size();
+    overflow = unacked > CONNECTION_WINDOW;
+    if (!overflow && unacked >= CONNECTION_WINDOW / 2) {
+      update = unacked;
+      unacked = 0;
+    }
+    auto it = streams.find(id);
+    if (!overflow && it != streams.end() && !it->second->ended &&
+        !it->second->failed) {
+      H2Stream& stream = *it->second;
+      stream.data.append(payload, start, length);
+      stream.unacked += payload.size() - length;
+      // buffered and read since the last WINDOW_UPDATE is what we granted
+      overflow = int64_t(stream.data.size()) + stream.unacked > STREAM_WINDOW;
+      if ((flags & END_STREAM) != 0) {
+        stream.ended = true;
+      }
+      stream.changed.notify_all();
+    }
+  }
+  if (overflow) {
+    return fail(FLOW_CONTROL_ERROR);
+  }
+  if (update > 0) {
+    std::string increment;
+    put32(increment, update);
+    std::lock_guard<std::mutex> write_lock(write_mutex);
+    return write_frame(WINDOW_UPDATE, 0, 0, increment.data(),
+                       increment.size());
+  }
+  return true;
+}
+
+// HEADERS, or a CONTINUATION of the block run() let through, which has
+// neither padding nor priority fields
+bool H2Connection::handle_headers(uint8_t flags, uint32_t id,
+                                  const std::string& payload) {
+  if (id == 0) {
+    return fail(PROTOCOL_ERROR);
+  }
+  if (in_block) {
+    block += payload;
+  }
+  else {
+    std::size_t start = 0;
+    std::size_t end = payload.size();
+    if ((flags & PADDED) != 0) {
+      std::size_t pad = payload.empty() ? 0 :
+        static_cast<unsigned char>(payload[0]);
+      start = 1;
+      if (payload.empty() || start + pad > end) {
+        return fail(PROTOCOL_ERROR);
+      }
+      end -= pad;
+    }
+    if ((flags & PRIORITY_FLAG) != 0) {
+      start += 5;
+    }
+    if (start > end) {
+      return fail(PROTOCOL_ERROR);
+    }
+    block.assign(payload, start, end - start);
+    block_stream = id;
+    block_end_stream = (flags & END_STREAM) != 0;
+    in_block = true;
+  }
+  if (block.size() > HEADER_LIST_SIZE) {
+    return fail(PROTOCOL_ERROR);
+  }
+  return (flags & END_HEADERS) == 0 || headers_complete();
+}
+
+bool H2Connection::headers_complete() {
+  in_block = false;
+  HeaderList headers;
+  // decoded even for streams we dropped, the table has to stay in step
+  if (!decoder.decode(block, headers)) {
+    return fail(COMPRESSION_ERROR);
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = streams.find(block_stream);
+  if (it == streams.end() || it->second->failed) {
+    return true;
+  }
+  H2Stream& stream = *it->second;
+  if (!stream.headers_done) {
+    int status = 0;
+    HeaderList fields;
+    for (auto& header : headers) {
+      if (header.first == ":status") {
+        status = std::atoi(header.second.c_str());
+      }
+      else if (header.first.empty() || header.first[0] != ':') {
+        fields.push_back(header);
+      }
+    }
+    if (status < 100 || status > 999) {
+      stream.failed = true;
+    }
+    else if (status >= 200) {
+      stream.status = status;
+      stream.headers.swap(fields);
+      stream.headers_done = true;
+    }
+    // 1xx: an interim response, the final one follows
+  }
+  // trailers after the body are dropped
+  if (block_end_stream) {
+    stream.ended = true;
+    stream.failed = stream.failed || !stream.headers_done;
+  }
+  stream.changed.notify_all();
+  return true;
+}
+
+bool H2Connection::handle_settings(uint8_t flags, const std::string& payload) {
+  if ((flags & ACK) != 0) {
+    return true;
+  }
+  if (payload.size() % 6 != 0) {
+    return fail(FRAME_SIZE_ERROR);
+  }
+  for (std::size_t i = 0; i < payload.size(); i += 6) {
+    uint16_t id = uint16_t(static_cast<unsigned char>(payload[i])) << 8 |
+      static_cast<unsigned char>(payload[i + 1]);
+    uint32_t value = get32(payload.data() + i + 2);
+    if (id == HEADER_TABLE_SIZE) {
+      std::lock_guard<std::mutex> write_lock(write_mutex);
+      encoder.set_max_table_size(value);
+    }
+    else if (id == MAX_CONCURRENT_STREAMS) {
+      peer_max_streams = std::min<std::size_t>(value, MAX_STREAMS);
+    }
+    else if (id == INITIAL_WINDOW_SIZE) {
+      if (value > MAX_WINDOW) {
+        return fail(FLOW_CONTROL_ERROR);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      int64_t delta = int64_t(value) - peer_initial_window;
+      peer_initial_window = value;
+      for (auto& entry : streams) {
+        entry.second->send_window += delta;
+      }
+      window_changed.notify_all();
+    }
+    else if (id == MAX_FRAME_SIZE) {
+      if (value < 16384 || value > 16777215) {
+        return fail(PROTOCOL_ERROR);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      peer_max_frame = value;
+    }
+  }
+  std::lock_guard<std::mutex> write_lock(write_mutex);
+  return write_frame(SETTINGS, ACK, 0, nullptr, 0);
+}
+
+bool H2Connection::handle_window_update(uint32_t id,
+                                        const std::string& payload) {
+  if (payload.size() != 4) {
+    return fail(FRAME_SIZE_ERROR);
+  }
+  int64_t increment = get32(payload.data()) & MAX_STREAM_ID;
+  if (id == 0 && increment == 0) {
+    return fail(PROTOCOL_ERROR);
+  }
+  bool overflow = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (id == 0) {
+      send_window += increment;
+      overflow = send_window > MAX_WINDOW;
+    }
+    else {
+      auto it = streams.find(id);
+      if (it != streams.end()) {
+        it->second->send_window += increment;
+      }
+    }
+    window_changed.notify_all();
+  }
+  return overflow ? fail(FLOW_CONTROL_ERROR) : true;
+}
+
+H2cClient::H2cClient(const std::string& h, const std::string& p,
+                     std::size_t max) :
+  host(h), port(p), name(h + ":" + p), max_connections(std::max<std::size_t>(max, 1)),
+  connecting(0) {}
+
+std::shared_ptr<H2Connection>
+H2cClient::connect(std::chrono::milliseconds timeout) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* result = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0 ||
+      result == nullptr) {
+    logger(ERROR, "h2c", "can't resolve " + name, 0);
+    return nullptr;
+  }
+  int sock = socket(result->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool connected = false;
+  if (sock >= 0) {
+    SocketDeadline deadline(sock, SHUT_RDWR, timeout);
+    connected = ::connect(sock, result->ai_addr, result->ai_addrlen) == 0 &&
+      !deadline.expired();
+  }
+  freeaddrinfo(result);
+  if (!connected) {
+    logger(ERROR, "h2c", "can't connect to " + name, sock);
+    if (sock >= 0) {
+      ::close(sock);
+    }
+    return nullptr;
+  }
+  int one = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // a peer that stops reading must not hold the writers forever
+  timeval write_timeout = {WRITE_TIMEOUT_SECONDS, 0};
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &write_timeout,
+             sizeof(write_timeout));
+  std::shared_ptr<H2Connection> connection =
+    std::make_shared<H2Connection>(sock);
+  if (!connection->start(name)) {
+    return nullptr;
+  }
+  logger(LOG, "h2c", "connected to " + name, sock);
+  return connection;
+}
+
+// connections that died or are going away leave once their streams are done
+void H2cClient::prune() {
+  for (auto it = slots.begin(); it != slots.end();) {
+    if (it->active == 0 && !it->connection->usable()) {
+      it->connection->close();
+      it = slots.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+bool H2cClient::open(Exchange& exchange, std::chrono::milliseconds timeout) {
+  Clock::time_point deadline = Clock::now() + timeout;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    prune();
+    Slot* best = nullptr;
+    for (auto& slot : slots) {
+      if (slot.active < slot.connection->max_streams() &&
+          slot.connection->usable() &&
+          (best == nullptr || slot.active < best->active)) {
+        best = &slot;
+      }
+    }
+    if (best != nullptr) {
+      ++best->active;
+      exchange.client = this;
+      exchange.connection = best->connection;
+      return true;
+    }
+    if (slots.size() + connecting < max_connections) {
+      ++connecting;
+      lock.unlock();
+      std::shared_ptr<H2Connection> connection = connect(timeout);
+      lock.lock();
+      --connecting;
+      if (!connection) {
+        freed.notify_all();
+        return false;
+      }
+      slots.push_back(Slot{connection, 0});
+      freed.notify_all(); // the threads that waited for it
+      continue;
+    }
+    // every connection is at its stream limit: wait for a stream to end
+    if (timeout.count() == 0) {
+      freed.wait(lock);
+    }
+    else if (freed.wait_until(lock, deadline) == std::cv_status::timeout) {
+      exchange.expired = true;
+      return false;
+    }
+  }
+}
+
+void H2cClient::release(const std::shared_ptr<H2Connection>& connection) {
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto& slot : slots) {
+    if (slot.connection == connection) {
+      --slot.active;
+      break;
+    }
+  }
+  prune();
+  freed.notify_all();
+}
+
+H2cClient::Exchange::~Exchange() {
+  if (stream) {
+    connection->finish(*stream);
+  }
+  if (client != nullptr) {
+    client->release(connection);
+  }
+}
+
+bool H2cClient::Exchange::send(const HeaderList& headers,
+                               const std::string& body,
+                               std::chrono::milliseconds timeout) {
+  if (!connection || stream) {
+    return false;
+  }
+  // kept to send again should the peer refuse the stream
+  request_headers = headers;
+  request_body = body;
+  stream = connection->open(headers, body.empty());
+  return stream && (body.empty() ||
+                    connection->send_data(*stream, body, timeout, expired));
+}
+
+bool H2cClient::Exchange::response(int& status, HeaderList& headers,
+                                   std::chrono::milliseconds timeout) {
+  while (stream) {
+    if (connection->wait_headers(*stream, timeout, status, headers, expired)) {
+      return true;
+    }
+    // refused before the peer saw its settings, or beyond its GOAWAY
+    if (expired || !connection->refused(*stream) || ++retries > MAX_RETRIES) {
+      return false;
+    }
+    connection->finish(*stream);
+    stream.reset();
+    H2cClient* c = client;
+    client = nullptr;
+    c->release(connection);
+    connection.reset();
+    if (!c->open(*this, timeout) ||
+        !send(request_headers, request_body, timeout)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool H2cClient::Exchange::read(std::string& data,
+                               std::chrono::milliseconds timeout) {
+  return stream && connection->read(*stream, timeout, data, expired);
+}
+
+bool H2cClient::Exchange::complete() const {
+  return stream && connection->complete(*stream);
+}
+
+static std::string lower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return s;
+}
+
+static std::string trim(const std::string& s) {
+  auto begin = s.find_first_not_of(" \t\r");
+  auto end = s.find_last_not_of(" \t\r");
+  return begin == std::string::npos ? std::string() :
+    s.substr(begin, end - begin + 1);
+}
+
+bool h2_request(const std::string& request, const std::string& authority,
+                HeaderList& headers, std::string& body) {
+  std::size_t end = request.find("\r\n\r\n");
+  std::size_t body_start = end + 4;
+  if (end == std::string::npos) {
+    end = request.find("\n\n");
+    body_start = end + 2;
+  }
+  if (end == std::string::npos) {
+    return false;
+  }
+  std::istringstream lines(request.substr(0, end));
+  std::string line;
+  std::getline(lines, line);
+  std::istringstream request_line(line);
+  std::string method;
+  std::string target;
+  if (!(request_line >> method >> target)) {
+    return false;
+  }
+  std::string host = authority;
+  // absolute form, as a client configured to use us as a proxy sends it,
+  // takes precedence over Host
+  bool absolute = target.compare(0, 7, "http://") == 0;
+  if (absolute) {
+    std::size_t slash = target.find('/', 7);
+    host = target.substr(7, slash == std::string::npos ? slash : slash - 7);
+    target = slash == std::string::npos ? "/" : target.substr(slash);
+  }
+  HeaderList fields;
+  std::vector<std::string> hop_by_hop = {"connection", "keep-alive",
+    "proxy-connection", "transfer-encoding", "upgrade", "http2-settings",
+    "host"};
+  bool chunked = false;
+  while (std::getline(lines, line)) {
+    auto colon = line.find(':');
+    if (colon == std::string::npos) {
+      continue;
+    }
+    std::string field = lower(trim(line.substr(0, colon)));
+    std::string value = trim(line.substr(colon + 1));
+    if (field == "host" && !absolute) {
+      host = value;
+    }
+    else if (field == "transfer-encoding") {
+      chunked = lower(value).find("chunked") != std::string::npos;
+    }
+    else if (field == "connection") {
+      std::istringstream tokens(value);
+      std::string token;
+      while (std::getline(tokens, token, ',')) {
+        hop_by_hop.push_back(lower(trim(token)));
+      }
+    }
+    else if (field == "te" && lower(value) != "trailers") {
+      continue;
+    }
+    fields.push_back(std::make_pair(field, value));
+  }
+  headers.clear();
+  headers.push_back(std::make_pair(":method", method));
+  headers.push_back(std::make_pair(":scheme", "http"));
+  headers.push_back(std::make_pair(":authority", host));
+  headers.push_back(std::make_pair(":path", target));
+  for (auto& field : fields) {
+    if (std::find(hop_by_hop.begin(), hop_by_hop.end(), field.first) ==
+        hop_by_hop.end()) {
+      headers.push_back(field);
+    }
+  }
+  body.clear();
+  if (chunked) {
+    return dechunk_body(request.substr(body_start), body);
+  }
+  body = request.substr(body_start);
+  return true;
+}
+
+static const char* reason(int status) {
+  switch (status) {
+  case 200: return "OK";
+  case 201: return "Created";
+  case 202: return "Accepted";
+  case 204: return "No Content";
+  case 206: return "Partial Content";
+  case 301: return "Moved Permanently";
+  case 302: return "Found";
+  case 303: return "See Other";
+  case 304: return "Not Modified";
+  case 307: return "Temporary Redirect";
+  case 308: return "Permanent Redirect";
+  case 400: return "Bad Request";
+  case 401: return "Unauthorized";
+  case 403: return "Forbidden";
+  case 404: return "Not Found";
+  case 405: return "Method Not Allowed";
+  case 408: return "Request Timeout";
+  case 409: return "Conflict";
+  case 410: return "Gone";
+  case 429: return "Too Many Requests";
+  case 500: return "Internal Server Error";
+  case 501: return "Not Implemented";
+  case 502: return "Bad Gateway";
+  case 503: return "Service Unavailable";
+  case 504: return "Gateway Timeout";
+  }
+  return "Unknown";
+}
+
+// h2 field names are lower case, HTTP/1.1 clients are used to Content-Type
+static std::string capitalize(std::string name) {
+  bool start = true;
+  for (auto& c : name) {
+    if (start) {
+      c = std::toupper(static_cast<unsigned char>(c));
+    }
+    start = c == '-';
+  }
+  return name;
+}
+
+std::string h1_response_head(int status, const HeaderList& headers,
+                             long long length) {
+  std::ostringstream head;
+  head << "HTTP/1.1 " << status << " " << reason(status) << "\r\n";
+  for (auto& header : headers) {
+    if (length >= 0 && header.first == "content-length") {
+      continue;
+    }
+    head << capitalize(header.first) << ": " << header.second << "\r\n";
+  }
+  if (length >= 0) {
+    head << "Content-Length: " << length << "\r\n";
+  }
+  head << "\r\n";
+  return head.str();
+}
+
+bool h2c_fetch(H2cClient& client, const std::string& request,
+               std::string& response, const Timeouts& timeouts,
+               bool& timed_out) {
+  H2cClient::Exchange exchange;
+  HeaderList headers;
+  std::string body;
+  int status = 0;
+  HeaderList fields;
+  response.clear();
+  timed_out = false;
+  if (!h2_request(request, client.authority(), headers, body) ||
+      !client.open(exchange, timeouts.connect) ||
+      !exchange.send(headers, body, timeouts.request) ||
+      !exchange.response(status, fields, timeouts.first_byte)) {
+    timed_out = exchange.timed_out();
+    return false;
+  }
+  std::string content;
+  std::string data;
+  while (exchange.read(data, timeouts.idle)) {
+    content += data;
+  }
+  if (!exchange.complete()) {
+    timed_out = exchange.timed_out();
+    return false;
+  }
+  response = h1_response_head(status, fields, content.size()) + content;
+  return true;
+}
@@ -0,0 +1,112 @@
+#ifndef H2C_CLIENT_H
+#define H2C_CLIENT_H
+
+#include "hpack.h"
+#include "http_caching_proxy.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Cleartext HTTP/2 with prior knowledge (h2c) to one --dest h2c://host:port.
+// Requests are multiplexed as streams over at most max_connections
+// connections, opened on first use; a thread per connection reads its
+// frames and hands every stream its headers and body.  Flow control runs
+// both ways: a request body waits for the peer's windows, and the windows
+// we grant are topped up as each stream's reader consumes its data.
+
+class H2Connection;
+struct H2Stream;
+
+class H2cClient {
+  public:
+    H2cClient(const std::string& host, const std::string& port,
+              std::size_t max_connections);
+
+    const std::string& authority() const { return name; }
+
+    // One request and its response on a stream.  Destroying it before the
+    // response is complete resets the stream.  A timeout of 0 waits forever.
+    class Exchange {
+      public:
+        Exchange() : client(nullptr), expired(false), retries(0) {}
+        ~Exchange();
+
+        bool send(const HeaderList& headers, const std::string& body,
+                  std::chrono::milliseconds timeout);
+
+        // waits for the final (non 1xx) response headers, sending the
+        // request again if the peer refused the stream unprocessed
+        bool response(int& status, HeaderList& headers,
+                      std::chrono::milliseconds timeout);
+
+        // the next piece of the body, false at its end or on an error
+        bool read(std::string& data, std::chrono::milliseconds timeout);
+
+        // the whole body arrived
+        bool complete() const;
+
+        bool timed_out() const { return expired; }
+
+      private:
+        friend class H2cClient;
+        Exchange(const Exchange&) = delete;
+        Exchange& operator=(const Exchange&) = delete;
+
+        H2cClient* client;
+        std::shared_ptr<H2Connection> connection;
+        std::shared_ptr<H2Stream> stream;
+        bool expired;
+        int retries;
+        HeaderList request_headers;
+        std::string request_body;
+    };
+
+    // a stream slot on the least loaded connection, opening a connection
+    // when all are full and fewer than max_connections are open
+    bool open(Exchange& exchange, std::chrono::milliseconds timeout);
+
+  private:
+    H2cClient(const H2cClient&) = delete;
+    H2cClient& operator=(const H2cClient&) = delete;
+
+    struct Slot {
+      std::shared_ptr<H2Connection> connection;
+      std::size_t active;
+    };
+
+    std::shared_ptr<H2Connection> connect(std::chrono::milliseconds timeout);
+    void release(const std::shared_ptr<H2Connection>& connection);
+    void prune();
+
+    const std::string host;
+    const std::string port;
+    const std::string name;
+    const std::size_t max_connections;
+    std::mutex mutex;
+    std::condition_variable freed;
+    std::vector<Slot> slots;
+    std::size_t connecting;
+};
+
+// an HTTP/1.1 request as the header list and body of an h2 request;
+// authority stands in for a missing Host
+bool h2_request(const std::string& request, const std::string& authority,
+                HeaderList& headers, std::string& body);
+
+// the head of an h2 response as HTTP/1.1; length >= 0 replaces the
+// Content-Length the response came with
+std::string h1_response_head(int status, const HeaderList& headers,
+                             long long length);
+
+// a whole exchange for callers that don't stream: an HTTP/1.1 request in,
+// the complete HTTP/1.1 response out
+bool h2c_fetch(H2cClient& client, const std::string& request,
+               std::string& response, const Timeouts& timeouts,
+               bool& timed_out);
+
+#endif
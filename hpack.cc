@@ -0,0 +1,356 @@
+#include "hpack.h"
+
+#include <algorithm>
+#include <cstdint>
+
+static const std::size_t ENTRY_OVERHEAD = 32;
+
+static const struct {
+  const char* name;
+  const char* value;
+} STATIC_TABLE[] = {
+  {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+  {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+  {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+  {":status", "206"}, {":status", "304"}, {":status", "400"},
+  {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+  {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+  {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+  {"content-disposition", ""}, {"content-encoding", ""},
+  {"content-language", ""}, {"content-length", ""}, {"content-location", ""},
+  {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+  {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+  {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+  {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+  {"link", ""}, {"location", ""}, {"max-forwards", ""},
+  {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+  {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+  {"set-cookie", ""}, {"strict-transport-security", ""},
+  {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+  {"www-authenticate", ""},
+};
+
+static const std::size_t STATIC_ENTRIES =
+  sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+// code lengths of the Huffman code of RFC 7541 appendix B, symbols 0-256;
+// the code is canonical, so the codes themselves follow from the lengths
+static const unsigned char HUFFMAN_LENGTHS[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+
+static const unsigned MAX_CODE_LENGTH = 30;
+
+static const unsigned EOS = 256;
+
+namespace {
+
+// for every length, the first code of that length and where its symbols
+// start in symbols[], which is sorted by length then symbol
+struct HuffmanCode {
+  HuffmanCode() {
+    unsigned count[MAX_CODE_LENGTH + 1] = {0};
+    for (unsigned s = 0; s <= EOS; ++s) {
+      ++count[HUFFMAN_LENGTHS[s]];
+    }
+    uint32_t code = 0;
+    unsigned index = 0;
+    for (unsigned length = 1; length <= MAX_CODE_LENGTH; ++length) {
+      first_code[length] = code;
+      first_index[length] = index;
+      counts[length] = count[length];
+      code = (code + count[length]) << 1;
+      index += count[length];
+    }
+    unsigned next[MAX_CODE_LENGTH + 1];
+    for (unsigned length = 1; length <= MAX_CODE_LENGTH; ++length) {
+      next[length] = first_index[length];
+    }
+    for (unsigned s = 0; s <= EOS; ++s) {
+      symbols[next[HUFFMAN_LENGTHS[s]]++] = s;
+    }
+  }
+
+  uint32_t first_code[MAX_CODE_LENGTH + 1];
+  unsigned first_index[MAX_CODE_LENGTH + 1];
+  unsigned counts[MAX_CODE_LENGTH + 1];
+  uint16_t symbols[EOS + 1];
+};
+
+const HuffmanCode& huffman_code() {
+  static const HuffmanCode code;
+  return code;
+}
+
+void encode_integer(std::string& out, unsigned char flags, unsigned prefix,
+                    std::size_t value) {
+  std::size_t max = (1u << prefix) - 1;
+  if (value < max) {
+    out += static_cast<char>(flags | value);
+    return;
+  }
+  out += static_cast<char>(flags | max);
+  value -= max;
+  while (value >= 128) {
+    out += static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out += static_cast<char>(value);
+}
+
+bool decode_integer(const std::string& in, std::size_t& pos, unsigned prefix,
+                    std::size_t& value) {
+  if (pos >= in.size()) {
+    return false;
+  }
+  std::size_t max = (1u << prefix) - 1;
+  value = static_cast<unsigned char>(in[pos++]) & max;
+  if (value < max) {
+    return true;
+  }
+  for (unsigned shift = 0; pos < in.size() && shift < 28; shift += 7) {
+    unsigned char b = in[pos++];
+    value += std::size_t(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void encode_string(std::string& out, const std::string& s) {
+  encode_integer(out, 0, 7, s.size());
+  out += s;
+}
+
+bool decode_string(const std::string& in, std::size_t& pos, std::string& s) {
+  if (pos >= in.size()) {
+    return false;
+  }
+  bool huffman = (in[pos] & 0x80) != 0;
+  std::size_t length;
+  if (!decode_integer(in, pos, 7, length) || length > in.size() - pos) {
+    return false;
+  }
+  s.clear();
+  bool ok = huffman ? huffman_decode(in.data() + pos, length, s) :
+    (s.assign(in, pos, length), true);
+  pos += length;
+  return ok;
+}
+
+// never put credentials in the table, where a later request could probe them
+bool sensitive(const std::string& name) {
+  return name == "authorization" || name == "proxy-authorization" ||
+    name == "cookie" || name == "set-cookie";
+}
+
+}
+
+bool huffman_decode(const char* data, std::size_t length, std::string& out) {
+  const HuffmanCode& huffman = huffman_code();
+  uint32_t code = 0;
+  unsigned bits = 0;
+  for (std::size_t i = 0; i < length; ++i) {
+    unsigned char byte = data[i];
+    for (int bit = 7; bit >= 0; --bit) {
+      code = (code << 1) | ((byte >> bit) & 1);
+      ++bits;
+      uint32_t offset = code - huffman.first_code[bits];
+      if (code >= huffman.first_code[bits] && offset < huffman.counts[bits]) {
+        unsigned symbol = huffman.symbols[huffman.first_index[bits] + offset];
+        if (symbol == EOS) {
+          return false;
+        }
+        out += static_cast<char>(symbol);
+        code = 0;
+        bits = 0;
+      }
+      else if (bits == MAX_CODE_LENGTH) {
+        return false;
+      }
+    }
+  }
+  // what is left must be padding: fewer than 8 bits, all ones
+  return bits < 8 && code == (1u << bits) - 1;
+}
+
+HpackTable::HpackTable(std::size_t max) : size(0), limit(max) {}
+
+bool HpackTable::get(std::size_t index, std::string& name,
+                     std::string& value) const {
+  if (index == 0) {
+    return false;
+  }
+  if (index <= STATIC_ENTRIES) {
+    name = STATIC_TABLE[index - 1].name;
+    value = STATIC_TABLE[index - 1].value;
+    return true;
+  }
+  index -= STATIC_ENTRIES + 1;
+  if (index >= entries.size()) {
+    return false;
+  }
+  name = entries[index].first;
+  value = entries[index].second;
+  return true;
+}
+
+std::size_t HpackTable::find(const std::string& name, const std::string& value,
+                             bool& exact) const {
+  std::size_t named = 0;
+  exact = false;
+  for (std::size_t i = 0; i < STATIC_ENTRIES; ++i) {
+    if (name == STATIC_TABLE[i].name) {
+      if (value == STATIC_TABLE[i].value) {
+        exact = true;
+        return i + 1;
+      }
+      if (named == 0) {
+        named = i + 1;
+      }
+    }
+  }
+  for (std::size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].first == name) {
+      if (entries[i].second == value) {
+        exact = true;
+        return STATIC_ENTRIES + i + 1;
+      }
+      if (named == 0) {
+        named = STATIC_ENTRIES + i + 1;
+      }
+    }
+  }
+  return named;
+}
+
+void HpackTable::add(const std::string& name, const std::string& value) {
+  std::size_t entry = name.size() + value.size() + ENTRY_OVERHEAD;
+  if (entry > limit) {
+    // an entry larger than the table empties it
+    entries.clear();
+    size = 0;
+    return;
+  }
+  entries.push_front(std::make_pair(name, value));
+  size += entry;
+  evict();
+}
+
+void HpackTable::resize(std::size_t max) {
+  limit = max;
+  evict();
+}
+
+void HpackTable::evict() {
+  while (size > limit && !entries.empty()) {
+    size -= entries.back().first.size() + entries.back().second.size() +
+      ENTRY_OVERHEAD;
+    entries.pop_back();
+  }
+}
+
+HpackEncoder::HpackEncoder() : table(4096), pending_size(4096),
+                               size_changed(false) {}
+
+void HpackEncoder::set_max_table_size(std::size_t size) {
+  // no need to use all the peer allows
+  pending_size = std::min<std::size_t>(size, 4096);
+  size_changed = pending_size != table.max_size();
+}
+
+void HpackEncoder::encode(const HeaderList& headers, std::string& block) {
+  if (size_changed) {
+    table.resize(pending_size);
+    encode_integer(block, 0x20, 5, pending_size);
+    size_changed = false;
+  }
+  for (auto& header : headers) {
+    bool exact;
+    std::size_t index = table.find(header.first, header.second, exact);
+    if (exact) {
+      encode_integer(block, 0x80, 7, index);
+      continue;
+    }
+    if (sensitive(header.first)) {
+      encode_integer(block, 0x10, 4, index);
+    }
+    else {
+      encode_integer(block, 0x40, 6, index);
+      table.add(header.first, header.second);
+    }
+    if (index == 0) {
+      encode_string(block, header.first);
+    }
+    encode_string(block, header.second);
+  }
+}
+
+HpackDecoder::HpackDecoder(std::size_t table_size, std::size_t list_size) :
+  table(table_size), max_table_size(table_size), max_list_size(list_size) {}
+
+bool HpackDecoder::decode(const std::string& block, HeaderList& headers) {
+  std::size_t pos = 0;
+  std::size_t list_size = 0;
+  while (pos < block.size()) {
+    unsigned char b = block[pos];
+    std::size_t index;
+    std::string name;
+    std::string value;
+    if ((b & 0x80) != 0) {
+      if (!decode_integer(block, pos, 7, index) ||
+          !table.get(index, name, value)) {
+        return false;
+      }
+    }
+    else if ((b & 0xe0) == 0x20) {
+      // size updates only come before the first header
+      if (!headers.empty() || !decode_integer(block, pos, 5, index) ||
+          index > max_table_size) {
+        return false;
+      }
+      table.resize(index);
+      continue;
+    }
+    else {
+      bool indexing = (b & 0xc0) == 0x40;
+      if (!decode_integer(block, pos, indexing ? 6 : 4, index)) {
+        return false;
+      }
+      if (index == 0 ? !decode_string(block, pos, name) :
+          !table.get(index, name, value)) {
+        return false;
+      }
+      if (!decode_string(block, pos, value)) {
+        return false;
+      }
+      if (indexing) {
+        table.add(name, value);
+      }
+    }
+    list_size += name.size() + value.size() + ENTRY_OVERHEAD;
+    if (list_size > max_list_size) {
+      return false;
+    }
+    headers.push_back(std::make_pair(name, value));
+  }
+  return true;
+}
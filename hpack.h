@@ -0,0 +1,73 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// HPACK header compression (RFC 7541) for the h2c client.  Both sides keep
+// a dynamic table in front of the static one; the decoder handles Huffman
+// coded strings, the encoder sends its strings as they are.
+
+typedef std::vector<std::pair<std::string, std::string> > HeaderList;
+
+class HpackTable {
+  public:
+    explicit HpackTable(std::size_t max_size);
+
+    // 1 based, the 61 static entries followed by the dynamic ones
+    bool get(std::size_t index, std::string& name, std::string& value) const;
+
+    // index of name: value, or failing that of an entry with name, 0 if none
+    std::size_t find(const std::string& name, const std::string& value,
+                     bool& exact) const;
+
+    void add(const std::string& name, const std::string& value);
+
+    void resize(std::size_t max);
+
+    std::size_t max_size() const { return limit; }
+
+  private:
+    void evict();
+
+    std::deque<std::pair<std::string, std::string> > entries;
+    std::size_t size;
+    std::size_t limit;
+};
+
+class HpackEncoder {
+  public:
+    HpackEncoder();
+
+    // the peer's SETTINGS_HEADER_TABLE_SIZE, announced in the next block
+    void set_max_table_size(std::size_t size);
+
+    void encode(const HeaderList& headers, std::string& block);
+
+  private:
+    HpackTable table;
+    std::size_t pending_size;
+    bool size_changed;
+};
+
+class HpackDecoder {
+  public:
+    // max_table_size is our SETTINGS_HEADER_TABLE_SIZE, max_list_size caps
+    // the decoded size of one block
+    HpackDecoder(std::size_t max_table_size, std::size_t max_list_size);
+
+    // false on a malformed block, which is a connection error
+    bool decode(const std::string& block, HeaderList& headers);
+
+  private:
+    HpackTable table;
+    std::size_t max_table_size;
+    std::size_t max_list_size;
+};
+
+bool huffman_decode(const char* data, std::size_t length, std::string& out);
+
+#endif
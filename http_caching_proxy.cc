@@ -1,15 +1,24 @@
 #include "http_caching_proxy.h"
+#include "admission.h"
 #include "server_main.h"
+#include "upgrade.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sched.h>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <memory>
-#include <thread>
 #include <chrono>
 #include <ctime>
 #include <cerrno>
+#include <cstdio>
+#include <cstring>
 
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
@@ -30,41 +39,154 @@ std::map<std::string, std::string> rest_data;
 
 static bool is_debug = false;
 
+static std::shared_ptr<const Cluster> cluster;
+
+static std::shared_ptr<const Snapshot> snapshot;
+
+static std::shared_ptr<NegativeCache> negative_cache;
+
+static std::shared_ptr<DestinationHealth> dest_health;
+
+static Timeouts timeouts;
+
+static std::shared_ptr<const CacheKeyBuilder> key_builder;
+
+static std::shared_ptr<RingPool> ring_pool;
+
+static std::shared_ptr<AdmissionController> admission;
+
+static std::shared_ptr<Prefetcher> prefetcher;
+
+static std::shared_ptr<Tracer> tracer;
+
+static std::vector<std::shared_ptr<H2cClient> > h2c_clients;
+
 void set_debug() {
   is_debug = true;
 }
 
-void logger(int type, const std::string& s1, const std::string& s2,
-            int socket_fd, int hit) {
-   std::ofstream logfile;
-   if (!is_debug) {
-     logfile.open("http_caching_proxy.log", std::ofstream::app);
-   }
-   std::ostream& log = is_debug ? std::cout : logfile;
-   auto start = std::chrono::system_clock::now();
-   std::time_t start_time = std::chrono::system_clock::to_time_t(start);
-   std::ostringstream resp;
-   char mbstr[100];
-   if (std::strftime(mbstr, 100, "%c", std::localtime(&start_time))) {
-     log << mbstr << ": ";
-   }
+void set_cluster(const std::shared_ptr<const Cluster>& c) {
+  cluster = c;
+}
+
+void set_snapshot(const std::shared_ptr<const Snapshot>& s) {
+  snapshot = s;
+}
+
+void set_negative_cache(const std::shared_ptr<NegativeCache>& nc) {
+  negative_cache = nc;
+}
+
+void set_dest_health(const std::shared_ptr<DestinationHealth>& dh) {
+  dest_health = dh;
+}
+
+void set_timeouts(const Timeouts& t) {
+  timeouts = t;
+}
+
+void set_key_builder(const std::shared_ptr<const CacheKeyBuilder>& kb) {
+  key_builder = kb;
+}
+
+void set_ring_pool(const std::shared_ptr<RingPool>& rp) {
+  ring_pool = rp;
+}
+
+void set_admission(const std::shared_ptr<AdmissionController>& ac) {
+  admission = ac;
+}
+
+void set_prefetcher(const std::shared_ptr<Prefetcher>& pf) {
+  prefetcher = pf;
+}
+
+void set_tracer(const std::shared_ptr<Tracer>& t) {
+  tracer = t;
+}
 
+void set_h2c_clients(const std::vector<std::shared_ptr<H2cClient> >& c) {
+  h2c_clients = c;
+}
+
+// the line is put together in an iovec and written with one writev, so a
+// log line costs no heap allocation
+static void write_log(int type, const char* s1, std::size_t n1,
+                      const char* s2, std::size_t n2, int socket_fd,
+                      int hit) {
+   int saved_errno = errno;
+   std::time_t now = std::chrono::system_clock::to_time_t(
+     std::chrono::system_clock::now());
+   std::tm local;
+   char stamp[100];
+   std::size_t stamp_size = std::strftime(stamp, sizeof(stamp), "%c: ",
+                                          localtime_r(&now, &local));
+   const char* kind = "";
+   const char* separator = ": ";
+   char tail[160];
+   int tail_size = 0;
    switch (type) {
-   case ERROR: log << "ERROR: " << s1 << ": " << s2 << " Errno = "
-                   << errno << " = " << std::strerror(errno) << std::endl;
+   case ERROR:
+     kind = "ERROR: ";
+     tail_size = snprintf(tail, sizeof(tail), " Errno = %d = %s\n",
+                          saved_errno, std::strerror(saved_errno));
      break;
    case LOG:
-     log << "INFO: " << s1 << ": " << s2 << " Socket ID: " << socket_fd
-         << " hit: " << hit << std::endl;
+     kind = "INFO: ";
+     tail_size = snprintf(tail, sizeof(tail), " Socket ID: %d hit: %d\n",
+                          socket_fd, hit);
      break;
    case HEADER:
-     log << s1 << ":\n" << s2 << "Socket ID: " << socket_fd << " hit: "
-         << hit << std::endl;
+     separator = ":\n";
+     tail_size = snprintf(tail, sizeof(tail), "Socket ID: %d hit: %d\n",
+                          socket_fd, hit);
+     break;
+   }
+   if (tail_size < 0) {
+     tail_size = 0;
+   }
+   iovec parts[] = {
+     { stamp, stamp_size },
+     { const_cast<char*>(kind), strlen(kind) },
+     { const_cast<char*>(s1), n1 },
+     { const_cast<char*>(separator), strlen(separator) },
+     { const_cast<char*>(s2), n2 },
+     { tail, std::min<std::size_t>(tail_size, sizeof(tail) - 1) } };
+   int fd = STDOUT_FILENO;
+   if (is_debug) {
+     std::cout.flush();
+   }
+   else {
+     fd = open("http_caching_proxy.log",
+               O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+   }
+   if (fd >= 0 && writev(fd, parts, sizeof(parts) / sizeof(parts[0])) < 0) {
+     // nowhere left to report it
    }
-   log.flush();
-   if (!is_debug) {
-     logfile.close();
+   if (!is_debug && fd >= 0) {
+     close(fd);
    }
+   errno = saved_errno;
+}
+
+void logger(int type, const std::string& s1, const std::string& s2,
+            int socket_fd, int hit) {
+  write_log(type, s1.data(), s1.size(), s2.data(), s2.size(), socket_fd, hit);
+}
+
+void logger(int type, const char* s1, const char* s2, int socket_fd,
+            int hit) {
+  write_log(type, s1, strlen(s1), s2, strlen(s2), socket_fd, hit);
+}
+
+std::string method_name(Method method) {
+  switch (method) {
+  case Method::GET: return "GET";
+  case Method::POST: return "POST";
+  case Method::HEAD: return "HEAD";
+  case Method::OTHER: return "OTHER";
+  }
+  return std::string();
 }
 
 void logger(int type, const std::string& s1, std::ostringstream& oss,
@@ -73,22 +195,77 @@ void logger(int type, const std::string& s1, std::ostringstream& oss,
   oss.str(std::string());
 }
 
+static const std::string SHED_RESPONSE =
+  "HTTP/1.1 503 Service Unavailable\nRetry-After: 1\nContent-Length: 53\n"
+  "Connection: close\nContent-Type: application/json\n\n"
+  "{\"code\":503,\"message\":\"HTTP 503 Service Unavailable\"}";
+
+static void* run_proxy(void* sm) {
+  static_cast<ServerMain*>(sm)->proxy();
+  return nullptr;
+}
+
 void proxy(int clntSock, int hit,
-           const std::vector<std::pair<std::string, std::string> >& dests) {
-  // Create separate memory for client argument
-  ThreadArgs threadArgs;
+           const std::vector<std::pair<std::string, std::string> >& dests,
+           int cpu) {
+  // over the connection cap: answer without spawning a thread.  What of the
+  // request already arrived is dropped so close doesn't reset the 503.
+  if (admission && !admission->enter()) {
+    if (send(clntSock, SHED_RESPONSE.c_str(), SHED_RESPONSE.size(),
+             MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+      logger(ERROR, "proxy", "send 503", clntSock, hit);
+    }
+    shutdown(clntSock, SHUT_WR);
+    char discard[4096];
+    while (recv(clntSock, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+    close(clntSock);
+    logger(LOG, "proxy", "shed at accept", clntSock, hit);
+    return;
+  }
+
+  // Reuse a pooled connection object; assigning in place keeps the
+  // capacity its strings and containers grew on earlier connections
+  std::unique_ptr<ServerMain> sm = ServerMain::acquire();
+  ThreadArgs& threadArgs = sm->args();
 
   threadArgs.clntSock = clntSock;
   threadArgs.hit = hit;
   threadArgs.dests = dests;
   threadArgs.rest_data = rest_data;
+  threadArgs.cluster = cluster;
+  threadArgs.snapshot = snapshot;
+  threadArgs.negative_cache = negative_cache;
+  threadArgs.dest_health = dest_health;
+  threadArgs.timeouts = timeouts;
+  threadArgs.key_builder = key_builder;
+  threadArgs.ring_pool = ring_pool;
+  threadArgs.admission = admission;
+  threadArgs.prefetcher = prefetcher;
+  threadArgs.tracer = tracer;
+  threadArgs.h2c = h2c_clients;
+  threadArgs.start = std::chrono::steady_clock::now();
+  request_started();
 
-  // Create client thread
-  std::unique_ptr<ServerMain> sm{new ServerMain(threadArgs)};
-
-  std::thread t(&ServerMain::proxy, sm.get());
-  sm->up = std::move(sm);
-  t.detach();
+  // Create client thread; pthread directly, as std::thread allocates its
+  // state on the heap
+  ServerMain* raw = sm.get();
+  raw->up = std::move(sm);
+  pthread_t t;
+  if (pthread_create(&t, nullptr, run_proxy, raw) != 0) {
+    logger(ERROR, "proxy", "pthread_create", clntSock, hit);
+    sm = std::move(raw->up);
+    close(clntSock);
+    sm->finish();
+    return;
+  }
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(t, sizeof(cpus), &cpus);
+  }
+  pthread_detach(t);
 
   logger(LOG, "proxy", "finished", clntSock, hit);
 }
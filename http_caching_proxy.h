@@ -9,6 +9,8 @@
 #include <map>
 #include <vector>
 #include <iosfwd>
+#include <memory>
+#include <chrono>
 
 extern const std::string VERSION;
 
@@ -24,13 +26,54 @@ extern const std::array<std::string, 9> BAD_DIRS;
 extern const int ERROR;
 extern const int LOG;
 
+// Per phase network timeouts, 0 disables a phase.  Every phase is also
+// capped by what is left of the total budget of the request, which
+// carries over from one destination to the next.
+struct Timeouts {
+  std::chrono::milliseconds connect;
+  std::chrono::milliseconds request;
+  std::chrono::milliseconds first_byte;
+  std::chrono::milliseconds idle;
+  std::chrono::milliseconds total;
+};
+
+class Cluster;
+class Snapshot;
+class NegativeCache;
+class DestinationHealth;
+class CacheKeyBuilder;
+class RingPool;
+class AdmissionController;
+class Prefetcher;
+class H2cClient;
+class Tracer;
+
 void set_debug();
+void set_cluster(const std::shared_ptr<const Cluster>& c);
+void set_snapshot(const std::shared_ptr<const Snapshot>& s);
+void set_negative_cache(const std::shared_ptr<NegativeCache>& nc);
+void set_dest_health(const std::shared_ptr<DestinationHealth>& dh);
+void set_timeouts(const Timeouts& t);
+void set_key_builder(const std::shared_ptr<const CacheKeyBuilder>& kb);
+void set_ring_pool(const std::shared_ptr<RingPool>& rp);
+void set_admission(const std::shared_ptr<AdmissionController>& ac);
+void set_prefetcher(const std::shared_ptr<Prefetcher>& pf);
+void set_tracer(const std::shared_ptr<Tracer>& t);
+// aligned with the dests, null for the ones spoken to in HTTP/1.1
+void set_h2c_clients(const std::vector<std::shared_ptr<H2cClient> >& c);
 void logger(int type, const std::string& s1, const std::string& s2, int
             socket_fd = 0, int hit = 0);
 void logger(int type, const std::string& s1, std::ostringstream& s2, int
             socket_fd = 0, int hit = 0);
-void proxy(int fd, int hit, const std::vector<std::pair<std::string, std::string> >& dests);
+// for the hot path: no std::string is built for literals or char buffers
+void logger(int type, const char* s1, const char* s2, int socket_fd = 0,
+            int hit = 0);
+// cpu >= 0 pins the connection thread to the cpu that accepted it
+void proxy(int fd, int hit, const std::vector<std::pair<std::string, std::string> >& dests,
+           int cpu = -1);
+
+enum class Method {GET, POST, HEAD, OTHER};
 
-enum class Method {GET, POST};
+std::string method_name(Method method);
 
 #endif
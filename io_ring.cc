@@ -0,0 +1,367 @@
+#include "io_ring.h"
+#include "http_caching_proxy.h"
+
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#ifndef NO_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+static const std::size_t CHUNK = 64 * 1024;
+
+#ifndef NO_IO_URING
+
+static const uint64_t ACCEPT_DATA = ~uint64_t(0);
+static const uint64_t CANCEL_DATA = ~uint64_t(0) - 1;
+static const uint64_t POLL_DATA = 1ULL << 62; // | wake fd index
+
+static unsigned load_acquire(const unsigned* p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void store_release(unsigned* p, unsigned v) {
+  __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+IoRing::IoRing(unsigned n) : ring_fd(-1), entries(0), sq_ring(MAP_FAILED),
+                             cq_ring(MAP_FAILED), sq_ring_size(0),
+                             cq_ring_size(0), sqes(nullptr), sqe_tail(0),
+                             to_submit(0) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, n, &p);
+  if (fd < 0) {
+    return;
+  }
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+  }
+  sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq_ring == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+  if (single_mmap) {
+    cq_ring = sq_ring;
+  }
+  else {
+    cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  }
+  void* s = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                 IORING_OFF_SQES);
+  if (cq_ring == MAP_FAILED || s == MAP_FAILED) {
+    if (s != MAP_FAILED) {
+      munmap(s, p.sq_entries * sizeof(io_uring_sqe));
+    }
+    close(fd);
+    return;
+  }
+  sqes = static_cast<io_uring_sqe*>(s);
+  char* sq = static_cast<char*>(sq_ring);
+  char* cq = static_cast<char*>(cq_ring);
+  sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+  sqe_tail = *sq_tail;
+  entries = p.sq_entries;
+  ring_fd = fd;
+}
+
+IoRing::~IoRing() {
+  if (ring_fd < 0) {
+    return;
+  }
+  munmap(sqes, entries * sizeof(io_uring_sqe));
+  if (cq_ring != sq_ring) {
+    munmap(cq_ring, cq_ring_size);
+  }
+  munmap(sq_ring, sq_ring_size);
+  close(ring_fd);
+}
+
+bool IoRing::supported() {
+  static const bool ok = IoRing(2).valid();
+  return ok;
+}
+
+io_uring_sqe* IoRing::get_sqe() {
+  if (sqe_tail - load_acquire(sq_head) >= entries) {
+    return nullptr;
+  }
+  unsigned index = sqe_tail & *sq_mask;
+  io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  ++sqe_tail;
+  ++to_submit;
+  return sqe;
+}
+
+int IoRing::submit(unsigned wait_nr) {
+  store_release(sq_tail, sqe_tail);
+  int n = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+                  wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+  if (n > 0) {
+    to_submit -= std::min<unsigned>(n, to_submit);
+  }
+  return n;
+}
+
+bool IoRing::peek(io_uring_cqe& cqe) {
+  unsigned head = *cq_head;
+  if (head == load_acquire(cq_tail)) {
+    return false;
+  }
+  cqe = cqes[head & *cq_mask];
+  store_release(cq_head, head + 1);
+  return true;
+}
+
+bool IoRing::wait(io_uring_cqe& cqe) {
+  while (!peek(cqe)) {
+    if (submit(1) < 0 && errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool IoRing::send_file(int file, std::size_t size, int sock, char* buffer,
+                       std::size_t& sent) {
+  sent = 0;
+  std::size_t queued = 0;
+  while (sent < size) {
+    // queue read/send pairs for as many chunks as the ring holds
+    std::size_t batch = 0;
+    std::size_t offset = sent;
+    while (offset < size && batch + 2 <= entries) {
+      std::size_t length = std::min(CHUNK, size - offset);
+      io_uring_sqe* read = get_sqe();
+      io_uring_sqe* send = get_sqe();
+      read->opcode = IORING_OP_READ;
+      read->fd = file;
+      read->addr = reinterpret_cast<uintptr_t>(buffer + offset);
+      read->len = length;
+      read->off = offset;
+      read->flags = IOSQE_IO_LINK;
+      read->user_data = offset << 1;
+      send->opcode = IORING_OP_SEND;
+      send->fd = sock;
+      send->addr = reinterpret_cast<uintptr_t>(buffer + offset);
+      send->len = length;
+      send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+      send->user_data = (offset << 1) | 1;
+      offset += length;
+      batch += 2;
+      if (offset < size && batch + 2 <= entries) {
+        send->flags = IOSQE_IO_LINK;
+      }
+    }
+    queued = batch;
+    if (submit(0) < 0) {
+      return false;
+    }
+    bool ok = true;
+    while (queued > 0) {
+      io_uring_cqe cqe;
+      if (!wait(cqe)) {
+        return false;
+      }
+      --queued;
+      std::size_t at = cqe.user_data >> 1;
+      std::size_t length = std::min(CHUNK, size - at);
+      // the socket is non-blocking, so a send can come back short: what it
+      // got out still counts, the caller resumes from there
+      if ((cqe.user_data & 1) != 0 && ok && cqe.res > 0) {
+        sent = std::max(sent, at + cqe.res);
+      }
+      if (cqe.res != static_cast<int>(length)) {
+        ok = false;
+      }
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+RingAcceptor::RingAcceptor(IoRing& r, int fd, const std::vector<int>& wake)
+  : ring(r), listenfd(fd), wake_fds(wake), poll_armed(wake.size(), false),
+    accept_armed(false), multishot(true) {}
+
+bool RingAcceptor::arm_accept() {
+  io_uring_sqe* sqe = ring.get_sqe();
+  if (sqe == nullptr) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listenfd;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  if (multishot) {
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  }
+  sqe->user_data = ACCEPT_DATA;
+  accept_armed = true;
+  return true;
+}
+
+bool RingAcceptor::arm_poll(std::size_t i) {
+  io_uring_sqe* sqe = ring.get_sqe();
+  if (sqe == nullptr) {
+    return false;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = wake_fds[i];
+  sqe->poll_events = POLLIN;
+  sqe->user_data = POLL_DATA | i;
+  poll_armed[i] = true;
+  return true;
+}
+
+void RingAcceptor::reap(const io_uring_cqe& cqe, bool& woken) {
+  if (cqe.user_data == ACCEPT_DATA) {
+    if (cqe.res >= 0) {
+      ready.push_back(cqe.res);
+    }
+    else if (cqe.res == -EINVAL && multishot) {
+      multishot = false; // kernel before 5.19
+    }
+    if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+      accept_armed = false;
+    }
+  }
+  else if ((cqe.user_data & POLL_DATA) != 0 && cqe.user_data != CANCEL_DATA) {
+    poll_armed[cqe.user_data & ~POLL_DATA] = false;
+    woken = true;
+  }
+}
+
+int RingAcceptor::next() {
+  bool woken = false;
+  while (ready.empty() && !woken) {
+    if (!accept_armed) {
+      arm_accept();
+    }
+    for (std::size_t i = 0; i < wake_fds.size(); ++i) {
+      if (!poll_armed[i]) {
+        arm_poll(i);
+      }
+    }
+    io_uring_cqe cqe;
+    if (!ring.wait(cqe)) {
+      return -1;
+    }
+    reap(cqe, woken);
+    while (ring.peek(cqe)) {
+      reap(cqe, woken);
+    }
+  }
+  if (ready.empty()) {
+    errno = EAGAIN;
+    return -1;
+  }
+  int fd = ready.front();
+  ready.pop_front();
+  return fd;
+}
+
+std::vector<int> RingAcceptor::cancel() {
+  if (accept_armed) {
+    io_uring_sqe* sqe = ring.get_sqe();
+    if (sqe != nullptr) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = ACCEPT_DATA;
+      sqe->user_data = CANCEL_DATA;
+    }
+    bool woken = false;
+    io_uring_cqe cqe;
+    while (accept_armed && ring.wait(cqe)) {
+      reap(cqe, woken);
+    }
+  }
+  std::vector<int> left(ready.begin(), ready.end());
+  ready.clear();
+  return left;
+}
+
+#else
+
+IoRing::IoRing(unsigned) : ring_fd(-1) {}
+IoRing::~IoRing() {}
+bool IoRing::supported() { return false; }
+io_uring_sqe* IoRing::get_sqe() { return nullptr; }
+int IoRing::submit(unsigned) { errno = ENOSYS; return -1; }
+bool IoRing::peek(io_uring_cqe&) { return false; }
+bool IoRing::wait(io_uring_cqe&) { return false; }
+bool IoRing::send_file(int, std::size_t, int, char*, std::size_t& sent) {
+  sent = 0;
+  return false;
+}
+
+RingAcceptor::RingAcceptor(IoRing& r, int fd, const std::vector<int>& wake)
+  : ring(r), listenfd(fd), wake_fds(wake), accept_armed(false),
+    multishot(false) {}
+int RingAcceptor::next() { errno = ENOSYS; return -1; }
+std::vector<int> RingAcceptor::cancel() { return std::vector<int>(); }
+
+#endif
+
+RingPool::RingPool() {
+  long cpus = std::max(1L, sysconf(_SC_NPROCESSORS_CONF));
+  for (long i = 0; i < cpus; ++i) {
+    slots.push_back(std::unique_ptr<Slot>(new Slot));
+  }
+}
+
+RingPool::Borrowed RingPool::borrow() {
+  int cpu = sched_getcpu();
+  std::size_t index = cpu < 0 ? 0 : cpu % slots.size();
+  Slot& slot = *slots[index];
+  if (!slot.mutex.try_lock()) {
+    return Borrowed();
+  }
+  if (!slot.ring) {
+    slot.ring.reset(new IoRing);
+  }
+  if (!slot.ring->valid()) {
+    slot.mutex.unlock();
+    return Borrowed();
+  }
+  return Borrowed(this, index);
+}
+
+RingPool::Borrowed::Borrowed(Borrowed&& other) : pool(other.pool),
+                                                 index(other.index) {
+  other.pool = nullptr;
+}
+
+RingPool::Borrowed::~Borrowed() {
+  if (pool != nullptr) {
+    pool->slots[index]->mutex.unlock();
+  }
+}
+
+IoRing* RingPool::Borrowed::operator->() const {
+  return pool->slots[index]->ring.get();
+}
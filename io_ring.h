@@ -0,0 +1,123 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Optional io_uring backend, driven through the raw syscalls so it needs
+// nothing but the kernel headers.  Build with -DNO_IO_URING to leave it out;
+// at run time IoRing::supported() decides and every user falls back to the
+// plain socket calls when it says no.
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class IoRing {
+  public:
+    explicit IoRing(unsigned entries = 64);
+    ~IoRing();
+
+    static bool supported();
+
+    bool valid() const { return ring_fd >= 0; }
+
+    // next free submission entry, zeroed, nullptr when the queue is full
+    io_uring_sqe* get_sqe();
+
+    // submit what get_sqe() handed out, waiting for wait_nr completions
+    int submit(unsigned wait_nr = 0);
+
+    bool peek(io_uring_cqe& cqe);
+    bool wait(io_uring_cqe& cqe);
+
+    // read file [0, size) into buffer and send it to sock, each chunk's read
+    // linked to its send so one io_uring_enter moves a batch of chunks;
+    // sent is how far the client got when it returns false
+    bool send_file(int file, std::size_t size, int sock, char* buffer,
+                   std::size_t& sent);
+
+  private:
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    int ring_fd;
+    unsigned entries;
+    void* sq_ring;
+    void* cq_ring;
+    std::size_t sq_ring_size;
+    std::size_t cq_ring_size;
+    io_uring_sqe* sqes;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    unsigned sqe_tail;
+    unsigned to_submit;
+};
+
+// One ring per cpu for the connection threads.  A thread borrows the ring of
+// the cpu it runs on (connection threads are pinned with --workers); when
+// that ring is busy it gets none and uses the plain calls.
+class RingPool {
+  public:
+    RingPool();
+
+    class Borrowed {
+      public:
+        Borrowed() : pool(nullptr), index(0) {}
+        Borrowed(Borrowed&& other);
+        ~Borrowed();
+        IoRing* operator->() const;
+        explicit operator bool() const { return pool != nullptr; }
+
+      private:
+        friend class RingPool;
+        Borrowed(RingPool* p, std::size_t i) : pool(p), index(i) {}
+        RingPool* pool;
+        std::size_t index;
+    };
+
+    Borrowed borrow();
+
+  private:
+    struct Slot {
+      std::mutex mutex;
+      std::unique_ptr<IoRing> ring;
+    };
+    std::vector<std::unique_ptr<Slot> > slots;
+};
+
+// Accepts through a ring: a multishot accept on the listener (re-armed as a
+// single shot on kernels without it) and a poll on each wake fd.  next()
+// returns a connection, or -1 once a wake fd is readable.
+class RingAcceptor {
+  public:
+    RingAcceptor(IoRing& ring, int listenfd, const std::vector<int>& wake_fds);
+
+    int next();
+
+    // cancel the accept; connections it still delivered are returned
+    std::vector<int> cancel();
+
+  private:
+    bool arm_accept();
+    bool arm_poll(std::size_t i);
+    void reap(const io_uring_cqe& cqe, bool& woken);
+
+    IoRing& ring;
+    int listenfd;
+    std::vector<int> wake_fds;
+    std::vector<bool> poll_armed;
+    bool accept_armed;
+    bool multishot;
+    std::deque<int> ready;
+};
+
+#endif
@@ -1,39 +1,268 @@
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <poll.h>
 
 #include <iostream>
+#include <chrono>
+#include <cerrno>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <limits>
 
 #include <boost/program_options/cmdline.hpp>
 #include <boost/program_options/options_description.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include <boost/program_options/parsers.hpp>
 #include "http_caching_proxy.h"
+#include "cluster.h"
+#include "snapshot.h"
+#include "cache_store.h"
+#include "cuckoo_filter.h"
+#include "negative_cache.h"
+#include "dest_health.h"
+#include "cache_key.h"
+#include "shm_cache.h"
+#include "upgrade.h"
+#include "io_ring.h"
+#include "cache_writer.h"
+#include "admission.h"
+#include "prefetcher.h"
+#include "tracer.h"
+#include "h2c_client.h"
 
 using namespace std;
 namespace po = boost::program_options;
 
-int listenfd = -1;
+std::vector<int> listenfds; /* one per worker */
 
+static std::atomic<bool> terminating(false);
+
+/* the handler only wakes the accept loops, check_terminate shuts down: the
+   cache writer can't be flushed from here, the interrupted thread may hold
+   its lock */
 void terminate(int signum) {
   if (signum == SIGTERM) {
-    if (listenfd > 0) {
-      std::ostringstream fd;
-      fd << "close socket: " << listenfd;
-      logger(LOG, "terminate", fd.str(), getpid());
-      close(listenfd);
+    terminating = true;
+    stop_accepting();
+  }
+}
+
+static std::string inherit_listener;
+
+static std::chrono::milliseconds drain_timeout(30000);
+
+static int workers = 1;
+
+static int backlog = 64;
+
+static std::atomic<int> hits(0);
+
+static std::atomic<bool> stopping(false);
+
+/* after SIGTERM close the listeners, write out the entries still queued for
+   the disk and exit */
+void check_terminate() {
+  if (!terminating.exchange(false)) {
+    return;
+  }
+  stopping = true;
+  for (int listenfd : listenfds) {
+    std::ostringstream fd;
+    fd << "close socket: " << listenfd;
+    logger(LOG, "terminate", fd.str(), getpid());
+    close(listenfd);
+  }
+  flush_cache_writer();
+  logger(LOG, "terminate", "done", getpid());
+  exit(0);
+}
+
+static bool use_io_uring = false;
+
+static std::shared_ptr<Tracer> tracer;
+
+/* a listening socket on port; with reuseport every worker binds its own and
+   the kernel spreads the connections over them */
+int open_listener(int port, bool reuseport) {
+  int listenfd;
+  if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0)) < 0) {
+    logger(ERROR, "open_listener", "socket", 0);
+    return -1;
+  }
+  int on = 1;
+  if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+    logger(ERROR, "open_listener", "SO_REUSEADDR", 0);
+  if (reuseport &&
+      setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    logger(ERROR, "open_listener", "SO_REUSEPORT", 0);
+  sockaddr_in serv_addr;
+  memset(&serv_addr, 0, sizeof(serv_addr));
+  serv_addr.sin_family = AF_INET;
+  serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  serv_addr.sin_port = htons(port);
+
+  const sockaddr* servAddr = reinterpret_cast<const sockaddr*>(&serv_addr);
+  if (bind(listenfd, servAddr, sizeof(serv_addr)) < 0) {
+    logger(ERROR, "open_listener", "bind", 0);
+    close(listenfd);
+    return -1;
+  }
+  if (listen(listenfd, backlog) < 0) {
+    logger(ERROR, "open_listener", "listen", 0);
+    close(listenfd);
+    return -1;
+  }
+  return listenfd;
+}
+
+/* the listeners of the process we replace, or new ones, one per worker */
+bool open_listeners(int port) {
+  if (!inherit_listener.empty()) {
+    listenfds = take_over_listeners(inherit_listener);
+    if (listenfds.empty()) {
+      logger(LOG, "upgrade", "no listener from " + inherit_listener, getpid());
+      exit(7);
     }
-    logger(LOG, "terminate", "done", getpid());
+    std::ostringstream oss;
+    oss << "inherited " << listenfds.size() << " listen sockets";
+    logger(LOG, "upgrade", oss, getpid());
+  }
+  if (port < 0 || port >60000) {
+    logger(ERROR, "Port", "Invalid number (try 1->60000)", 0);
+    return false;
+  }
+  while (listenfds.size() < static_cast<std::size_t>(workers)) {
+    int listenfd = open_listener(port, workers > 1);
+    if (listenfd < 0) {
+      return false;
+    }
+    listenfds.push_back(listenfd);
+  }
+  return true;
+}
+
+/* on SIGUSR2 hand the listeners to a new process, finish the requests in
+   flight and exit */
+void check_upgrade() {
+  if (!upgrade_requested() || stopping) {
+    return;
+  }
+  logger(LOG, "upgrade", "SIGUSR2, starting successor", getpid());
+  if (hand_over_listeners(listenfds, drain_timeout)) {
+    stopping = true;
+    stop_accepting();
+    for (int fd : listenfds) {
+      close(fd);
+    }
+    drain(drain_timeout);
+    flush_cache_writer();
+    logger(LOG, "upgrade", "done", getpid());
     exit(0);
   }
 }
 
-static sockaddr_in cli_addr; /* static = initialised to zeros */
+/* on SIGUSR1 write the sampled traces to trace.<pid>.json in data_dir */
+void check_trace() {
+  if (!tracer || !trace_requested()) {
+    return;
+  }
+  std::ostringstream file;
+  file << "trace." << getpid() << ".json";
+  if (tracer->dump(file.str()))
+    logger(LOG, "trace", "wrote " + file.str(), getpid());
+  else
+    logger(ERROR, "trace", "can't write " + file.str(), getpid());
+}
+
+/* wait for a connection, -1 with EAGAIN when woken for an upgrade or a
+   trace dump */
+int next_connection(int listenfd) {
+  pollfd fds[4] = {{listenfd, POLLIN, 0}, {upgrade_fd(), POLLIN, 0},
+                   {stop_fd(), POLLIN, 0}, {trace_fd(), POLLIN, 0}};
+  if (poll(fds, 4, -1) < 0) {
+    return -1;
+  }
+  if (stopping || (fds[0].revents & POLLIN) == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  sockaddr_in cli_addr;
+  socklen_t length = sizeof(cli_addr);
+  return accept4(listenfd, (struct sockaddr *)&cli_addr, &length,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+/* accept on one listener, through an io_uring when enabled; with several
+   workers the thread is pinned to a cpu and so are the connections it
+   accepts */
+void accept_loop(std::size_t worker, const std::string& mode,
+                 const std::vector<std::pair<std::string, std::string> >& dests) {
+  int cpu = -1;
+  if (workers > 1) {
+    cpu = worker % std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      logger(LOG, mode, "can't pin worker to its cpu", worker);
+  }
+  int listenfd = listenfds[worker];
+  std::unique_ptr<IoRing> ring;
+  std::unique_ptr<RingAcceptor> acceptor;
+  if (use_io_uring) {
+    ring.reset(new IoRing);
+    std::vector<int> wake_fds;
+    for (int fd : {upgrade_fd(), stop_fd(), trace_fd()}) {
+      if (fd >= 0)
+        wake_fds.push_back(fd);
+    }
+    if (ring->valid())
+      acceptor.reset(new RingAcceptor(*ring, listenfd, wake_fds));
+    else
+      logger(LOG, mode, "io_uring setup failed, using accept4", worker);
+  }
+  while (!stopping) {
+    check_terminate();
+    int socketfd = acceptor ? acceptor->next() : next_connection(listenfd);
+    if (socketfd < 0) {
+      if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        logger(ERROR, mode, "accept", 0);
+      check_upgrade();
+      check_trace();
+    }
+    else {
+      proxy(socketfd, ++hits, dests, cpu); /* never returns */
+    }
+  }
+  if (acceptor) {
+    /* connections the ring accepted before it was cancelled */
+    for (int socketfd : acceptor->cancel())
+      proxy(socketfd, ++hits, dests, cpu);
+  }
+}
+
+void run_workers(const std::string& mode,
+                 const std::vector<std::pair<std::string, std::string> >& dests) {
+  std::vector<std::thread> threads;
+  for (std::size_t worker = 0; worker < listenfds.size(); ++worker) {
+    threads.push_back(std::thread(accept_loop, worker, mode, std::cref(dests)));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
 
-int daemon(int port, int& hit, const std::string& data_dir,
+int daemon(int port, const std::string& data_dir,
            const std::vector<std::pair<std::string, std::string> >& dests) {
   logger(LOG, "starting", "become daemon", getpid());
   /* Become deamon + unstopable and no zombies children ( = no wait()) */
@@ -41,78 +270,76 @@ int daemon(int port, int& hit, const std::string& data_dir,
     return 0; /* parent returns OK to shell */
   signal(SIGCLD, SIG_IGN); /* ignore child death */
   signal(SIGHUP, SIG_IGN); /* ignore terminal hangups */
-  signal(SIGTERM, terminate);
-  signal(SIGINT, terminate);
   logger(LOG, "starting", "close open files", getpid());
   for (int i = 0; i < 32; i++)
     close(i); /* close open files */
+  /* stdin, stdout and stderr on /dev/null, so the pipes and the eventfd
+     below can't take their numbers and get written to by cout or cerr */
+  int null = open("/dev/null", O_RDWR);
+  for (int i = 0; null >= 0 && i < 3; i++) {
+    if (null != i)
+      dup2(null, i);
+  }
+  if (null > 2)
+    close(null);
   setpgrp(); /* break away from process group */
+  install_upgrade_handler();
+  if (tracer)
+    install_trace_handler();
+  /* after the stop eventfd exists, the handler wakes the accept loops */
+  signal(SIGTERM, terminate);
+  signal(SIGINT, terminate);
   std::ostringstream portStr;
   portStr << port;
   logger(LOG, "listen on port", portStr.str().c_str(), getpid());
-  /* setup the network socket */
-  if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) <0)
-    logger(ERROR, "system call", "socket", 0);
-  if (port < 0 || port >60000)
-    logger(ERROR, "Port", "Invalid number (try 1->60000)", 0);
-  static sockaddr_in serv_addr; /* static = initialised to zeros */
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  serv_addr.sin_port = htons(port);
-
-  const sockaddr* servAddr = reinterpret_cast<const sockaddr*>(&serv_addr);
-  if (bind(listenfd, servAddr, sizeof(servAddr)) <0)
-    logger(ERROR, "system call", "bind", 0);
-  if ( listen(listenfd, 64) < 0)
-    logger(ERROR, "system call", "listen", 0);
-  for (hit = 1; true ;hit++) {
-    int socketfd;
-    socklen_t length = sizeof(cli_addr);
-    if ((socketfd = accept(listenfd,
-                           (struct sockaddr *)&cli_addr, &length)) < 0) {
-      logger(ERROR, "system call", "accept", 0);
-    }
-    else {
-      std::cout << "Log file: " << data_dir << "/http_caching_proxy.log"
-                << std::endl;
-      proxy(socketfd, hit, dests); /* never returns */
-    }
-  }
+  std::cout << "Log file: " << data_dir << "/http_caching_proxy.log"
+            << std::endl;
+  /* setup the network sockets */
+  if (!open_listeners(port))
+    exit(8);
+  run_workers("system call", dests);
+  return 0;
 }
 
 void debug(int port, const std::string& data_dir,
            const std::vector<std::pair<std::string, std::string> >& dests) {
   set_debug();
+  install_upgrade_handler();
+  if (tracer)
+    install_trace_handler();
   signal(SIGTERM, terminate);
   std::ostringstream portStr;
   portStr << port;
   logger(LOG, "listen on port", portStr.str().c_str(), getpid());
-  /* setup the network socket */
-  if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) <0)
-    logger(ERROR, "debug", "socket creation", 0);
-  if (port < 0 || port >60000)
-    logger(ERROR, "debug", "Invalid port number (try 1->60000)", 0);
-  static sockaddr_in serv_addr; /* static = initialised to zeros */
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  serv_addr.sin_port = htons(port);
+  /* setup the network sockets */
+  if (!open_listeners(port))
+    exit(8);
+  run_workers("debug", dests);
+}
 
-  const sockaddr* servAddr = reinterpret_cast<const sockaddr*>(&serv_addr);
-  if (bind(listenfd, servAddr, sizeof(serv_addr)) <0)
-    logger(ERROR, "debug", "bind", 0);
-  if (listen(listenfd, 64) < 0)
-    logger(ERROR, "debug", "listen", 0);
-  for (int hit = 1; true ;hit++) {
-    int socketfd;
-    socklen_t length = sizeof(cli_addr);
-    if ((socketfd = accept(listenfd,
-                           (struct sockaddr *)&cli_addr, &length)) < 0) {
-      logger(ERROR, "debug", "accept", hit);
+std::pair<std::string, std::string> parse_host_port(const std::string& dest) {
+  std::string host = dest;
+  unsigned short destPort = 80;
+  auto pos = dest.find(':');
+  std::string portStr = "80";
+  if (pos != dest.npos) {
+    host = dest.substr(0,pos);
+    portStr = dest.substr(pos+1);
+    std::istringstream iss(portStr);
+    iss >> destPort;
+    if (destPort == 0) {
+      std::cout << "Error parsing destination port: "
+                << portStr << " at " << pos << " of "
+                << dest << std::endl;
+      exit(-1);
     }
-    else {
-      proxy(socketfd, hit, dests); /* never returns */
+    else if (destPort < 1 || destPort > 65535) {
+      std::cerr << "Error: " << destPort << " is not between 1 and 65535."
+                << std::endl;
+      exit(-2);
     }
   }
+  return std::make_pair(host, portStr);
 }
 
 void parse_command_line(const po::variables_map& vm, int& port, 
@@ -144,7 +371,7 @@ void parse_command_line(const po::variables_map& vm, int& port,
   }
 
   if (vm.count("data_dir") == 0 ||
-      vm.count("port") == 0) {
+      (vm.count("port") == 0 && vm.count("compile_snapshot") == 0)) {
     std::cout << "hint: mock_rest_api --port <port> --data_dir <directory> "
               <<"""--version"
               << VERSION << "\n\n"
@@ -163,33 +390,52 @@ void parse_command_line(const po::variables_map& vm, int& port,
     std::cout << std::endl;
     exit(0);
   }
-  port = vm["port"].as<int>();
+  port = vm.count("port") ? vm["port"].as<int>() : 0;
   data_dir = vm["data_dir"].as<std::string>();
+  std::vector<std::shared_ptr<H2cClient> > h2c;
   if (vm.count("dest") > 0) {
+    static const std::string H2C = "h2c://";
+    std::size_t connections = std::max(vm["h2c_connections"].as<int>(), 1);
     for (auto& dest : vm["dest"].as<std::vector<std::string> >()) {
-      std::string host = dest;
-      unsigned short destPort = 80;
-      auto pos = dest.find(':');
-      std::string portStr = "80";
-      if (pos != dest.npos) {
-        host = dest.substr(0,pos);
-        portStr = dest.substr(pos+1);
-        std::istringstream iss(portStr);
-        iss >> destPort;
-        if (destPort == 0) {
-          std::cout << "Error parsing destination port: "
-                    << portStr << " at " << pos << " of "
-                    << dest << std::endl;
-          exit(-1);
-        }
-        else if (destPort < 1 || destPort > 65535) {
-          std::cerr << "Error: " << destPort << " is not between 1 and 65535."
-                    << std::endl;
-          exit(-2);
-        }
-      }
-      dests.push_back(std::make_pair(host, portStr));
+      bool is_h2c = dest.compare(0, H2C.size(), H2C) == 0;
+      dests.push_back(parse_host_port(is_h2c ? dest.substr(H2C.size()) : dest));
+      h2c.push_back(is_h2c ? std::make_shared<H2cClient>(
+        dests.back().first, dests.back().second, connections) : nullptr);
+    }
+    set_h2c_clients(h2c);
+  }
+  Timeouts timeouts;
+  timeouts.connect = std::chrono::milliseconds(vm["connect_timeout"].as<int>());
+  timeouts.request = std::chrono::milliseconds(vm["request_timeout"].as<int>());
+  timeouts.first_byte = std::chrono::milliseconds(vm["first_byte_timeout"].as<int>());
+  timeouts.idle = std::chrono::milliseconds(vm["idle_timeout"].as<int>());
+  timeouts.total = std::chrono::milliseconds(vm["total_timeout"].as<int>());
+  set_timeouts(timeouts);
+  std::shared_ptr<DestinationHealth> dest_health;
+  if (!dests.empty()) {
+    dest_health = std::make_shared<DestinationHealth>(
+      dests, std::chrono::milliseconds(vm["breaker_cooldown"].as<int>()));
+    set_dest_health(dest_health);
+  }
+  if (vm.count("peer") > 0) {
+    std::vector<std::pair<std::string, std::string> > peers;
+    for (auto& peer : vm["peer"].as<std::vector<std::string> >()) {
+      peers.push_back(parse_host_port(peer));
     }
+    std::ostringstream self;
+    self << "localhost:" << port;
+    if (vm.count("self")) {
+      auto self_peer = parse_host_port(vm["self"].as<std::string>());
+      self.str(self_peer.first + ":" + self_peer.second);
+    }
+    std::shared_ptr<const Cluster> cluster{
+      new Cluster(peers, self.str(), vm.count("replicate") > 0)};
+    if (!cluster->valid()) {
+      std::cerr << "Error: " << self.str() << " is not in the --peer list."
+                << std::endl;
+      exit(5);
+    }
+    set_cluster(cluster);
   }
 
   for (auto& bad_dir : BAD_DIRS) {
@@ -205,14 +451,174 @@ void parse_command_line(const po::variables_map& vm, int& port,
               << std::endl;
     exit(4);
   }
+
+  // snapshot paths are relative to data_dir, like the log file
+  if (vm.count("compile_snapshot")) {
+    set_debug();
+    exit(compile_snapshot(vm["compile_snapshot"].as<std::string>()) ? 0 : 6);
+  }
+  if (vm.count("snapshot")) {
+    std::shared_ptr<Snapshot> snapshot{new Snapshot};
+    if (!snapshot->open(vm["snapshot"].as<std::string>())) {
+      std::cerr << "ERROR: Can't open snapshot "
+                << vm["snapshot"].as<std::string>() << std::endl;
+      exit(6);
+    }
+    std::cout << "snapshot entries " << snapshot->size() << std::endl;
+    set_snapshot(snapshot);
+  }
+
+  std::vector<std::string> drop_params;
+  if (vm.count("drop_param")) {
+    drop_params = vm["drop_param"].as<std::vector<std::string> >();
+  }
+  std::vector<std::string> post_prefixes;
+  if (vm.count("cache_post")) {
+    post_prefixes = vm["cache_post"].as<std::vector<std::string> >();
+  }
+  std::shared_ptr<CacheKeyBuilder> key_builder{
+    new CacheKeyBuilder(drop_params, post_prefixes)};
+  key_builder->vary().load();
+  set_key_builder(key_builder);
+
+  // an upgrade's predecessor may still be writing entries, leave it alone
+  if (vm.count("inherit_listener") == 0) {
+    std::size_t removed = collect_cache_garbage();
+    if (removed > 0) {
+      std::cout << "removed " << removed << " unreferenced cache files"
+                << std::endl;
+    }
+  }
+  int filter_capacity = vm["filter_capacity"].as<int>();
+  if (filter_capacity > 0) {
+    std::shared_ptr<CuckooFilter> filter{new CuckooFilter(filter_capacity)};
+    for (auto key : list_cached_keys()) {
+      filter->insert(key);
+    }
+    std::cout << "cached keys " << filter->size() << std::endl;
+    if (filter->overflowed()) {
+      std::cout << "existence filter full, raise --filter_capacity"
+                << std::endl;
+    }
+    set_cache_filter(filter);
+  }
+  int shm_cache_mb = vm["shm_cache_mb"].as<int>();
+  if (shm_cache_mb > 0) {
+    std::size_t slot_size = std::size_t(vm["shm_slot_kb"].as<int>()) << 10;
+    std::size_t slots = (std::size_t(shm_cache_mb) << 20) / std::max<std::size_t>(slot_size, 1);
+    std::ostringstream name;
+    name << "/http_caching_proxy." << port;
+    std::shared_ptr<ShmCache> hot{new ShmCache};
+    if (hot->open(name.str(), slots, slot_size)) {
+      set_hot_cache(hot);
+    }
+  }
+  drain_timeout = std::chrono::milliseconds(vm["drain_timeout"].as<int>());
+  workers = vm["workers"].as<int>();
+  if (workers <= 0) {
+    workers = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  }
+  backlog = vm["backlog"].as<int>();
+  if (vm.count("io_uring")) {
+    use_io_uring = IoRing::supported();
+    if (use_io_uring) {
+      set_ring_pool(std::make_shared<RingPool>());
+    }
+    std::cout << (use_io_uring ? "using io_uring" :
+                  "io_uring not supported, using accept4 and blocking reads")
+              << std::endl;
+  }
+  if (vm.count("inherit_listener")) {
+    inherit_listener = vm["inherit_listener"].as<std::string>();
+  }
+  CacheWriter::Sync sync;
+  if (!CacheWriter::parse_sync(vm["fsync"].as<std::string>(), sync)) {
+    std::cerr << "ERROR: --fsync must be none, batch or always" << std::endl;
+    exit(9);
+  }
+  int write_behind_mb = vm["write_behind_mb"].as<int>();
+  if (write_behind_mb > 0) {
+    set_cache_writer(std::make_shared<CacheWriter>(
+      std::size_t(write_behind_mb) << 20, sync));
+  }
+  else {
+    set_cache_sync(sync != CacheWriter::Sync::NONE);
+  }
+  int max_inflight = vm["max_inflight"].as<int>();
+  int max_per_dest = vm["max_per_dest"].as<int>();
+  std::shared_ptr<AdmissionController> admission;
+  if (max_inflight > 0 || max_per_dest > 0) {
+    admission = std::make_shared<AdmissionController>(
+      max_inflight > 0 ? max_inflight : std::numeric_limits<int>::max(),
+      std::max(vm["max_queue"].as<int>(), 0), dests.size(),
+      std::max(max_per_dest, 0),
+      std::chrono::milliseconds(vm["codel_target"].as<int>()),
+      std::chrono::milliseconds(vm["codel_interval"].as<int>()));
+    set_admission(admission);
+  }
+  double prefetch_rate = vm["prefetch_rate"].as<double>();
+  if (prefetch_rate > 0 && !dests.empty()) {
+    set_prefetcher(std::make_shared<Prefetcher>(
+      dests, vm["prefetch_paths"].as<int>(),
+      vm["prefetch_confidence"].as<double>(), prefetch_rate, dest_health,
+      admission, key_builder, timeouts, h2c));
+  }
+  int trace_sample = vm["trace_sample"].as<int>();
+  if (trace_sample > 0) {
+    tracer = std::make_shared<Tracer>(trace_sample,
+                                      std::max(vm["trace_requests"].as<int>(), 1));
+    set_tracer(tracer);
+  }
+  int negative_ttl = vm["negative_ttl"].as<int>();
+  if (negative_ttl > 0) {
+    set_negative_cache(std::make_shared<NegativeCache>(
+      std::chrono::seconds(negative_ttl), vm["negative_entries"].as<int>()));
+  }
 }
 
 int main(int argc, char **argv) {
+  save_command_line(argc, argv);
   po::options_description desc("Allowed options");
   desc.add_options()
     ("data_dir",  po::value<std::string>(), "rest api response files")
-    ("dest",      po::value<std::vector<std::string> >(), "list of comma separated host:port pairs")
+    ("dest",      po::value<std::vector<std::string> >(), "list of comma separated host:port pairs, h2c://host:port for cleartext HTTP/2")
+    ("h2c_connections", po::value<int>()->default_value(2), "connections requests to one h2c destination are multiplexed over")
     ("port",      po::value<int>(),         "tcp port")
+    ("peer",      po::value<std::vector<std::string> >(), "cluster node host:port, repeat for every node including this one")
+    ("self",      po::value<std::string>(), "this node in the --peer list (default localhost:<port>)")
+    ("replicate",                           "push entries fetched from a --dest to their owning peer")
+    ("snapshot",  po::value<std::string>(), "serve from a snapshot file compiled with --compile_snapshot")
+    ("compile_snapshot", po::value<std::string>(), "compile data_dir into a read only snapshot file and exit")
+    ("filter_capacity", po::value<int>()->default_value(1 << 20), "keys in the in memory existence filter, 0 disables it")
+    ("negative_ttl", po::value<int>()->default_value(30), "seconds 404 and other cacheable errors are answered locally, 0 disables")
+    ("negative_entries", po::value<int>()->default_value(10000), "maximum number of negative cache entries")
+    ("drop_param", po::value<std::vector<std::string> >(), "query parameter left out of the cache key, a trailing * matches a prefix")
+    ("cache_post", po::value<std::vector<std::string> >(), "cache POST requests to paths starting with this prefix, keyed on their body")
+    ("breaker_cooldown", po::value<int>()->default_value(5000), "milliseconds a tripped destination is skipped before a probe")
+    ("connect_timeout", po::value<int>()->default_value(3000), "milliseconds to connect to a destination, 0 disables")
+    ("request_timeout", po::value<int>()->default_value(10000), "milliseconds to read the client request, 0 disables")
+    ("first_byte_timeout", po::value<int>()->default_value(30000), "milliseconds until the first response byte, 0 disables")
+    ("idle_timeout", po::value<int>()->default_value(10000), "milliseconds between response bytes, 0 disables")
+    ("total_timeout", po::value<int>()->default_value(60000), "milliseconds budget of a request across all destinations, 0 disables")
+    ("shm_cache_mb", po::value<int>()->default_value(0), "megabytes of hot cache in shared memory, kept across restarts, 0 disables")
+    ("shm_slot_kb", po::value<int>()->default_value(64), "kilobytes per shared memory cache slot, larger responses are not kept there")
+    ("drain_timeout", po::value<int>()->default_value(30000), "milliseconds requests in flight get to finish after SIGUSR2 hands the listener over")
+    ("inherit_listener", po::value<std::string>(), "internal: Unix socket the listener is received on during an upgrade")
+    ("workers",   po::value<int>()->default_value(1), "accepting threads, each with its own SO_REUSEPORT listener pinned to a cpu; 0 means one per cpu")
+    ("backlog",   po::value<int>()->default_value(64), "listen backlog of every listener")
+    ("write_behind_mb", po::value<int>()->default_value(64), "megabytes of cache writes queued for the background writer, 0 writes on the request thread")
+    ("fsync",     po::value<std::string>()->default_value("none"), "when cache files are fsynced: none, batch (one syncfs per written batch) or always")
+    ("max_inflight", po::value<int>()->default_value(0), "requests served at once, the rest queue with cache hits first; 0 disables admission control")
+    ("max_queue", po::value<int>()->default_value(128), "requests waiting for admission before new ones get a 503")
+    ("max_per_dest", po::value<int>()->default_value(0), "requests in flight to one destination, 0 is unlimited")
+    ("codel_target", po::value<int>()->default_value(5), "ms of queueing delay tolerated before misses are shed")
+    ("codel_interval", po::value<int>()->default_value(100), "ms the queueing delay must stay above target to count as overload")
+    ("prefetch_rate", po::value<double>()->default_value(0), "background fetches per second of paths predicted to be requested next, 0 disables prefetching")
+    ("prefetch_confidence", po::value<double>()->default_value(0.6), "share of the observed transitions a path must follow to be prefetched")
+    ("prefetch_paths", po::value<int>()->default_value(10000), "paths (and clients) the prefetch model remembers")
+    ("trace_sample", po::value<int>()->default_value(0), "trace the phases of one request in N, exported from /trace or to trace.<pid>.json on SIGUSR1; 0 disables tracing")
+    ("trace_requests", po::value<int>()->default_value(1000), "traced requests kept for export")
+    ("io_uring",                            "accept and serve disk hits through io_uring when the kernel supports it")
     ("debug",                               "debug mode");
     ;
 
@@ -224,11 +630,10 @@ int main(int argc, char **argv) {
   std::vector<std::pair<std::string, std::string> > dests;
   bool is_debug = false;
   parse_command_line(vm, port, data_dir, dests, is_debug);
-  int hit = 0;
   if (is_debug) {
     debug(port, data_dir, dests);
   }
   else {
-    return daemon(port, hit, data_dir, dests);
+    return daemon(port, data_dir, dests);
   }
 }
@@ -0,0 +1,231 @@
+#include "memory_pool.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+#ifdef COUNT_HEAP_ALLOCS
+std::atomic<uint64_t> heap_allocs(0);
+#endif
+std::atomic<uint64_t> pool_mallocs(0);
+std::atomic<uint64_t> pool_acquires(0);
+std::atomic<uint64_t> pool_releases(0);
+std::atomic<uint64_t> pool_thread_hits(0);
+std::atomic<uint64_t> arena_allocs(0);
+std::atomic<uint64_t> arena_mallocs(0);
+std::atomic<uint64_t> arena_resets(0);
+
+struct ThreadCache {
+  ThreadCache() : count(0) {}
+  ~ThreadCache() {
+    BufferPool::instance().flush_thread_cache();
+  }
+  char* buffers[BufferPool::THREAD_CACHE_SIZE];
+  std::size_t count;
+};
+
+thread_local ThreadCache thread_cache;
+
+inline void bump(std::atomic<uint64_t>& counter) {
+  counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+}
+
+#ifdef COUNT_HEAP_ALLOCS
+// replaces the global operator new so heap_allocs sees every allocation,
+// the standard containers' included; new[] and nothrow new come through here.
+// Only in builds with -DCOUNT_HEAP_ALLOCS, it puts an atomic add on every
+// allocation in the process
+void* operator new(std::size_t size) {
+  bump(heap_allocs);
+  if (size == 0) {
+    size = 1;
+  }
+  void* p;
+  while ((p = std::malloc(size)) == nullptr) {
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+#endif
+
+BufferPool& BufferPool::instance() {
+  static BufferPool* pool = new BufferPool; // never destroyed, threads may outlive main
+  return *pool;
+}
+
+char* BufferPool::acquire() {
+  bump(pool_acquires);
+  ThreadCache& cache = thread_cache;
+  if (cache.count > 0) {
+    bump(pool_thread_hits);
+    return cache.buffers[--cache.count];
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_list != nullptr) {
+      FreeBuffer* fb = free_list;
+      free_list = fb->next;
+      --free_count;
+      return reinterpret_cast<char*>(fb);
+    }
+  }
+  bump(pool_mallocs);
+  char* buffer = static_cast<char*>(std::malloc(BUFFER_SIZE));
+  if (buffer == nullptr) {
+    throw std::bad_alloc();
+  }
+  return buffer;
+}
+
+void BufferPool::release(char* buffer) {
+  if (buffer == nullptr) {
+    return;
+  }
+  bump(pool_releases);
+  ThreadCache& cache = thread_cache;
+  if (cache.count < THREAD_CACHE_SIZE) {
+    cache.buffers[cache.count++] = buffer;
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  FreeBuffer* fb = reinterpret_cast<FreeBuffer*>(buffer);
+  fb->next = free_list;
+  free_list = fb;
+  ++free_count;
+}
+
+void BufferPool::flush_thread_cache() {
+  ThreadCache& cache = thread_cache;
+  std::lock_guard<std::mutex> lock(mutex);
+  while (cache.count > 0) {
+    FreeBuffer* fb = reinterpret_cast<FreeBuffer*>(cache.buffers[--cache.count]);
+    fb->next = free_list;
+    free_list = fb;
+    ++free_count;
+  }
+}
+
+MemoryStats BufferPool::stats() const {
+  MemoryStats s;
+#ifdef COUNT_HEAP_ALLOCS
+  s.heap_allocs = heap_allocs.load(std::memory_order_relaxed);
+#else
+  s.heap_allocs = 0;
+#endif
+  s.pool_mallocs = pool_mallocs.load(std::memory_order_relaxed);
+  s.pool_acquires = pool_acquires.load(std::memory_order_relaxed);
+  s.pool_releases = pool_releases.load(std::memory_order_relaxed);
+  s.pool_thread_hits = pool_thread_hits.load(std::memory_order_relaxed);
+  s.arena_allocs = arena_allocs.load(std::memory_order_relaxed);
+  s.arena_mallocs = arena_mallocs.load(std::memory_order_relaxed);
+  s.arena_resets = arena_resets.load(std::memory_order_relaxed);
+  std::lock_guard<std::mutex> lock(mutex);
+  s.pool_free = free_count;
+  return s;
+}
+
+MemoryStats memory_stats() {
+  return BufferPool::instance().stats();
+}
+
+Arena::Arena() : head(nullptr), cursor(nullptr), limit(nullptr),
+                 bytes_used(0) {}
+
+Arena::~Arena() {
+  free_blocks(head);
+}
+
+Arena::Block* Arena::new_block(std::size_t size) {
+  Block* block;
+  if (size + sizeof(Block) + ALIGNMENT <= BufferPool::BUFFER_SIZE) {
+    block = reinterpret_cast<Block*>(BufferPool::instance().acquire());
+    block->pooled = true;
+    size = BufferPool::BUFFER_SIZE;
+  }
+  else {
+    bump(arena_mallocs);
+    size += sizeof(Block) + ALIGNMENT;
+    block = static_cast<Block*>(std::malloc(size));
+    if (block == nullptr) {
+      throw std::bad_alloc();
+    }
+    block->pooled = false;
+  }
+  block->next = head;
+  head = block;
+  cursor = reinterpret_cast<char*>(block) + sizeof(Block);
+  limit = reinterpret_cast<char*>(block) + size;
+  return block;
+}
+
+void* Arena::allocate(std::size_t size, std::size_t align) {
+  bump(arena_allocs);
+  uintptr_t p = reinterpret_cast<uintptr_t>(cursor);
+  uintptr_t aligned = (p + align - 1) & ~(uintptr_t(align) - 1);
+  if (cursor == nullptr || aligned + size > reinterpret_cast<uintptr_t>(limit)) {
+    new_block(size + align);
+    p = reinterpret_cast<uintptr_t>(cursor);
+    aligned = (p + align - 1) & ~(uintptr_t(align) - 1);
+  }
+  cursor = reinterpret_cast<char*>(aligned + size);
+  bytes_used += size;
+  return reinterpret_cast<void*>(aligned);
+}
+
+void Arena::free_blocks(Block* block) {
+  while (block != nullptr) {
+    Block* next = block->next;
+    if (block->pooled) {
+      BufferPool::instance().release(reinterpret_cast<char*>(block));
+    }
+    else {
+      std::free(block);
+    }
+    block = next;
+  }
+}
+
+void Arena::reset() {
+  bump(arena_resets);
+  bytes_used = 0;
+  if (head == nullptr) {
+    return;
+  }
+  // keep the oldest pooled block for the next request, give back the rest
+  Block* keep = nullptr;
+  Block* block = head;
+  Block* rest = nullptr;
+  while (block != nullptr) {
+    Block* next = block->next;
+    if (next == nullptr && block->pooled) {
+      keep = block;
+    }
+    else {
+      block->next = rest;
+      rest = block;
+    }
+    block = next;
+  }
+  free_blocks(rest);
+  head = keep;
+  if (keep != nullptr) {
+    keep->next = nullptr;
+    cursor = reinterpret_cast<char*>(keep) + sizeof(Block);
+    limit = reinterpret_cast<char*>(keep) + BufferPool::BUFFER_SIZE;
+  }
+  else {
+    cursor = limit = nullptr;
+  }
+}
@@ -0,0 +1,163 @@
+#ifndef MEMORY_POOL_H
+#define MEMORY_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+// Counters for every allocation the memory subsystem makes.  The *_mallocs
+// fields only move when the pools have to go to the heap, so in steady state
+// they should stay flat while the *_acquires/*_allocs fields keep growing.
+// heap_allocs counts every operator new in the process, in builds with
+// -DCOUNT_HEAP_ALLOCS only; a disk hit in steady state should not move it.
+struct MemoryStats {
+  uint64_t heap_allocs;
+  uint64_t pool_mallocs;
+  uint64_t pool_acquires;
+  uint64_t pool_releases;
+  uint64_t pool_thread_hits;
+  uint64_t pool_free;
+  uint64_t arena_allocs;
+  uint64_t arena_mallocs;
+  uint64_t arena_resets;
+};
+
+// Global pool of fixed size I/O buffers.  Each thread keeps a small cache of
+// buffers so the common acquire/release pair never takes the global lock.
+class BufferPool {
+  public:
+    static const std::size_t BUFFER_SIZE = 8192;
+    static const std::size_t THREAD_CACHE_SIZE = 8;
+
+    static BufferPool& instance();
+
+    char* acquire();
+    void release(char* buffer);
+
+    // return the buffers cached by the calling thread to the global list
+    void flush_thread_cache();
+
+    MemoryStats stats() const;
+
+  private:
+    BufferPool() : free_list(nullptr), free_count(0) {}
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    struct FreeBuffer {
+      FreeBuffer* next;
+    };
+
+    mutable std::mutex mutex;
+    FreeBuffer* free_list;
+    std::size_t free_count;
+};
+
+// RAII handle on a pool buffer, replaces the 8 KB stack buffers.
+class PooledBuffer {
+  public:
+    PooledBuffer() : buffer(BufferPool::instance().acquire()) {}
+    ~PooledBuffer() { BufferPool::instance().release(buffer); }
+
+    char* data() const { return buffer; }
+    static std::size_t size() { return BufferPool::BUFFER_SIZE; }
+
+  private:
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    char* buffer;
+};
+
+// Per connection bump allocator.  Blocks come from the BufferPool so a new
+// connection reuses memory released by the previous one; reset() hands back
+// everything but the first block at the end of each request.
+class Arena {
+  public:
+    static const std::size_t ALIGNMENT = 16;
+
+    Arena();
+    ~Arena();
+
+    void* allocate(std::size_t size, std::size_t align = ALIGNMENT);
+    void reset();
+    std::size_t used() const { return bytes_used; }
+
+  private:
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    struct Block {
+      Block* next;
+      bool pooled;
+    };
+
+    Block* new_block(std::size_t size);
+    void free_blocks(Block* block);
+
+    Block* head;
+    char* cursor;
+    char* limit;
+    std::size_t bytes_used;
+};
+
+// Minimal allocator so standard containers can live in an Arena.  Memory is
+// only reclaimed when the arena is reset.
+template <typename T>
+class ArenaAllocator {
+  public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef std::size_t size_type;
+    typedef std::ptrdiff_t difference_type;
+
+    template <typename U>
+    struct rebind {
+      typedef ArenaAllocator<U> other;
+    };
+
+    explicit ArenaAllocator(Arena& a) : arena(&a) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(std::size_t n) {
+      return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, std::size_t) {}
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+      ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+    template <typename U>
+    void destroy(U* p) { p->~U(); }
+
+    std::size_t max_size() const { return std::size_t(-1) / sizeof(T); }
+
+    Arena* arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+  return a.arena != b.arena;
+}
+
+typedef std::map<std::string, std::string, std::less<std::string>,
+                 ArenaAllocator<std::pair<const std::string, std::string> > >
+  HeaderMap;
+
+MemoryStats memory_stats();
+
+#endif
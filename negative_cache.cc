@@ -0,0 +1,55 @@
+#include "negative_cache.h"
+
+NegativeCache::NegativeCache(std::chrono::seconds t, std::size_t max) :
+  ttl(t), max_entries(max) {}
+
+bool NegativeCache::cacheable(int code) {
+  switch (code) {
+  case 404:
+  case 405:
+  case 410:
+  case 414:
+  case 501:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void NegativeCache::expire(Clock::time_point now) {
+  while (!order.empty() &&
+         (order.front().first <= now || entries.size() > max_entries)) {
+    auto it = entries.find(order.front().second);
+    // only drop the entry if it was not stored again since
+    if (it != entries.end() && it->second.expires == order.front().first) {
+      entries.erase(it);
+    }
+    order.pop_front();
+  }
+}
+
+void NegativeCache::store(uint64_t key, int code, const std::string& response) {
+  if (max_entries == 0 || ttl.count() == 0) {
+    return;
+  }
+  Clock::time_point now = Clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  Entry& entry = entries[key];
+  entry.expires = now + ttl;
+  entry.code = code;
+  entry.response = response;
+  order.push_back(std::make_pair(entry.expires, key));
+  expire(now);
+}
+
+bool NegativeCache::lookup(uint64_t key, std::string& response) {
+  Clock::time_point now = Clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  expire(now);
+  auto it = entries.find(key);
+  if (it == entries.end()) {
+    return false;
+  }
+  response = it->second.response;
+  return true;
+}
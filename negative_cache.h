@@ -0,0 +1,44 @@
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Short lived in memory tier for 404s and other cacheable error responses,
+// so repeated lookups of missing resources are answered locally instead of
+// going upstream every time.  All entries share one TTL, so insertion order
+// is also expiry order and the oldest entry is the one evicted when full.
+class NegativeCache {
+  public:
+    NegativeCache(std::chrono::seconds ttl, std::size_t max_entries);
+
+    // status codes that are cacheable by default (RFC 7231 section 6.1)
+    static bool cacheable(int code);
+
+    void store(uint64_t key, int code, const std::string& response);
+    bool lookup(uint64_t key, std::string& response);
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry {
+      Clock::time_point expires;
+      int code;
+      std::string response;
+    };
+
+    void expire(Clock::time_point now);
+
+    std::mutex mutex;
+    std::chrono::seconds ttl;
+    std::size_t max_entries;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::deque<std::pair<Clock::time_point, uint64_t> > order;
+};
+
+#endif
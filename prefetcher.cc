@@ -0,0 +1,323 @@
+#include "prefetcher.h"
+#include "admission.h"
+#include "cache_key.h"
+#include "cache_store.h"
+#include "dest_health.h"
+#include "h2c_client.h"
+#include "memory_pool.h"
+#include "seastate.h"
+#include "timer_wheel.h"
+
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <sstream>
+
+static const std::size_t MAX_QUEUE = 64;
+
+Prefetcher::Prefetcher(
+  const std::vector<std::pair<std::string, std::string> >& destinations,
+  std::size_t paths, double conf, double r,
+  const std::shared_ptr<DestinationHealth>& dh,
+  const std::shared_ptr<AdmissionController>& ac,
+  const std::shared_ptr<const CacheKeyBuilder>& kb, const Timeouts& t,
+  const std::vector<std::shared_ptr<H2cClient> >& h2c) :
+  max_paths(std::max<std::size_t>(paths, 1)), confidence(conf), rate(r),
+  tokens(r), refilled(Clock::now()), health(dh), admission(ac),
+  key_builder(kb), timeouts(t), issued(0), stored(0), used(0), misses(0),
+  skipped(0), stopping(false) {
+  for (std::size_t i = 0; i < destinations.size(); ++i) {
+    auto& dest = destinations[i];
+    Dest d;
+    d.name = dest.first + ":" + dest.second;
+    d.resolved = false;
+    if (i < h2c.size()) {
+      d.h2c = h2c[i];
+    }
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(dest.first.c_str(), dest.second.c_str(), &hints,
+                    &result) == 0 && result != nullptr) {
+      memcpy(&d.addr, result->ai_addr, sizeof(d.addr));
+      d.resolved = true;
+    }
+    if (result != nullptr) {
+      freeaddrinfo(result);
+    }
+    dests.push_back(d);
+  }
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void Prefetcher::observe(const std::string& client, const std::string& path,
+                         uint64_t hash, bool miss) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto p = prefetched.find(hash);
+  if (!miss && p != prefetched.end() && !p->second) {
+    p->second = true;
+    ++used;
+  }
+  else if (miss) {
+    ++misses;
+  }
+  auto last = last_path.find(client);
+  if (last == last_path.end()) {
+    if (last_path.size() >= max_paths) {
+      last_path.erase(client_order.front());
+      client_order.pop_front();
+    }
+    client_order.push_back(client);
+    last = last_path.insert(std::make_pair(client, std::string())).first;
+  }
+  if (!last->second.empty() && last->second != path) {
+    learn(last->second, path);
+  }
+  last->second = path;
+  predict(path);
+}
+
+// Space-Saving: a new successor replaces the least counted one and inherits
+// its count, so the heavy hitters survive in SUCCESSORS slots
+void Prefetcher::learn(const std::string& from, const std::string& to) {
+  auto it = model.find(from);
+  if (it == model.end()) {
+    if (model.size() >= max_paths) {
+      model.erase(model_order.front());
+      model_order.pop_front();
+    }
+    model_order.push_back(from);
+    it = model.insert(std::make_pair(from, Transitions())).first;
+    it->second.total = 0;
+  }
+  Transitions& transitions = it->second;
+  ++transitions.total;
+  for (auto& next : transitions.next) {
+    if (next.path == to) {
+      ++next.count;
+      return;
+    }
+  }
+  if (transitions.next.size() < SUCCESSORS) {
+    transitions.next.push_back(Successor{to, 1});
+    return;
+  }
+  auto least = std::min_element(
+    transitions.next.begin(), transitions.next.end(),
+    [](const Successor& a, const Successor& b) { return a.count < b.count; });
+  least->path = to;
+  ++least->count;
+}
+
+void Prefetcher::predict(const std::string& from) {
+  auto it = model.find(from);
+  if (it == model.end() || it->second.total < MIN_SUPPORT) {
+    return;
+  }
+  bool queued = false;
+  for (auto& next : it->second.next) {
+    if (next.count < confidence * it->second.total ||
+        queue.size() >= MAX_QUEUE ||
+        std::find(queue.begin(), queue.end(), next.path) != queue.end()) {
+      continue;
+    }
+    queue.push_back(next.path);
+    queued = true;
+  }
+  if (queued) {
+    // started here rather than in the constructor, after the daemon forked
+    if (!thread.joinable()) {
+      thread = std::thread(&Prefetcher::run, this);
+    }
+    wake.notify_one();
+  }
+}
+
+bool Prefetcher::take_token() {
+  Clock::time_point now = Clock::now();
+  tokens = std::min(rate, tokens + rate *
+    std::chrono::duration<double>(now - refilled).count());
+  refilled = now;
+  if (tokens < 1) {
+    return false;
+  }
+  tokens -= 1;
+  return true;
+}
+
+void Prefetcher::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [this] { return stopping || !queue.empty(); });
+    if (stopping) {
+      break;
+    }
+    std::string path = queue.front();
+    queue.pop_front();
+    if (!take_token()) {
+      ++skipped; // over budget
+      continue;
+    }
+    lock.unlock();
+    uint64_t hash = 0;
+    bool ok = false;
+    bool admitted = !admission || admission->try_admit();
+    if (admitted) {
+      ok = fetch(path, hash);
+      if (admission) {
+        admission->release();
+      }
+    }
+    lock.lock();
+    if (!admitted) {
+      ++skipped;
+    }
+    else if (ok) {
+      ++stored;
+      if (prefetched.size() >= max_paths) {
+        prefetched.erase(prefetched_order.front());
+        prefetched_order.pop_front();
+      }
+      if (prefetched.insert(std::make_pair(hash, false)).second) {
+        prefetched_order.push_back(hash);
+      }
+    }
+  }
+}
+
+bool Prefetcher::fetch(const std::string& path, uint64_t& hash) {
+  uint64_t base;
+  if (key_builder) {
+    hash = key_builder->key(Method::GET, path,
+                            std::map<std::string, std::string>(),
+                            std::string(), base);
+    if (hash != base) {
+      return false; // varies on request headers we don't have
+    }
+  }
+  else {
+    SeaState state;
+    hash = base = state.hash(path);
+  }
+  if (is_cached(hash)) {
+    return false;
+  }
+  std::vector<std::size_t> order;
+  if (health) {
+    order = health->order();
+  }
+  else {
+    for (std::size_t i = 0; i < dests.size(); ++i) {
+      order.push_back(i);
+    }
+  }
+  for (auto i : order) {
+    const Dest& dest = dests[i];
+    if (!dest.resolved) {
+      continue;
+    }
+    if (admission && !admission->acquire_dest(i)) {
+      continue;
+    }
+    if (health && !health->acquire(i)) {
+      if (admission) {
+        admission->release_dest(i);
+      }
+      continue;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++issued;
+    }
+    auto start = Clock::now();
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + dest.name +
+      "\r\nUser-Agent: http_caching_proxy/" + VERSION +
+      " prefetch\r\nConnection: close\r\n\r\n";
+    std::string response;
+    int code = 0;
+    bool timed_out;
+    int sock = dest.h2c ? -1 :
+      socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (dest.h2c) {
+      h2c_fetch(*dest.h2c, request, response, timeouts, timed_out);
+    }
+    else if (sock >= 0) {
+      {
+        SocketDeadline deadline(sock, SHUT_RDWR, timeouts.connect);
+        bool connected =
+          ::connect(sock, reinterpret_cast<const sockaddr*>(&dest.addr),
+                    sizeof(dest.addr)) == 0;
+        deadline.restart(timeouts.first_byte);
+        if (connected &&
+            send(sock, request.data(), request.size(), MSG_NOSIGNAL) ==
+            static_cast<ssize_t>(request.size())) {
+          PooledBuffer buffer;
+          ssize_t n;
+          while ((n = recv(sock, buffer.data(), PooledBuffer::size(), 0)) > 0) {
+            response.append(buffer.data(), n);
+            deadline.restart(timeouts.idle);
+          }
+          if (n < 0 || deadline.expired()) {
+            response.clear();
+          }
+        }
+      }
+      // the deadline is gone, it can't shut down whatever reuses the fd
+      close(sock);
+    }
+    std::istringstream status(response);
+    std::string version;
+    status >> version >> code;
+    if (version.compare(0, 5, "HTTP/") != 0) {
+      code = 0;
+    }
+    if (health) {
+      health->release(i, code > 0 && code < 500,
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          Clock::now() - start));
+    }
+    if (admission) {
+      admission->release_dest(i);
+    }
+    if (code == 0) {
+      continue;
+    }
+    // stored the way ServerMain::save_response stores what it relays
+    if (code >= 399 ||
+        parse_header_fields(response).count("vary") != 0 ||
+        !dechunk_response(response)) {
+      return false;
+    }
+    store_cached_response(hash, request, response);
+    return true;
+  }
+  return false;
+}
+
+std::string Prefetcher::report() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::ostringstream oss;
+  oss << "{\"paths\":" << model.size() << ",\"queued\":" << queue.size()
+      << ",\"issued\":" << issued << ",\"stored\":" << stored
+      << ",\"used\":" << used << ",\"misses\":" << misses
+      << ",\"skipped\":" << skipped
+      << ",\"precision\":" << (stored ? double(used) / stored : 0.0)
+      << ",\"recall\":" << (used + misses ? double(used) / (used + misses) : 0.0)
+      << "}";
+  return oss.str();
+}
@@ -0,0 +1,116 @@
+#ifndef PREFETCHER_H
+#define PREFETCHER_H
+
+#include <netinet/in.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "http_caching_proxy.h"
+
+class DestinationHealth;
+class AdmissionController;
+class CacheKeyBuilder;
+class H2cClient;
+
+// Learns which path a client asks for after which, and fetches the likely
+// next paths into the cache ahead of the client.  The model keeps at most
+// max_paths source paths with SUCCESSORS counted successors each; a
+// successor is prefetched once it follows its source in at least
+// confidence of MIN_SUPPORT or more observations.  Prefetches are paced by
+// a token bucket of rate per second, go to one background thread and count
+// against the admission limits like any upstream fetch.
+//
+// precision = prefetched entries later requested / prefetched entries
+// recall    = requests served by a prefetch / (those + upstream misses)
+class Prefetcher {
+  public:
+    static const std::size_t SUCCESSORS = 4;
+    static const uint32_t MIN_SUPPORT = 3;
+
+    Prefetcher(const std::vector<std::pair<std::string, std::string> >& dests,
+               std::size_t max_paths, double confidence, double rate,
+               const std::shared_ptr<DestinationHealth>& health,
+               const std::shared_ptr<AdmissionController>& admission,
+               const std::shared_ptr<const CacheKeyBuilder>& key_builder,
+               const Timeouts& timeouts,
+               const std::vector<std::shared_ptr<H2cClient> >& h2c);
+    ~Prefetcher();
+
+    // a cacheable GET from client for path, answered from the cache or not
+    void observe(const std::string& client, const std::string& path,
+                 uint64_t hash, bool miss);
+
+    std::string report() const;
+
+  private:
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    struct Successor {
+      std::string path;
+      uint32_t count;
+    };
+
+    struct Transitions {
+      uint32_t total;
+      std::vector<Successor> next;
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    void learn(const std::string& from, const std::string& to);
+    void predict(const std::string& from);
+    bool take_token();
+    void run();
+    bool fetch(const std::string& path, uint64_t& hash);
+
+    struct Dest {
+      std::string name;
+      sockaddr_in addr;
+      bool resolved;
+      std::shared_ptr<H2cClient> h2c; // null for HTTP/1.1
+    };
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<Dest> dests;
+    std::size_t max_paths;
+    double confidence;
+    double rate;
+    double tokens;
+    Clock::time_point refilled;
+    std::shared_ptr<DestinationHealth> health;
+    std::shared_ptr<AdmissionController> admission;
+    std::shared_ptr<const CacheKeyBuilder> key_builder;
+    Timeouts timeouts;
+
+    std::unordered_map<std::string, Transitions> model;
+    std::deque<std::string> model_order;
+    std::unordered_map<std::string, std::string> last_path; // per client
+    std::deque<std::string> client_order;
+    std::unordered_map<uint64_t, bool> prefetched; // hash -> used
+    std::deque<uint64_t> prefetched_order;
+    std::deque<std::string> queue;
+
+    uint64_t issued;
+    uint64_t stored;
+    uint64_t used;
+    uint64_t misses;
+    uint64_t skipped;
+
+    bool stopping;
+    std::thread thread;
+};
+
+#endif
@@ -3,6 +3,50 @@ LD_LIBRARY_PATH=/bb/blaw/tools/gcc-4_8_0/4.8.0/lib64
 LD_LIBRARY_PATH=${LD_LIBRARY_PATH}:/bb/blaw/tools/boost-1_52_0/4.8.0/lib
 
 export LD_LIBRARY_PATH
+
+# ./run.sh cluster: two proxies on localhost peering with each other in
+# front of a python upstream.  Entries fetched through the first must still
+# be served by the second once the upstream is gone.
+if [ "$1" = "cluster" ]; then
+    dir=$(mktemp -d)
+    mkdir -p $dir/up $dir/a $dir/b
+    for i in 1 2 3 4 5 6 7 8; do
+        echo "{\"n\":$i}" > $dir/up/p$i.json
+    done
+    (cd $dir/up && exec python3 -m http.server 8290 >/dev/null 2>&1) &
+    upstream=$!
+    peers="--peer localhost:8281 --peer localhost:8282 --replicate"
+    ./http_caching_proxy --data_dir $dir/a --port 8281 $peers \
+        --dest localhost:8290 --debug >$dir/a.log 2>&1 &
+    a=$!
+    ./http_caching_proxy --data_dir $dir/b --port 8282 $peers \
+        --dest localhost:8290 --debug >$dir/b.log 2>&1 &
+    b=$!
+    sleep 1
+    for i in 1 2 3 4 5 6 7 8; do
+        curl -s -o /dev/null http://localhost:8281/p$i.json
+    done
+    sleep 1
+    kill $upstream
+    failed=0
+    for i in 1 2 3 4 5 6 7 8; do
+        if ! curl -s http://localhost:8282/p$i.json | cmp -s - $dir/up/p$i.json
+        then
+            echo "p$i.json: not served by the cluster"
+            failed=1
+        fi
+    done
+    kill $a $b
+    wait 2>/dev/null
+    if [ $failed = 0 ]; then
+        echo "cluster: ok"
+        rm -rf $dir
+    else
+        echo "cluster: failed, logs in $dir"
+    fi
+    exit $failed
+fi
+
 ./http_caching_proxy --data_dir htdocs \
     --rest_data rest_data.json --port 8080 \
     --dest vsearch-alpha.bdns.bloomberg.com:7777 --debug
@@ -1,10 +1,15 @@
 #include "server_main.h"
 #include "http_caching_proxy.h"
 #include "seastate.h"
+#include "cache_store.h"
+#include "timer_wheel.h"
+#include "cache_key.h"
+#include "upgrade.h"
 
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -15,18 +20,83 @@
 #include <map>
 #include <memory>
 #include <future>
+#include <thread>
 #include <chrono>
 #include <ctime>
 #include <iomanip>
+#include <algorithm>
 
-static const unsigned short BUFSIZE = 8192;
+static const unsigned short BUFSIZE = BufferPool::BUFFER_SIZE;
 static const int HEADER    =   45;
 static const int FORBIDDEN =  403;
 static const int NOTFOUND  =  404;
 
-void cleanup(std::unique_ptr<ServerMain>& up) {
-  ServerMain* sm = up.release();
-  delete sm;
+static const std::string NOT_FOUND_RESPONSE =
+  "HTTP/1.1 404 Not Found\nContent-Length: 43\n"
+  "Connection: close\nContent-Type: application/json\n\n"
+  "{\"code\":404,\"message\":\"HTTP 404 Not Found\"}";
+
+static const std::string BAD_GATEWAY_RESPONSE =
+  "HTTP/1.1 502 Bad Gateway\nContent-Length: 45\n"
+  "Connection: close\nContent-Type: application/json\n\n"
+  "{\"code\":502,\"message\":\"HTTP 502 Bad Gateway\"}";
+
+static const std::string GATEWAY_TIMEOUT_RESPONSE =
+  "HTTP/1.1 504 Gateway Timeout\nContent-Length: 49\n"
+  "Connection: close\nContent-Type: application/json\n\n"
+  "{\"code\":504,\"message\":\"HTTP 504 Gateway Timeout\"}";
+
+static const std::string SERVICE_UNAVAILABLE_RESPONSE =
+  "HTTP/1.1 503 Service Unavailable\nRetry-After: 1\nContent-Length: 53\n"
+  "Connection: close\nContent-Type: application/json\n\n"
+  "{\"code\":503,\"message\":\"HTTP 503 Service Unavailable\"}";
+
+static const std::string FORBIDDEN_RESPONSE =
+  "HTTP/1.1 403 Forbidden\nContent-Length: 43\n"
+  "Connection: close\nContent-Type: application/json\n\n"
+  "{\"code\":403,\"message\":\"HTTP 403 Forbidden\"}";
+
+static const std::string BAD_REQUEST_RESPONSE =
+  "HTTP/1.1 400 Bad Request\nContent-Length: 45\n"
+  "Connection: close\nContent-Type: application/json\n\n"
+  "{\"code\":400,\"message\":\"HTTP 400 Bad Request\"}";
+
+static const std::string REQUEST_TIMEOUT_RESPONSE =
+  "HTTP/1.1 408 Request Timeout\nContent-Length: 49\n"
+  "Connection: close\nContent-Type: application/json\n\n"
+  "{\"code\":408,\"message\":\"HTTP 408 Request Timeout\"}";
+
+// connection objects kept for reuse, and the largest request or response
+// capacity one keeps
+static const std::size_t POOL_SIZE = 256;
+static const std::size_t KEPT_CAPACITY = 64 * 1024;
+
+static std::mutex pool_mutex;
+static std::vector<ServerMain*> pool;
+
+std::unique_ptr<ServerMain> ServerMain::acquire() {
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (!pool.empty()) {
+      std::unique_ptr<ServerMain> sm{pool.back()};
+      pool.pop_back();
+      return sm;
+    }
+  }
+  return std::unique_ptr<ServerMain>{new ServerMain};
+}
+
+// ends the connection and puts its object back in the pool
+void recycle(std::unique_ptr<ServerMain>& up) {
+  std::unique_ptr<ServerMain> sm = std::move(up);
+  sm->finish();
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  if (pool.size() < POOL_SIZE) {
+    if (pool.capacity() < POOL_SIZE) {
+      pool.reserve(POOL_SIZE);
+    }
+    pool.push_back(sm.release());
+  }
 }
 
 bool ServerMain::get_response(const std::string& bufStr, int& code) const {
@@ -44,7 +114,7 @@ bool ServerMain::get_response(const std::string& bufStr, int& code) const {
   }
 }
 
-int ServerMain::connect(const std::string& host, const std::string& port) const {
+int ServerMain::connect(const std::string& host, const std::string& port) {
   int hit = threadArgs.hit;
   int sock = 0;
   addrinfo* result;
@@ -53,61 +123,142 @@ int ServerMain::connect(const std::string& host, const std::string& port) const
   hints->ai_family = AF_INET;
   hints->ai_socktype = SOCK_STREAM;
   hints->ai_protocol = IPPROTO_TCP;
-  getaddrinfo(host.c_str(), port.c_str(), hints.get(), &result);
-  const addrinfo* s = nullptr;
   std::ostringstream oss;
+  if (getaddrinfo(host.c_str(), port.c_str(), hints.get(), &result) != 0) {
+    oss << "Can't resolve host: " << host << ":" << port;
+    logger(ERROR, "connect", oss, sock, hit);
+    return -1;
+  }
+  const addrinfo* s = nullptr;
   for (s = result; s != nullptr; s = s->ai_next) {
     if ((sock = socket(s->ai_family, s->ai_socktype, s->ai_protocol)) < 0) {
       oss << "Can't create socket for: " << host << ":" << port;
       logger(ERROR, "connect", oss, sock, hit);
     }
-    else if (::connect(sock, s->ai_addr, s->ai_addrlen) < 0) {
-      oss << "Can't connect to host: " << host << ":" << port;
-      logger(ERROR, "connect", oss, sock, hit);
+    else {
+      int rc;
+      bool timed_out;
+      {
+        // gone before the close below, or it could shut down a reused fd
+        SocketDeadline deadline(sock, SHUT_RDWR,
+                                phase_timeout(threadArgs.timeouts.connect));
+        rc = ::connect(sock, s->ai_addr, s->ai_addrlen);
+        timed_out = deadline.expired();
+      }
+      if (rc < 0) {
+        if (timed_out) {
+          oss << "Timed out connecting to host: " << host << ":" << port;
+          upstream_timed_out = true;
+        }
+        else {
+          oss << "Can't connect to host: " << host << ":" << port;
+        }
+        logger(ERROR, "connect", oss, sock, hit);
+        close(sock);
+        sock = -1;
+      }
     }
     break;
   }
   freeaddrinfo(result);
-  if (s == nullptr) {
-    oss << "Can't resolve host: " << host << ":" << port << " exiting.";
-    logger(ERROR, "connect", oss, sock, hit);
-    exit(7);
+  return s == nullptr ? -1 : sock;
+}
+
+// client sockets are accepted non blocking: wait for them rather than fail
+// with EAGAIN, a SocketDeadline shutdown wakes the poll up
+static bool wait_for(int fd, short events) {
+  pollfd pfd = {fd, events, 0};
+  int rc;
+  while ((rc = poll(&pfd, 1, -1)) < 0 && errno == EINTR) {
+  }
+  return rc > 0;
+}
+
+static bool send_all(int fd, const char* data, std::size_t length) {
+  while (length > 0) {
+    ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      if (!wait_for(fd, POLLOUT)) {
+        return false;
+      }
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    length -= n;
   }
-  return sock;
+  return true;
 }
 
 bool ServerMain::recv_request(const std::string& mode, int source,
                               int flags) {
   int hit = threadArgs.hit;
   ssize_t n;
-  char buffer[BUFSIZE];
-  memset(buffer, 0, BUFSIZE);
-  std::ostringstream oss;
+  PooledBuffer buffer;
+  char line[64];
 
-  logger(LOG, mode, "start", source, hit);
+  logger(LOG, mode.c_str(), "start", source, hit);
 
   // read data from input socket
-  if ((n = recv(source, buffer, BUFSIZE, flags)) > 0) {
-    oss << "recv " << n << " bytes";
-    logger(LOG, mode, oss, source, hit);
-    std::string bufStr(buffer, n);
-    logger(LOG, mode, bufStr, hit);
-    request += bufStr;
+  wait_for(source, POLLIN);
+  if ((n = recv(source, buffer.data(), BUFSIZE, flags)) > 0) {
+    snprintf(line, sizeof(line), "recv %zd bytes", n);
+    logger(LOG, mode.c_str(), line, source, hit);
+    request.append(buffer.data(), n);
+    logger(LOG, mode.c_str(), request.c_str() + request.size() - n, hit);
   }
 
-  bool try_again = false;
   if (n < 0 && errno != EAGAIN) {
-    oss << "recv " << n;
-    logger(ERROR, mode, oss, source, hit);
-    return try_again;
-  }
-  try_again = (n == 0 || n == BUFSIZE || (flags != 0 && errno == EAGAIN));
-  oss << "done with try_again = " << (try_again ? "true" : "false")
-      << " errno = " << errno << " error '" << strerror(errno) << "'";
-  logger(LOG, mode, oss, source, hit);
+    snprintf(line, sizeof(line), "recv %zd", n);
+    logger(ERROR, mode.c_str(), line, source, hit);
+    return false;
+  }
+  bool try_again = n > 0 && !request_complete();
+  logger(LOG, mode.c_str(), try_again ? "done with try_again = true" :
+         "done with try_again = false", source, hit);
   return try_again;
 }
 
+bool ServerMain::request_complete() const {
+  static const char NAME[] = "content-length:";
+  auto header_end = request.find("\r\n\r\n");
+  if (header_end == std::string::npos) {
+    return false;
+  }
+  std::string::size_type content_length = 0;
+  for (auto line = request.find('\n'); line < header_end;
+       line = request.find('\n', line + 1)) {
+    if (strncasecmp(request.c_str() + line + 1, NAME, sizeof(NAME) - 1) == 0) {
+      content_length = strtoul(request.c_str() + line + sizeof(NAME), nullptr,
+                               10);
+      break;
+    }
+  }
+  return request.size() >= header_end + 4 + content_length;
+}
+
+std::chrono::milliseconds
+ServerMain::phase_timeout(std::chrono::milliseconds phase) const {
+  const Timeouts& timeouts = threadArgs.timeouts;
+  if (timeouts.total.count() == 0) {
+    return phase;
+  }
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+    threadArgs.start + timeouts.total - std::chrono::steady_clock::now());
+  if (left.count() <= 0) {
+    left = std::chrono::milliseconds(1); // over budget, give up right away
+  }
+  return phase.count() == 0 || left < phase ? left : phase;
+}
+
+bool ServerMain::budget_exhausted() const {
+  const Timeouts& timeouts = threadArgs.timeouts;
+  return timeouts.total.count() != 0 &&
+    std::chrono::steady_clock::now() >= threadArgs.start + timeouts.total;
+}
+
 bool ServerMain::send_request(const std::string& mode, int destination) const {
   int hit = threadArgs.hit;
   ssize_t n;
@@ -222,7 +373,10 @@ bool ServerMain::forward_response(int source,
                                   int destination, int& code) {
   int hit = threadArgs.hit;
   ssize_t n;
-  char buffer[BUFSIZE];
+  // one byte is kept back for the terminator parse_headers() relies on
+  const ssize_t capacity = BUFSIZE - 1;
+  PooledBuffer pooled;
+  char* buffer = pooled.data();
   std::ostringstream oss;
   static const std::string mode = "response";
 
@@ -230,24 +384,37 @@ bool ServerMain::forward_response(int source,
 
   bool try_again = true;
   bool is_chunked = false;
+  bool chunked = false;
   response.clear();
   int recv_errno = 0;
   int send_errno = 0;
-  std::map<std::string, std::string> headers;
+  HeaderMap headers{std::less<std::string>(), HeaderMap::allocator_type(arena)};
+  std::string bufStr;
   int content_length = 0;
   int content_left = -1;
   unsigned chunk_left = -1;
+  bool received = false;
+  RequestTrace::Scope phase(trace, "first_byte");
+  SocketDeadline deadline(source, SHUT_RDWR,
+                          phase_timeout(threadArgs.timeouts.first_byte));
   while (try_again) {
     // read data from input socket
-    memset(buffer, 0, BUFSIZE);
     errno = 0;
-    if ((n = recv(source, buffer, BUFSIZE, 0)) > 0) {
+    if ((n = recv(source, buffer, capacity, 0)) > 0) {
+      buffer[n] = '\0';
+      if (!received) {
+        phase.next("last_byte");
+        received = true;
+      }
+      deadline.restart(phase_timeout(threadArgs.timeouts.idle));
+      // kept as it came, save_response decodes the chunks of the whole
+      response.append(buffer, n);
       if (is_chunked) {
         oss << "chunk_left = " << chunk_left << " ";
       }
       oss << "recv = " << n << " bytes";
       logger(LOG, mode, oss, source, hit);
-      std::string bufStr(buffer, n);
+      bufStr.assign(buffer, n);
       if (get_response(bufStr, code)) {
         oss << "code: " << code;
         logger(LOG, mode, oss, source, hit);
@@ -276,9 +443,9 @@ bool ServerMain::forward_response(int source,
       }
       else {
         parse_headers(buffer, headers);
-        if (headers[XFER_ENCODING] == CHUNKED) {
+        if (expect_body && headers[XFER_ENCODING] == CHUNKED) {
           logger(LOG, mode, XFER_ENCODING + ":" + CHUNKED, source, hit);  
-          is_chunked = true;
+          is_chunked = chunked = true;
           chunk_left = remove_chunk_header_info(bufStr);
           std::ostringstream oss;
           oss << "chunk_left = " << std::dec << chunk_left 
@@ -286,7 +453,7 @@ bool ServerMain::forward_response(int source,
           logger(LOG, mode, oss, source, hit);
         }
         auto content_len = headers.find(CONTENT_LEN);
-        if (content_len != headers.end()) {
+        if (expect_body && content_len != headers.end()) {
           std::istringstream iss(content_len->second);
           iss >> content_length;
           int buffer_content_length = get_buffer_content_length(bufStr);
@@ -304,10 +471,9 @@ bool ServerMain::forward_response(int source,
         }
       }
       logger(LOG, mode, bufStr, source, hit);
-      response += bufStr;
       errno = 0;
       // send data to output socket
-      if (send(destination, bufStr.c_str(),bufStr.size(), 0) < 0) {
+      if (!send_all(destination, bufStr.c_str(), bufStr.size())) {
         logger(ERROR, mode, "send", destination, hit);
       }
       send_errno = errno;
@@ -318,89 +484,406 @@ bool ServerMain::forward_response(int source,
       recv_errno = errno;
     }
 
+    if (deadline.expired()) {
+      logger(ERROR, mode, "upstream timed out", source, hit);
+      upstream_timed_out = true;
+      return false;
+    }
     if (n < 0 && errno != EAGAIN) {
       oss << "recv " << n;
       logger(ERROR, mode, oss, destination, hit);
       return false;
     }
     
-    try_again = (n == BUFSIZE) || (is_chunked && n > 0) || (content_left > 0);
+    try_again = (n == capacity) || (is_chunked && n > 0) || (content_left > 0);
     oss << "try_again = " << (try_again ? "true" : "false") << " recv_errno = "
         << recv_errno << " error '" << strerror(recv_errno) << "'"
         << " send_errno = " << send_errno << " error '" << strerror(send_errno) 
         << "'";
     logger(LOG, mode, oss, source, hit);
   }
-  return false;
+  // whole once the Content-Length arrived, the last chunk was seen (the
+  // chunks are checked again by save_response) or, with neither, the
+  // upstream closed
+  if (!received) {
+    return false;
+  }
+  if (!expect_body || code == 204 || code == 304) {
+    return true;
+  }
+  if (chunked) {
+    return !is_chunked || n == 0;
+  }
+  if (content_left != -1) {
+    return content_left <= 0;
+  }
+  return n == 0;
 }
 
-ServerMain::ServerMain(const ThreadArgs& ta) : threadArgs(ta) {}
+// The request as a stream on one of the destination's h2c connections, the
+// response relayed to the client as HTTP/1.1.  A response without a length
+// is buffered so the client and the cache get one.  False unless the whole
+// response arrived.
+bool ServerMain::forward_h2c(H2cClient& client, int& code) {
+  int hit = threadArgs.hit;
+  static const std::string mode = "h2c";
+  response.clear();
+  HeaderList headers;
+  std::string body;
+  if (!h2_request(request, client.authority(), headers, body)) {
+    logger(ERROR, mode, "malformed request", threadArgs.clntSock, hit);
+    return false;
+  }
+  H2cClient::Exchange exchange;
+  int status = 0;
+  HeaderList fields;
+  {
+    RequestTrace::Scope phase(trace, "connect");
+    bool ok = client.open(exchange, phase_timeout(threadArgs.timeouts.connect));
+    if (ok) {
+      phase.next("upstream_send");
+      ok = exchange.send(headers, body,
+                         phase_timeout(threadArgs.timeouts.request));
+    }
+    if (ok) {
+      phase.next("first_byte");
+      ok = exchange.response(status, fields,
+                             phase_timeout(threadArgs.timeouts.first_byte));
+    }
+    if (!ok) {
+      logger(ERROR, mode, exchange.timed_out() ? "upstream timed out" :
+             "no response from " + client.authority(), threadArgs.clntSock, hit);
+      upstream_timed_out = upstream_timed_out || exchange.timed_out();
+      return false;
+    }
+  }
+  std::ostringstream oss;
+  oss << "code: " << status;
+  logger(LOG, mode, oss, threadArgs.clntSock, hit);
+  if (status == NOTFOUND) {
+    code = status;
+    return true;
+  }
+  RequestTrace::Scope phase(trace, "last_byte");
+  bool streamed = !expect_body;
+  for (auto& field : fields) {
+    streamed = streamed || field.first == "content-length";
+  }
+  if (streamed) {
+    response = h1_response_head(status, fields, -1);
+    logger(LOG, mode, response, threadArgs.clntSock, hit);
+    if (!send_all(threadArgs.clntSock, response.data(), response.size())) {
+      logger(ERROR, mode, "send", threadArgs.clntSock, hit);
+    }
+    code = status;
+  }
+  std::string data;
+  while (exchange.read(data, phase_timeout(threadArgs.timeouts.idle))) {
+    response += data;
+    if (streamed &&
+        !send_all(threadArgs.clntSock, data.data(), data.size())) {
+      logger(ERROR, mode, "send", threadArgs.clntSock, hit);
+    }
+  }
+  if (!exchange.complete()) {
+    logger(ERROR, mode, exchange.timed_out() ? "upstream timed out" :
+           "response cut short", threadArgs.clntSock, hit);
+    upstream_timed_out = upstream_timed_out || exchange.timed_out();
+    return false;
+  }
+  if (!streamed) {
+    response.insert(0, h1_response_head(status, fields, response.size()));
+    send_all(threadArgs.clntSock, response.data(), response.size());
+  }
+  code = status;
+  oss << "received " << response.size() << " bytes";
+  logger(LOG, mode, oss, threadArgs.clntSock, hit);
+  return true;
+}
+
+ServerMain::ServerMain() : upstream_timed_out(false),
+                           upstream_saturated(false),
+                           expect_body(true),
+                           admitted(false) {}
 
-ServerMain::~ServerMain() {
-  logger(LOG, "~ServerMain", "dtor", threadArgs.clntSock, threadArgs.hit);
+void ServerMain::finish() {
+  logger(LOG, "ServerMain", "finish", threadArgs.clntSock, threadArgs.hit);
+  request_finished();
+  if (threadArgs.admission) {
+    threadArgs.admission->leave();
+  }
   logger(LOG, "----------------", "------------------", threadArgs.clntSock, threadArgs.hit);
+  // what the next connection starts from; capacity is kept unless it grew
+  // past what a typical request needs
+  for (std::string* s : {&request, &response, &path}) {
+    if (s->capacity() > KEPT_CAPACITY) {
+      std::string().swap(*s);
+    }
+    s->clear();
+  }
+  upstream_timed_out = false;
+  upstream_saturated = false;
+  expect_body = true;
+  admitted = false;
+  arena.reset();
+}
+
+// a method token, a space and a target on the first line; anything else
+// has nothing to forward
+static bool request_line_ok(const std::string& request,
+                            const std::string& path) {
+  static const char TOKEN_CHARS[] = "!#$%&'*+-.^_`|~";
+  auto eol = request.find('\n');
+  auto space = request.find(' ');
+  if (eol == std::string::npos || space == 0 || space >= eol ||
+      path.empty() || space + 1 + path.size() >= eol) {
+    return false;
+  }
+  for (std::string::size_type i = 0; i < space; ++i) {
+    char c = request[i];
+    if (!isalnum(static_cast<unsigned char>(c)) &&
+        (c == '\0' || strchr(TOKEN_CHARS, c) == nullptr)) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void ServerMain::proxy() {
   int hit = threadArgs.hit;
-  bool is_first = true;
   int code = 0;
-  for (const auto& dest : threadArgs.dests) {
-    bool try_again = is_first;
-    int destSock = connect(dest.first, dest.second);
-    std::ostringstream oss;
-    for (int c = 0; try_again && c < 3; ++c) {
-      try_again = recv_request("request", threadArgs.clntSock, MSG_DONTWAIT);
-      std::this_thread::sleep_for(std::chrono::milliseconds(500));
-    }
-    is_first = false;
-    Method method = parse_method(request.c_str(), threadArgs.clntSock);
-    int offset = method == Method::GET ? 4 : 5;
-    std::string path = parse_path(request.c_str(), BUFSIZE, offset);
-    oss << "path: '" << path << "'";
-    logger(LOG, "proxy", oss, threadArgs.clntSock, hit);
-    SeaState state;
-    std::istringstream iss(path);
-    uint64_t hash = state.hash(path);
-    oss << "hash: " << std::hex << std::setw(16) << std::setfill('0') << hash;
-    logger(LOG, "proxy", oss, threadArgs.clntSock, hit);
-    if (path == "/getpid") {
-      handle_getpid(threadArgs.clntSock);
-      shutdown(destSock, SHUT_RDWR); // stop other processes from using socket
-      close(destSock);
+  trace.start(threadArgs.tracer.get(), hit, threadArgs.start);
+  bool timed_out;
+  {
+    // shutting down the read side lets us still answer with a 408
+    SocketDeadline deadline(threadArgs.clntSock, SHUT_RD,
+                            phase_timeout(threadArgs.timeouts.request));
+    RequestTrace::Scope phase(trace, "request_read");
+    while (recv_request("request", threadArgs.clntSock, 0)) {
+    }
+    timed_out = deadline.expired();
+  }
+  if (timed_out) {
+    logger(LOG, "proxy", "request read timed out", threadArgs.clntSock, hit);
+    {
+      RequestTrace::Scope phase(trace, "close");
+      send_all(threadArgs.clntSock, REQUEST_TIMEOUT_RESPONSE.c_str(),
+               REQUEST_TIMEOUT_RESPONSE.size());
+      close(threadArgs.clntSock);
+    }
+    trace.finish(std::string(), 408);
+    recycle(up);
+    return;
+  }
+  Method method = parse_method(request.c_str(), threadArgs.clntSock);
+  int offset = request.find(' ') + 1;
+  parse_path(request.c_str(), request.size(), offset, path);
+  {
+    PooledBuffer line;
+    snprintf(line.data(), PooledBuffer::size(), "path: '%s'", path.c_str());
+    logger(LOG, "proxy", line.data(), threadArgs.clntSock, hit);
+  }
+  if (!request_line_ok(request, path)) {
+    logger(LOG, "proxy", "no request line", threadArgs.clntSock, hit);
+    {
+      RequestTrace::Scope phase(trace, "close");
+      send_all(threadArgs.clntSock, BAD_REQUEST_RESPONSE.c_str(),
+               BAD_REQUEST_RESPONSE.size());
+      shutdown(threadArgs.clntSock, SHUT_RDWR);
+      close(threadArgs.clntSock);
+    }
+    trace.finish(std::string(), 400);
+    recycle(up);
+    return;
+  }
+  expect_body = method != Method::HEAD;
+  bool cacheable = threadArgs.key_builder ?
+    threadArgs.key_builder->cacheable(method, path) : method == Method::GET;
+  uint64_t base;
+  uint64_t hash;
+  {
+    RequestTrace::Scope phase(trace, "hash");
+    hash = cache_key(method, path, base);
+  }
+  char line[32];
+  snprintf(line, sizeof(line), "hash: %016llx",
+           static_cast<unsigned long long>(hash));
+  logger(LOG, "proxy", line, threadArgs.clntSock, hit);
+  bool fetched = false;
+  bool upstream = false;
+  bool miss = false;
+  bool learn = false;
+  if (path == "/getpid") {
+    handle_getpid(threadArgs.clntSock);
+  }
+  else if (path == "/memstats") {
+    handle_memstats(threadArgs.clntSock);
+  }
+  else if (path == "/deststats") {
+    handle_deststats(threadArgs.clntSock);
+  }
+  else if (path == "/admissionstats") {
+    handle_admissionstats(threadArgs.clntSock);
+  }
+  else if (path == "/prefetchstats") {
+    handle_prefetchstats(threadArgs.clntSock);
+  }
+  else if (path == "/trace") {
+    handle_trace(threadArgs.clntSock);
+  }
+  else if (threadArgs.cluster &&
+           path.compare(0, CLUSTER_PREFIX.size(), CLUSTER_PREFIX) == 0) {
+    handle_cluster(path, method);
+  }
+  else if (!admit(cacheable, hash)) {
+    logger(LOG, "proxy", "shed by admission control", threadArgs.clntSock, hit);
+    send_all(threadArgs.clntSock, SERVICE_UNAVAILABLE_RESPONSE.c_str(),
+             SERVICE_UNAVAILABLE_RESPONSE.size());
+  }
+  else if (!cacheable) {
+    logger(LOG, "proxy", "forwarding uncached", threadArgs.clntSock, hit);
+    upstream = !threadArgs.dests.empty();
+    fetch_upstream(false, base, hash, code);
+  }
+  else {
+    {
+      RequestTrace::Scope phase(trace, "cache_lookup");
+      miss = !send_snapshot(hash) && !send_response(hash) &&
+        !send_negative(hash) && !fetch_from_peer(hash);
+    }
+    if (miss) {
+      upstream = !threadArgs.dests.empty();
+      fetched = fetch_upstream(true, base, hash, code);
+    }
+    learn = method == Method::GET;
+  }
+  if (code == NOTFOUND) {
+    send_not_found(threadArgs.clntSock);
+  }
+  else if (code == 0 && upstream) {
+    const std::string& resp = upstream_timed_out ? GATEWAY_TIMEOUT_RESPONSE :
+      upstream_saturated ? SERVICE_UNAVAILABLE_RESPONSE : BAD_GATEWAY_RESPONSE;
+    send_all(threadArgs.clntSock, resp.c_str(), resp.size());
+  }
+  if (admitted) {
+    threadArgs.admission->release();
+  }
+  if (learn && threadArgs.prefetcher) {
+    threadArgs.prefetcher->observe(client_address(), path, hash, miss);
+  }
+  {
+    RequestTrace::Scope phase(trace, "close");
+    shutdown(threadArgs.clntSock, SHUT_RDWR); // stop other processes from using socket
+    close(threadArgs.clntSock);
+  }
+  trace.finish(path, code);
+  // replicate after the client has its answer, the owner is off the hot path
+  if (fetched && threadArgs.cluster && threadArgs.cluster->replicate()) {
+    const Peer* owner = threadArgs.cluster->owner(hash);
+    if (owner != nullptr) {
+      threadArgs.cluster->push(*owner, hash, response, hit,
+                               threadArgs.timeouts.first_byte);
+    }
+  }
+  recycle(up);
+}
+
+bool ServerMain::fetch_upstream(bool cacheable, uint64_t base, uint64_t& hash,
+                                int& code) {
+  int hit = threadArgs.hit;
+  bool fetched = false;
+  std::string error_response;
+  // the global slot is for local work: waiting on an upstream only holds
+  // the destination's, so misses on a slow upstream can't starve the hits
+  if (admitted) {
+    threadArgs.admission->release();
+    admitted = false;
+  }
+  for (auto i : dest_order()) {
+    const auto& dest = threadArgs.dests[i];
+    if (budget_exhausted()) {
+      logger(LOG, "proxy", "request budget exhausted", threadArgs.clntSock, hit);
+      upstream_timed_out = true;
       break;
     }
-    else if (send_response(hash)) {
-      shutdown(destSock, SHUT_RDWR); // stop other processes from using socket
-      close(destSock);
+    if (threadArgs.admission && !threadArgs.admission->acquire_dest(i)) {
+      logger(LOG, "proxy", "too many requests in flight to " + dest.first +
+             ":" + dest.second, threadArgs.clntSock, hit);
+      upstream_saturated = true;
+      continue;
+    }
+    if (threadArgs.dest_health && !threadArgs.dest_health->acquire(i)) {
+      logger(LOG, "proxy", "circuit open for " + dest.first + ":" +
+             dest.second, threadArgs.clntSock, hit);
+      if (threadArgs.admission) {
+        threadArgs.admission->release_dest(i);
+      }
+      continue;
+    }
+    auto start = std::chrono::steady_clock::now();
+    int dest_code = 0;
+    bool whole = true;
+    int destSock = -1;
+    if (i < threadArgs.h2c.size() && threadArgs.h2c[i]) {
+      whole = forward_h2c(*threadArgs.h2c[i], dest_code);
+    }
+    else {
+      RequestTrace::Scope phase(trace, "connect");
+      destSock = connect(dest.first, dest.second);
+      if (destSock >= 0) {
+        phase.next("upstream_send");
+        send_request("request", destSock);
+        phase.end();
+        whole = forward_response(destSock, threadArgs.clntSock, dest_code);
+        shutdown(destSock, SHUT_RDWR); // stop other processes from using socket
+        close(destSock);
+      }
+    }
+    if (threadArgs.dest_health) {
+      threadArgs.dest_health->release(i, dest_code > 0 && dest_code < 500,
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - start));
+    }
+    if (threadArgs.admission) {
+      threadArgs.admission->release_dest(i);
+    }
+    if (dest_code == 0) {
+      continue;
+    }
+    code = dest_code;
+    if (code < 399) {
+      // a response cut short mid body has reached the client, but not the
+      // cache
+      if (cacheable && whole && response_key(base, hash)) {
+        RequestTrace::Scope phase(trace, "cache_save");
+        fetched = save_response(hash);
+      }
       break;
     }
     else {
-      send_request("request", destSock);
-      try_again = forward_response(destSock, threadArgs.clntSock, code);
-      if (code < 399) {
-        save_response(hash);
-        break;
+      if (code == NOTFOUND) {
+        logger(LOG, "proxy", "not found", destSock, hit);
+      }
+      if (whole) {
+        error_response.swap(response);
       }
       else {
-        if (code == NOTFOUND) {
-          logger(LOG, "proxy", "not found", destSock, hit);
-        }
-        response.clear();
+        error_response.clear();
       }
-      shutdown(destSock, SHUT_RDWR); // stop other processes from using socket
-      close(destSock);
+      response.clear();
+    }
+    if (!cacheable) {
+      break; // the request may not be idempotent, don't replay it elsewhere
     }
   }
-  if (code == NOTFOUND) {
-    std::string resp = "HTTP/1.1 404 Not Found\nContent-Length: 43\n" 
-      "Connection: close\nContent-Type: application/json\n\n" 
-      "{\"code\":404,\"message\":\"HTTP 404 Not Found\"}";
-    write(threadArgs.clntSock, resp.c_str(), resp.size());
+  if (cacheable && !fetched && threadArgs.negative_cache &&
+      NegativeCache::cacheable(code) &&
+      (code == NOTFOUND || !error_response.empty()) &&
+      dechunk_response(error_response)) {
+    threadArgs.negative_cache->store(hash, code, code == NOTFOUND ?
+                                     NOT_FOUND_RESPONSE : error_response);
   }
-  shutdown(threadArgs.clntSock, SHUT_RDWR); // stop other processes from using socket
-  close(threadArgs.clntSock);
-  cleanup(up);
+  return fetched;
 }
 
 Method ServerMain::parse_method(const char* buffer, int fd) {
@@ -408,6 +891,8 @@ Method ServerMain::parse_method(const char* buffer, int fd) {
   static const std::string get{"get "};
   static const std::string POST{"POST "};
   static const std::string post{"post "};
+  static const std::string HEAD{"HEAD "};
+  static const std::string head{"head "};
   if (strncmp(buffer, GET.c_str(), GET.size()) == 0 ||
       strncmp(buffer, get.c_str(), get.size()) == 0) {
     logger(LOG, "Method", "GET", fd);
@@ -418,13 +903,16 @@ Method ServerMain::parse_method(const char* buffer, int fd) {
     logger(LOG, "Method", "POST", fd);
     return Method::POST;
   }
-  logger(FORBIDDEN, "Only simple GET operation supported", buffer, fd);
-  exit(4);
-  return Method::GET;
+  else if (strncmp(buffer, HEAD.c_str(), HEAD.size()) == 0 ||
+           strncmp(buffer, head.c_str(), head.size()) == 0) {
+    logger(LOG, "Method", "HEAD", fd);
+    return Method::HEAD;
+  }
+  logger(LOG, "Method", std::string(buffer, strcspn(buffer, " \r\n")), fd);
+  return Method::OTHER;
 }
 
-void ServerMain::parse_headers(const char* buffer,
-                               std::map<std::string, std::string>& header) {
+void ServerMain::parse_headers(const char* buffer, HeaderMap& header) {
   int pos = 0;
   const char* request = buffer;
   const char* end_headers = "\r\n\r\n";
@@ -462,14 +950,16 @@ void ServerMain::parse_headers(const char* buffer,
   }
 }
 
-std::string ServerMain::parse_path(const char* buffer, int len, int offset) const {
+void ServerMain::parse_path(const char* buffer, int len, int offset,
+                            std::string& path) const {
   int i;
   for (i = offset;i < len; i++) {
     if (buffer[i] == ' ') {
-      return std::string(buffer + offset, i - offset);
+      path.assign(buffer + offset, i - offset);
+      return;
     }
   }
-  return std::string();
+  path.clear();
 }
 
 
@@ -481,42 +971,331 @@ void ServerMain::handle_getpid(int fd) const {
   out << "HTTP/1.1 200 OK\nServer: http_caching_proxy/" << VERSION << ".0\n"
       << "Content-Length: " << pid.str().size() << "\n"
       << "Connection: close\nContent-Type: text/plain\n\n" << pid.str();
-  write(fd, out.str().c_str(), out.str().size());
+  send_all(fd, out.str().c_str(), out.str().size());
   logger(HEADER, "Response Header", out, fd, hit);
 }
 
-void ServerMain::save_response(uint64_t hash) const {
-  std::ostringstream oss;
-  oss << std::hex << std::setw(16) << std::setfill('0') << hash;
-  std::ofstream resp(oss.str() + ".res");
-  resp << response;
-  resp.close();
-  std::ofstream req(oss.str() + ".req");
-  req << request;
-  req.close();
+void ServerMain::handle_memstats(int fd) const {
+  int hit = threadArgs.hit;
+  MemoryStats stats = memory_stats();
+  std::ostringstream body;
+  body << "{";
+#ifdef COUNT_HEAP_ALLOCS
+  body << "\"heap_allocs\":" << stats.heap_allocs << ",";
+#endif
+  body << "\"pool_mallocs\":" << stats.pool_mallocs
+       << ",\"pool_acquires\":" << stats.pool_acquires
+       << ",\"pool_releases\":" << stats.pool_releases
+       << ",\"pool_thread_hits\":" << stats.pool_thread_hits
+       << ",\"pool_free\":" << stats.pool_free
+       << ",\"arena_allocs\":" << stats.arena_allocs
+       << ",\"arena_mallocs\":" << stats.arena_mallocs
+       << ",\"arena_resets\":" << stats.arena_resets << "}";
+  std::ostringstream out;
+  out << "HTTP/1.1 200 OK\nServer: http_caching_proxy/" << VERSION << ".0\n"
+      << "Content-Length: " << body.str().size() << "\n"
+      << "Connection: close\nContent-Type: application/json\n\n" << body.str();
+  send_all(fd, out.str().c_str(), out.str().size());
+  logger(HEADER, "Response Header", out, fd, hit);
 }
 
-bool ServerMain::send_response(uint64_t hash) {
+void ServerMain::send_not_found(int fd) const {
+  send_all(fd, NOT_FOUND_RESPONSE.c_str(), NOT_FOUND_RESPONSE.size());
+}
+
+void ServerMain::handle_cluster(const std::string& path, Method method) {
   int hit = threadArgs.hit;
-  std::ostringstream oss;
-  oss << std::hex << std::setw(16) << std::setfill('0') << hash;
-  std::ifstream resp(oss.str() + ".res");
-  std::string line;
-  std::ostringstream log;
-  if (resp.is_open()) {
+  uint64_t key;
+  if (!parse_cluster_path(path, key)) {
+    send_not_found(threadArgs.clntSock);
+    return;
+  }
+  if (method == Method::POST) {
+    // a replica overwrites the entry, only a peer may send one
+    sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    if (getpeername(threadArgs.clntSock, reinterpret_cast<sockaddr*>(&addr),
+                    &length) < 0 ||
+        !threadArgs.cluster->is_peer(reinterpret_cast<sockaddr*>(&addr))) {
+      logger(LOG, "cluster", "replica from " + client_address() + " refused",
+             threadArgs.clntSock, hit);
+      send_all(threadArgs.clntSock, FORBIDDEN_RESPONSE.c_str(),
+               FORBIDDEN_RESPONSE.size());
+      return;
+    }
+    auto body = request.find("\r\n\r\n");
+    if (body != std::string::npos) {
+      store_cached_response(key, request.substr(0, body + 4),
+                            request.substr(body + 4));
+      logger(LOG, "cluster", "stored replica " + cache_key_name(key),
+             threadArgs.clntSock, hit);
+    }
+    static const std::string ack = "HTTP/1.0 204 No Content\r\n\r\n";
+    send_all(threadArgs.clntSock, ack.c_str(), ack.size());
+  }
+  else if (!send_response(key)) {
+    send_not_found(threadArgs.clntSock);
+  }
+}
+
+bool ServerMain::fetch_from_peer(uint64_t hash) {
+  if (!threadArgs.cluster) {
+    return false;
+  }
+  const Peer* owner = threadArgs.cluster->owner(hash);
+  if (owner == nullptr ||
+      !threadArgs.cluster->fetch(*owner, hash, response, threadArgs.hit,
+                                 phase_timeout(threadArgs.timeouts.first_byte))) {
+    return false;
+  }
+  send_all(threadArgs.clntSock, response.c_str(), response.size());
+  save_response(hash);
+  return true;
+}
+
+void ServerMain::handle_deststats(int fd) const {
+  int hit = threadArgs.hit;
+  std::string body = threadArgs.dest_health ?
+    threadArgs.dest_health->report() : "[]";
+  std::ostringstream out;
+  out << "HTTP/1.1 200 OK\nServer: http_caching_proxy/" << VERSION << ".0\n"
+      << "Content-Length: " << body.size() << "\n"
+      << "Connection: close\nContent-Type: application/json\n\n" << body;
+  send_all(fd, out.str().c_str(), out.str().size());
+  logger(HEADER, "Response Header", out, fd, hit);
+}
+
+void ServerMain::handle_admissionstats(int fd) const {
+  int hit = threadArgs.hit;
+  std::string body = threadArgs.admission ?
+    threadArgs.admission->report() : "{}";
+  std::ostringstream out;
+  out << "HTTP/1.1 200 OK\nServer: http_caching_proxy/" << VERSION << ".0\n"
+      << "Content-Length: " << body.size() << "\n"
+      << "Connection: close\nContent-Type: application/json\n\n" << body;
+  send_all(fd, out.str().c_str(), out.str().size());
+  logger(HEADER, "Response Header", out, fd, hit);
+}
+
+void ServerMain::handle_prefetchstats(int fd) const {
+  int hit = threadArgs.hit;
+  std::string body = threadArgs.prefetcher ?
+    threadArgs.prefetcher->report() : "{}";
+  std::ostringstream out;
+  out << "HTTP/1.1 200 OK\nServer: http_caching_proxy/" << VERSION << ".0\n"
+      << "Content-Length: " << body.size() << "\n"
+      << "Connection: close\nContent-Type: application/json\n\n" << body;
+  send_all(fd, out.str().c_str(), out.str().size());
+  logger(HEADER, "Response Header", out, fd, hit);
+}
+
+void ServerMain::handle_trace(int fd) const {
+  int hit = threadArgs.hit;
+  std::string body = threadArgs.tracer ?
+    threadArgs.tracer->json() : "{\"traceEvents\":[]}";
+  std::ostringstream out;
+  out << "HTTP/1.1 200 OK\nServer: http_caching_proxy/" << VERSION << ".0\n"
+      << "Content-Length: " << body.size() << "\n"
+      << "Connection: close\nContent-Type: application/json\n\n" << body;
+  send_all(fd, out.str().c_str(), out.str().size());
+  logger(HEADER, "Response Header", out, fd, hit);
+}
+
+std::string ServerMain::client_address() const {
+  sockaddr_storage addr;
+  socklen_t length = sizeof(addr);
+  char host[NI_MAXHOST];
+  if (getpeername(threadArgs.clntSock, reinterpret_cast<sockaddr*>(&addr),
+                  &length) < 0 ||
+      getnameinfo(reinterpret_cast<sockaddr*>(&addr), length, host,
+                  sizeof(host), nullptr, 0, NI_NUMERICHOST) != 0) {
+    return std::string();
+  }
+  return host;
+}
+
+// entries the snapshot or the existence filter know about are queued ahead
+// of requests that will have to go upstream
+bool ServerMain::admit(bool cacheable, uint64_t hash) {
+  if (!threadArgs.admission) {
+    return true;
+  }
+  RequestTrace::Scope phase(trace, "admission");
+  const char* data;
+  std::size_t length;
+  bool hit = cacheable &&
+    ((threadArgs.snapshot && threadArgs.snapshot->lookup(hash, data, length)) ||
+     may_be_cached(hash));
+  // a request still queued when its first byte is due is shed
+  admitted = threadArgs.admission->admit(hit ?
+    AdmissionController::Priority::HIT : AdmissionController::Priority::MISS,
+    phase_timeout(threadArgs.timeouts.first_byte));
+  return admitted;
+}
+
+std::vector<std::size_t> ServerMain::dest_order() const {
+  if (threadArgs.dest_health) {
+    return threadArgs.dest_health->order();
+  }
+  std::vector<std::size_t> order;
+  for (std::size_t i = 0; i < threadArgs.dests.size(); ++i) {
+    order.push_back(i);
+  }
+  return order;
+}
+
+uint64_t ServerMain::cache_key(Method method, const std::string& path,
+                               uint64_t& base) const {
+  if (!threadArgs.key_builder) {
+    SeaState state;
+    base = state.hash(path);
+    return base;
+  }
+  // a GET with no known Vary needs neither the header fields nor the body
+  if (method == Method::GET) {
+    base = threadArgs.key_builder->base_key(method, path);
+    if (!threadArgs.key_builder->vary().contains(base)) {
+      return base;
+    }
+  }
+  auto body = request.find("\r\n\r\n");
+  return threadArgs.key_builder->key(method, path, parse_header_fields(request),
+                                     body == std::string::npos ? std::string() :
+                                     request.substr(body + 4), base);
+}
+
+bool ServerMain::response_key(uint64_t base, uint64_t& hash) const {
+  if (!threadArgs.key_builder) {
+    return true;
+  }
+  VaryIndex& vary_index = threadArgs.key_builder->vary();
+  auto fields = parse_header_fields(response);
+  auto vary = fields.find("vary");
+  if (vary == fields.end()) {
+    vary_index.forget(base);
+    hash = base;
+    return true;
+  }
+  std::vector<std::string> names = parse_vary(vary->second);
+  if (names.size() == 1 && names[0] == "*") {
+    logger(LOG, "proxy", "Vary: * is not cached", threadArgs.clntSock,
+           threadArgs.hit);
+    return false;
+  }
+  vary_index.remember(base, names);
+  hash = threadArgs.key_builder->variant_key(base, names,
+                                             parse_header_fields(request));
+  return true;
+}
+
+// what proxy() and the prefetcher store: the response without its chunk
+// framing, not stored if that is malformed or cut short
+bool ServerMain::save_response(uint64_t hash) {
+  if (!dechunk_response(response)) {
+    logger(LOG, "proxy", "chunked response cut short, not cached",
+           threadArgs.clntSock, threadArgs.hit);
+    return false;
+  }
+  store_cached_response(hash, request, response);
+  return true;
+}
+
+// disk hits through the cpu's ring: the reads of the body are linked to
+// the sends to the client so both go out in one io_uring_enter
+bool ServerMain::send_response_ring(uint64_t hash) {
+  if (load_hot_response(hash, response)) {
+    send_all(threadArgs.clntSock, response.c_str(), response.size());
+    return true;
+  }
+  RingPool::Borrowed ring = threadArgs.ring_pool->borrow();
+  if (!ring) {
+    return false;
+  }
+  std::size_t size = 0;
+  int file = open_cached_response(hash, response, size);
+  if (file < 0) {
+    response.clear();
+    return false;
+  }
+  std::size_t head = response.size();
+  if (head > 0 && !send_all(threadArgs.clntSock, response.data(), head)) {
+    close(file);
+    return true;
+  }
+  response.resize(head + size);
+  std::size_t sent = 0;
+  bool ok = size == 0 || ring->send_file(file, size, threadArgs.clntSock,
+                                         &response[head], sent);
+  if (!ok && sent == 0 && head == 0) {
+    close(file);
     response.clear();
-    while (getline(resp, line)) {
-      response += line + '\n';
+    return false;
+  }
+  if (!ok) {
+    // finish the plain way from where the ring stopped
+    ssize_t n = 0;
+    std::size_t done = sent;
+    while (done < size &&
+           (n = pread(file, &response[head + done], size - done, done)) > 0) {
+      done += n;
     }
-    resp.close();
-    write(threadArgs.clntSock, response.c_str(), response.size());
-    log << "Sent " << response.size() << " bytes";
-    logger(LOG, "send_response", log, threadArgs.clntSock, hit);
+    response.resize(head + done);
+    ok = done > sent && send_all(threadArgs.clntSock, &response[head + sent],
+                                 done - sent);
+  }
+  close(file);
+  char line[64];
+  snprintf(line, sizeof(line), "Sent %zu bytes through io_uring",
+           response.size());
+  logger(LOG, "send_response", line, threadArgs.clntSock, threadArgs.hit);
+  if (ok) {
+    promote_cached_response(hash, response);
+  }
+  return true;
+}
+
+bool ServerMain::send_snapshot(uint64_t hash) const {
+  const char* data;
+  std::size_t length;
+  if (!threadArgs.snapshot || !threadArgs.snapshot->lookup(hash, data, length)) {
+    return false;
+  }
+  send_all(threadArgs.clntSock, data, length);
+  char line[64];
+  snprintf(line, sizeof(line), "Sent %zu bytes from snapshot", length);
+  logger(LOG, "send_snapshot", line, threadArgs.clntSock, threadArgs.hit);
+  return true;
+}
+
+bool ServerMain::send_negative(uint64_t hash) {
+  if (!threadArgs.negative_cache ||
+      !threadArgs.negative_cache->lookup(hash, response)) {
+    return false;
+  }
+  send_all(threadArgs.clntSock, response.c_str(), response.size());
+  logger(LOG, "send_negative", "answered from negative cache",
+         threadArgs.clntSock, threadArgs.hit);
+  response.clear();
+  return true;
+}
+
+bool ServerMain::send_response(uint64_t hash) {
+  int hit = threadArgs.hit;
+  char line[80];
+  if (threadArgs.ring_pool && send_response_ring(hash)) {
+    return true;
+  }
+  if (load_cached_response(hash, response)) {
+    send_all(threadArgs.clntSock, response.c_str(), response.size());
+    snprintf(line, sizeof(line), "Sent %zu bytes", response.size());
+    logger(LOG, "send_response", line, threadArgs.clntSock, hit);
     return true;
   }
   else {
-    log << "Response file for " << oss.str() << " not found";
-    logger(LOG, "send_response", log, threadArgs.clntSock, hit);
+    response.clear();
+    snprintf(line, sizeof(line), "Response file for %016llx not found",
+             static_cast<unsigned long long>(hash));
+    logger(LOG, "send_response", line, threadArgs.clntSock, hit);
     return false;
   }
 }
@@ -2,12 +2,24 @@
 #define SERVER_MAIN_H
 
 #include "http_caching_proxy.h"
+#include "memory_pool.h"
+#include "cluster.h"
+#include "snapshot.h"
+#include "negative_cache.h"
+#include "dest_health.h"
+#include "cache_key.h"
+#include "io_ring.h"
+#include "admission.h"
+#include "prefetcher.h"
+#include "tracer.h"
+#include "h2c_client.h"
 #include <netdb.h>
 
 #include <string>
 #include <map>
 #include <vector>
 #include <memory>
+#include <chrono>
 
 // Structure of arguments to pass to client thread
 struct ThreadArgs {
@@ -17,13 +29,32 @@ struct ThreadArgs {
   int hit;
   std::vector<std::pair<std::string, std::string>> dests;
   std::map<std::string, std::string> rest_data;
+  std::shared_ptr<const Cluster> cluster;
+  std::shared_ptr<const Snapshot> snapshot;
+  std::shared_ptr<NegativeCache> negative_cache;
+  std::shared_ptr<DestinationHealth> dest_health;
+  std::shared_ptr<const CacheKeyBuilder> key_builder;
+  std::shared_ptr<RingPool> ring_pool; // null unless --io_uring
+  std::shared_ptr<AdmissionController> admission;
+  std::shared_ptr<Prefetcher> prefetcher;
+  std::shared_ptr<Tracer> tracer; // null unless --trace_sample
+  std::vector<std::shared_ptr<H2cClient>> h2c; // by dest, null unless h2c://
+  Timeouts timeouts;
+  std::chrono::steady_clock::time_point start; // the total budget starts here
 };
 
 class ServerMain {
   private:
     ThreadArgs threadArgs;
+    Arena arena;
     std::string request;
     std::string response;
+    std::string path;
+    bool upstream_timed_out;
+    bool upstream_saturated;
+    bool expect_body;
+    bool admitted;
+    RequestTrace trace;
 
   protected:
     int get_buffer_content_length(const std::string& chunk) const;
@@ -36,32 +67,86 @@ class ServerMain {
 
     bool recv_request(const std::string& mode, int source, int flags);
 
+    bool request_complete() const;
+
+    std::chrono::milliseconds phase_timeout(std::chrono::milliseconds phase) const;
+
+    bool budget_exhausted() const;
+
     bool send_request(const std::string& mode, int destination) const;
 
-    void save_response(uint64_t hash) const;
+    uint64_t cache_key(Method method, const std::string& path,
+                       uint64_t& base) const;
+
+    bool response_key(uint64_t base, uint64_t& hash) const;
+
+    bool save_response(uint64_t hash);
 
     bool send_response(uint64_t hash);
 
+    bool send_response_ring(uint64_t hash);
+
+    bool send_snapshot(uint64_t hash) const;
+
+    bool send_negative(uint64_t hash);
+
     void handle_getpid(int fd) const;
 
-    std::string parse_path(const char* buffer, int len, int offset = 4) const;
+    void handle_memstats(int fd) const;
+
+    void handle_deststats(int fd) const;
+
+    void handle_admissionstats(int fd) const;
+
+    void handle_prefetchstats(int fd) const;
+
+    void handle_trace(int fd) const;
 
-    int connect(const std::string& host, const std::string& port) const;
+    std::string client_address() const;
 
-    void parse_headers(const char* buffer, 
-                       std::map<std::string, std::string>& header);
+    bool admit(bool cacheable, uint64_t hash);
+
+    void handle_cluster(const std::string& path, Method method);
+
+    bool fetch_from_peer(uint64_t hash);
+
+    void send_not_found(int fd) const;
+
+    void parse_path(const char* buffer, int len, int offset,
+                    std::string& path) const;
+
+    int connect(const std::string& host, const std::string& port);
+
+    std::vector<std::size_t> dest_order() const;
+
+    void parse_headers(const char* buffer, HeaderMap& header);
 
     Method parse_method(const char* buffer, int fd);
 
     bool get_response(const std::string& bufStr, int& code) const;
 
+    // relays the upstream response to the client and keeps it in response;
+    // false unless all of it arrived
     bool forward_response(int source, int destination, int& code);
 
+    bool forward_h2c(H2cClient& client, int& code);
+
+    bool fetch_upstream(bool cacheable, uint64_t base, uint64_t& hash,
+                        int& code);
+
+    ServerMain();
+
   public:
-    ServerMain(const ThreadArgs& ta);
-    ~ServerMain();
+    // a connection object from the pool, or a new one; recycle() hands it
+    // back with its string capacity and arena kept, so a hit in steady
+    // state doesn't allocate
+    static std::unique_ptr<ServerMain> acquire();
+    ThreadArgs& args() { return threadArgs; }
     std::unique_ptr<ServerMain> up;
 
+    // logs the end of the connection and resets for the next one
+    void finish();
+
     void proxy();
     void handle();
 };
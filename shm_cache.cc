@@ -0,0 +1,316 @@
+#include "shm_cache.h"
+#include "cache_store.h"
+#include "http_caching_proxy.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+
+#include <atomic>
+#include <sstream>
+
+static const uint64_t MAGIC = 0x48435053484d3034LLU; // "HCPSHM04"
+
+enum SlotKind : uint32_t { EMPTY, HEAD, BODY };
+
+struct ShmHeader {
+  uint64_t magic;
+  uint64_t slots;
+  uint64_t slot_size;
+  std::atomic<uint32_t> ready;
+};
+
+// a HEAD slot under the entry's key names the BODY slot, stored under the
+// content hash of the body, that completes it.  Both carry a second hash of
+// the body, so a head never completes with another body that hashed alike.
+struct ShmSlot {
+  // the low half is the sequence, odd while a writer owns the slot; the
+  // high half is that writer's pid, so a slot it died holding is reclaimed
+  std::atomic<uint64_t> sequence;
+  uint64_t key;
+  uint64_t body;
+  uint64_t check;
+  uint32_t length;
+  uint32_t body_length;
+  uint32_t kind;
+  char data[1];
+};
+
+static const std::size_t SLOT_OVERHEAD = offsetof(ShmSlot, data);
+
+static bool writing(uint64_t sequence) {
+  return (sequence & 1) != 0;
+}
+
+static uint64_t owned(uint64_t sequence, uint32_t count) {
+  return uint64_t(getpid()) << 32 | uint32_t(sequence + count);
+}
+
+static bool writer_died(uint64_t sequence) {
+  pid_t pid = static_cast<pid_t>(sequence >> 32);
+  return pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+// empties a slot whose writer died halfway, false if it is still alive or
+// someone else got there first
+static bool reclaim(ShmSlot* s, uint64_t& sequence) {
+  if (!writing(sequence) || !writer_died(sequence)) {
+    return false;
+  }
+  uint64_t mine = owned(sequence, 2); // still odd
+  if (!s->sequence.compare_exchange_strong(sequence, mine,
+                                           std::memory_order_acquire)) {
+    return false;
+  }
+  s->key = 0;
+  s->kind = EMPTY;
+  s->length = 0;
+  sequence = owned(mine, 1);
+  s->sequence.store(sequence, std::memory_order_release);
+  return true;
+}
+
+ShmCache::ShmCache() : base(nullptr), mapped(0), header(nullptr),
+                       reused(false) {}
+
+ShmCache::~ShmCache() {
+  if (base != nullptr) {
+    munmap(base, mapped);
+  }
+}
+
+// the other segments of prefix, left by a process with another geometry;
+// whoever still has one mapped keeps it until it unmaps
+static void remove_stale(const std::string& prefix, const std::string& name) {
+  DIR* dir = opendir("/dev/shm");
+  if (dir == nullptr) {
+    return;
+  }
+  while (dirent* entry = readdir(dir)) {
+    std::string other = std::string("/") + entry->d_name;
+    if (other != name && (other == prefix ||
+                          other.compare(0, prefix.size() + 1,
+                                        prefix + ".") == 0)) {
+      logger(LOG, "shm_cache", "removing " + other, 0);
+      shm_unlink(other.c_str());
+    }
+  }
+  closedir(dir);
+}
+
+bool ShmCache::open(const std::string& prefix, std::size_t slots,
+                    std::size_t slot_size) {
+  slot_size = (slot_size + 7) & ~std::size_t(7);
+  if (slots == 0 || slot_size <= SLOT_OVERHEAD) {
+    return false;
+  }
+  std::size_t size = sizeof(ShmHeader) + slots * slot_size;
+  std::ostringstream oss;
+  oss << prefix << '.' << slots << 'x' << slot_size;
+  std::string name = oss.str();
+  oss.str(std::string());
+  int fd = shm_open(name.c_str(), O_RDWR, 0600);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 &&
+      static_cast<std::size_t>(st.st_size) == size) {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      header = static_cast<ShmHeader*>(p);
+      reused = header->magic == MAGIC && header->slots == slots &&
+        header->slot_size == slot_size && header->ready.load() == 1;
+      if (!reused) {
+        munmap(p, size);
+        header = nullptr;
+      }
+    }
+  }
+  if (fd >= 0) {
+    ::close(fd);
+  }
+  if (!reused) {
+    // never rewritten in place, a predecessor may still be reading it: a
+    // fresh segment takes over the name, zeroed by ftruncate
+    shm_unlink(name.c_str());
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+      logger(ERROR, "shm_cache", "create " + name, 0);
+      if (fd >= 0) {
+        ::close(fd);
+      }
+      return false;
+    }
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      logger(ERROR, "shm_cache", "mmap " + name, 0);
+      return false;
+    }
+    header = static_cast<ShmHeader*>(p);
+    header->magic = MAGIC;
+    header->slots = slots;
+    header->slot_size = slot_size;
+    header->ready.store(1);
+  }
+  base = reinterpret_cast<char*>(header);
+  mapped = size;
+  remove_stale(prefix, name);
+  std::size_t reclaimed = 0;
+  for (std::size_t i = 0; reused && i < slots; ++i) {
+    ShmSlot* s = reinterpret_cast<ShmSlot*>(base + sizeof(ShmHeader) +
+                                            i * slot_size);
+    uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+    reclaimed += reclaim(s, sequence);
+  }
+  oss << (reused ? "attached to " : "created ") << name << " with " << slots
+      << " slots of " << slot_size << " bytes";
+  if (reclaimed > 0) {
+    oss << ", " << reclaimed << " left mid-write reclaimed";
+  }
+  logger(LOG, "shm_cache", oss, 0);
+  return true;
+}
+
+std::size_t ShmCache::capacity() const {
+  return header == nullptr ? 0 : header->slot_size - SLOT_OVERHEAD;
+}
+
+ShmSlot* ShmCache::slot(uint64_t key) const {
+  std::size_t index = key % header->slots;
+  return reinterpret_cast<ShmSlot*>(base + sizeof(ShmHeader) +
+                                 index * header->slot_size);
+}
+
+// FNV-1a, independent of content_hash
+static uint64_t body_check(const char* data, std::size_t size) {
+  uint64_t h = 0xcbf29ce484222325LLU;
+  for (std::size_t i = 0; i < size; ++i) {
+    h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001b3LLU;
+  }
+  return h;
+}
+
+// copy slot s holding key of kind into data, false if it doesn't or a
+// writer got in while we copied
+static bool read_slot(const ShmSlot* s, uint64_t key, uint32_t kind,
+                      std::size_t capacity, std::string& data,
+                      uint64_t& body, uint64_t& check,
+                      uint32_t& body_length) {
+  uint64_t before = s->sequence.load(std::memory_order_acquire);
+  if (writing(before) || s->key != key || s->kind != kind ||
+      s->length > capacity) {
+    return false;
+  }
+  body = s->body;
+  check = s->check;
+  body_length = s->body_length;
+  data.append(s->data, s->length);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return s->sequence.load(std::memory_order_relaxed) == before &&
+    s->key == key;
+}
+
+static bool write_slot(ShmSlot* s, uint64_t key, uint32_t kind,
+                       const char* data, std::size_t length, uint64_t body,
+                       uint64_t check, std::size_t body_length) {
+  uint64_t sequence = s->sequence.load(std::memory_order_relaxed);
+  if (writing(sequence) && !reclaim(s, sequence)) {
+    return false;
+  }
+  uint64_t mine = owned(sequence, 1);
+  if (!s->sequence.compare_exchange_strong(sequence, mine,
+                                           std::memory_order_acquire)) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  s->key = key;
+  s->kind = kind;
+  s->body = body;
+  s->check = check;
+  s->body_length = body_length;
+  s->length = length;
+  memcpy(s->data, data, length);
+  s->sequence.store(owned(mine, 1), std::memory_order_release);
+  return true;
+}
+
+bool ShmCache::lookup(uint64_t key, std::string& response) const {
+  if (header == nullptr) {
+    return false;
+  }
+  uint64_t body = 0;
+  uint64_t check = 0;
+  uint32_t body_length = 0;
+  response.clear();
+  if (!read_slot(slot(key), key, HEAD, capacity(), response, body, check,
+                 body_length)) {
+    return false;
+  }
+  if (body_length == 0) {
+    return true;
+  }
+  std::size_t head = response.size();
+  uint64_t unused;
+  uint64_t body_check;
+  uint32_t unused_length;
+  return read_slot(slot(body), body, BODY, capacity(), response, unused,
+                   body_check, unused_length) &&
+    body_check == check && response.size() == head + body_length;
+}
+
+bool ShmCache::contains(uint64_t key) const {
+  if (header == nullptr) {
+    return false;
+  }
+  const ShmSlot* s = slot(key);
+  uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+  bool found = !writing(sequence) && s->key == key && s->kind == HEAD;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return found && s->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+// the BODY slot s holds exactly these bytes
+static bool same_body(const ShmSlot* s, uint64_t body, uint64_t check,
+                      const char* data, std::size_t length) {
+  uint64_t sequence = s->sequence.load(std::memory_order_acquire);
+  if (writing(sequence) || s->key != body || s->kind != BODY ||
+      s->check != check || s->length != length) {
+    return false;
+  }
+  bool same = memcmp(s->data, data, length) == 0;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return same && s->sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+// identical bodies share one BODY slot; one that is already there isn't
+// copied again.  A different body under the same content hash takes the
+// slot over, and the heads of the old one miss on its check.
+void ShmCache::insert(uint64_t key, const std::string& response) {
+  if (header == nullptr || response.empty()) {
+    return;
+  }
+  std::size_t offset = body_offset(response);
+  std::size_t length = response.size() - offset;
+  if (offset > capacity() || length > capacity()) {
+    return;
+  }
+  uint64_t body = 0;
+  uint64_t check = 0;
+  if (length > 0) {
+    const char* data = response.data() + offset;
+    body = content_hash(data, length);
+    check = body_check(data, length);
+    ShmSlot* s = slot(body);
+    if (!same_body(s, body, check, data, length) &&
+        !write_slot(s, body, BODY, data, length, 0, check, 0)) {
+      return;
+    }
+  }
+  write_slot(slot(key), key, HEAD, response.data(), offset, body, check,
+             length);
+}
@@ -0,0 +1,49 @@
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct ShmHeader;
+struct ShmSlot;
+
+// Hot tier of the cache in a named POSIX shared memory segment, so it
+// survives a restart: the next process attaches to the same segment instead
+// of starting cold.  Direct mapped, one entry per slot; every slot is
+// guarded by a sequence lock so readers never block and a writer that
+// finds the slot busy simply skips the insert.  A slot busy because its
+// writer died is emptied by the next writer, or when a process attaches.
+class ShmCache {
+  public:
+    ShmCache();
+    ~ShmCache();
+
+    // attach to the segment prefix.<slots>x<slot_size> or create it, and
+    // unlink the others of prefix.  A segment that can't be attached to is
+    // replaced by a new one, never reset under a process still using it.
+    bool open(const std::string& prefix, std::size_t slots,
+              std::size_t slot_size);
+
+    bool lookup(uint64_t key, std::string& response) const;
+
+    // key has a head here, without copying it out
+    bool contains(uint64_t key) const;
+    void insert(uint64_t key, const std::string& response);
+
+    bool attached() const { return reused; }
+    std::size_t capacity() const;
+
+  private:
+    ShmCache(const ShmCache&) = delete;
+    ShmCache& operator=(const ShmCache&) = delete;
+
+    ShmSlot* slot(uint64_t key) const;
+
+    char* base;
+    std::size_t mapped;
+    ShmHeader* header;
+    bool reused;
+};
+
+#endif
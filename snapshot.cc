@@ -0,0 +1,231 @@
+#include "snapshot.h"
+#include "cache_store.h"
+#include "http_caching_proxy.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+static const char MAGIC[8] = {'H', 'C', 'P', 'S', 'N', 'A', 'P', '1'};
+static const uint32_t VERSION_NUMBER = 1;
+static const uint64_t PAGE = 4096;
+static const uint32_t KEYS_PER_BUCKET = 4;
+static const uint32_t MAX_PILOT = 1u << 20;
+
+static uint64_t mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15LLU;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9LLU;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebLLU;
+  return x ^ (x >> 31);
+}
+
+static uint64_t page_align(uint64_t offset) {
+  return (offset + PAGE - 1) & ~(PAGE - 1);
+}
+
+static uint64_t slot_of(uint64_t h, uint32_t pilot, uint64_t count) {
+  return mix(h ^ mix(pilot)) % count;
+}
+
+// hash and displace: buckets are placed largest first, each one searching
+// for the first pilot that sends all of its keys to free slots
+static bool build_index(const std::vector<uint64_t>& keys, uint64_t seed,
+                        uint32_t buckets, std::vector<uint32_t>& pilots,
+                        std::vector<uint64_t>& slot_keys) {
+  uint64_t count = keys.size();
+  std::vector<std::vector<uint64_t> > members(buckets);
+  for (auto key : keys) {
+    uint64_t h = mix(key ^ seed);
+    members[h % buckets].push_back(h);
+  }
+  std::vector<uint32_t> order(buckets);
+  for (uint32_t b = 0; b < buckets; ++b) {
+    order[b] = b;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {
+    return members[x].size() > members[y].size();
+  });
+  pilots.assign(buckets, 0);
+  std::vector<bool> taken(count, false);
+  std::vector<uint64_t> hashes(count);
+  std::vector<uint64_t> positions;
+  for (auto b : order) {
+    const std::vector<uint64_t>& bucket = members[b];
+    if (bucket.empty()) {
+      break;
+    }
+    uint32_t pilot = 0;
+    for (; pilot < MAX_PILOT; ++pilot) {
+      positions.clear();
+      bool ok = true;
+      for (auto h : bucket) {
+        uint64_t pos = slot_of(h, pilot, count);
+        if (taken[pos] ||
+            std::find(positions.begin(), positions.end(), pos) != positions.end()) {
+          ok = false;
+          break;
+        }
+        positions.push_back(pos);
+      }
+      if (ok) {
+        break;
+      }
+    }
+    if (pilot == MAX_PILOT) {
+      return false;
+    }
+    pilots[b] = pilot;
+    for (std::size_t i = 0; i < bucket.size(); ++i) {
+      taken[positions[i]] = true;
+      hashes[positions[i]] = bucket[i];
+    }
+  }
+  // slot_keys holds the original key for every slot
+  slot_keys.assign(count, 0);
+  for (auto key : keys) {
+    uint64_t h = mix(key ^ seed);
+    slot_keys[slot_of(h, pilots[h % buckets], count)] = key;
+  }
+  return true;
+}
+
+bool compile_snapshot(const std::string& file) {
+  std::vector<uint64_t> keys = list_cached_keys();
+  std::sort(keys.begin(), keys.end());
+  uint64_t count = keys.size();
+  uint32_t buckets = static_cast<uint32_t>(count / KEYS_PER_BUCKET + 1);
+  std::vector<uint32_t> pilots;
+  std::vector<uint64_t> slot_keys;
+  uint64_t seed = 0;
+  while (count > 0 && !build_index(keys, seed, buckets, pilots, slot_keys)) {
+    seed = mix(seed + 1);
+  }
+  if (count == 0) {
+    pilots.assign(buckets, 0);
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION_NUMBER;
+  header.buckets = buckets;
+  header.count = count;
+  header.seed = seed;
+  header.slots_offset = sizeof(header) + buckets * sizeof(uint32_t);
+  header.slots_offset = (header.slots_offset + 7) & ~uint64_t(7);
+  header.data_offset = page_align(header.slots_offset +
+                                  count * sizeof(SnapshotSlot));
+
+  std::string tmp = file + ".tmp";
+  std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    logger(ERROR, "snapshot", "can't create " + tmp, 0);
+    return false;
+  }
+  std::vector<SnapshotSlot> slots(count);
+  uint64_t offset = header.data_offset;
+  std::string response;
+  out.seekp(offset);
+  for (uint64_t i = 0; i < count; ++i) {
+    if (!load_cached_response(slot_keys[i], response)) {
+      response.clear();
+    }
+    slots[i].key = slot_keys[i];
+    slots[i].offset = offset;
+    slots[i].length = response.size();
+    out.seekp(offset);
+    out.write(response.data(), response.size());
+    offset = page_align(offset + response.size());
+  }
+  header.file_size = offset;
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(pilots.data()),
+            pilots.size() * sizeof(uint32_t));
+  out.seekp(header.slots_offset);
+  out.write(reinterpret_cast<const char*>(slots.data()),
+            slots.size() * sizeof(SnapshotSlot));
+  out.close();
+  if (!out || truncate(tmp.c_str(), header.file_size) < 0 ||
+      rename(tmp.c_str(), file.c_str()) < 0) {
+    logger(ERROR, "snapshot", "can't write " + file, 0);
+    unlink(tmp.c_str());
+    return false;
+  }
+  std::ostringstream oss;
+  oss << "compiled " << count << " entries into " << file << " ("
+      << header.file_size << " bytes)";
+  logger(LOG, "snapshot", oss, 0);
+  return true;
+}
+
+Snapshot::Snapshot() : base(nullptr), mapped(0), header(nullptr),
+                       pilots(nullptr), slots(nullptr) {}
+
+Snapshot::~Snapshot() {
+  if (base != nullptr) {
+    munmap(const_cast<char*>(base), mapped);
+  }
+}
+
+bool Snapshot::open(const std::string& file) {
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    logger(ERROR, "snapshot", "can't open " + file, 0);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 ||
+      static_cast<uint64_t>(st.st_size) < sizeof(SnapshotHeader)) {
+    logger(ERROR, "snapshot", "bad snapshot " + file, 0);
+    ::close(fd);
+    return false;
+  }
+  void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (p == MAP_FAILED) {
+    logger(ERROR, "snapshot", "mmap " + file, 0);
+    return false;
+  }
+  const SnapshotHeader* h = static_cast<const SnapshotHeader*>(p);
+  if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      h->version != VERSION_NUMBER ||
+      h->file_size != static_cast<uint64_t>(st.st_size) ||
+      h->data_offset > h->file_size || h->buckets == 0 ||
+      h->slots_offset + h->count * sizeof(SnapshotSlot) > h->data_offset) {
+    logger(ERROR, "snapshot", "bad snapshot header " + file, 0);
+    munmap(p, st.st_size);
+    return false;
+  }
+  madvise(p, st.st_size, MADV_RANDOM);
+  base = static_cast<const char*>(p);
+  mapped = st.st_size;
+  header = h;
+  pilots = reinterpret_cast<const uint32_t*>(base + sizeof(SnapshotHeader));
+  slots = reinterpret_cast<const SnapshotSlot*>(base + h->slots_offset);
+  return true;
+}
+
+bool Snapshot::lookup(uint64_t key, const char*& data,
+                      std::size_t& length) const {
+  if (header == nullptr || header->count == 0) {
+    return false;
+  }
+  uint64_t h = mix(key ^ header->seed);
+  const SnapshotSlot& slot =
+    slots[slot_of(h, pilots[h % header->buckets], header->count)];
+  if (slot.key != key || slot.offset + slot.length > mapped) {
+    return false;
+  }
+  data = base + slot.offset;
+  length = slot.length;
+  return true;
+}
@@ -0,0 +1,60 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Immutable, read only image of a data_dir for offline playback.
+//
+//   SnapshotHeader
+//   uint32_t pilots[buckets]      hash and displace minimal perfect hash
+//   SnapshotSlot slots[count]     one per key, indexed by the perfect hash
+//   response blobs                each one starting on a page boundary
+//
+// A key k lands in bucket b = mix(k ^ seed) % buckets and in slot
+// mix(mix(k ^ seed) ^ mix(pilots[b])) % count.  The file is mapped
+// read only and shared, so every process playing back the same snapshot
+// shares one copy through the page cache.
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t buckets;
+  uint64_t count;
+  uint64_t seed;
+  uint64_t slots_offset;
+  uint64_t data_offset;
+  uint64_t file_size;
+};
+
+struct SnapshotSlot {
+  uint64_t key;
+  uint64_t offset;
+  uint64_t length;
+};
+
+// compile every entry of the current (data) directory into file
+bool compile_snapshot(const std::string& file);
+
+class Snapshot {
+  public:
+    Snapshot();
+    ~Snapshot();
+
+    bool open(const std::string& file);
+    bool lookup(uint64_t key, const char*& data, std::size_t& length) const;
+    uint64_t size() const { return header == nullptr ? 0 : header->count; }
+
+  private:
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    const char* base;
+    std::size_t mapped;
+    const SnapshotHeader* header;
+    const uint32_t* pilots;
+    const SnapshotSlot* slots;
+};
+
+#endif
@@ -0,0 +1,786 @@
+// Checks for the h2c client: HPACK against the examples of RFC 7541
+// appendix C, the HTTP/1.1 translation, and the client against a stub h2c
+// server on localhost that enforces the stream limit and flow control.
+//
+//   make http_caching_proxy.t && ./http_caching_proxy.t
+
+#include "h2c_client.h"
+#include "hpack.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond \
+                << ") failed" << std::endl; \
+      ++failures; \
+    } \
+  } while (0)
+
+typedef std::chrono::steady_clock Clock;
+
+static std::string unhex(const std::string& hex) {
+  std::string out;
+  std::string digits;
+  for (char c : hex) {
+    if (c != ' ') {
+      digits += c;
+    }
+  }
+  for (std::size_t i = 0; i + 1 < digits.size(); i += 2) {
+    out += static_cast<char>(std::strtoul(digits.substr(i, 2).c_str(),
+                                          nullptr, 16));
+  }
+  return out;
+}
+
+static void check_block(HpackDecoder& decoder, const std::string& hex,
+                        const HeaderList& expected) {
+  HeaderList headers;
+  CHECK(decoder.decode(unhex(hex), headers));
+  CHECK(headers == expected);
+}
+
+// C.2: one representation each
+static void hpack_literals() {
+  HpackDecoder decoder(4096, 65536);
+  check_block(decoder, "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d "
+              "6865 6164 6572", {{"custom-key", "custom-header"}});
+  check_block(decoder, "040c 2f73 616d 706c 652f 7061 7468",
+              {{":path", "/sample/path"}});
+  check_block(decoder, "1008 7061 7373 776f 7264 0673 6563 7265 74",
+              {{"password", "secret"}});
+  check_block(decoder, "82", {{":method", "GET"}});
+}
+
+static const HeaderList REQUEST1 = {
+  {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+  {":authority", "www.example.com"}};
+static const HeaderList REQUEST2 = {
+  {":method", "GET"}, {":scheme", "http"}, {":path", "/"},
+  {":authority", "www.example.com"}, {"cache-control", "no-cache"}};
+static const HeaderList REQUEST3 = {
+  {":method", "GET"}, {":scheme", "https"}, {":path", "/index.html"},
+  {":authority", "www.example.com"}, {"custom-key", "custom-value"}};
+
+// C.3: the encoder has to produce the same bytes, without Huffman coding
+static void hpack_requests() {
+  static const char* blocks[] = {
+    "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+    "8286 84be 5808 6e6f 2d63 6163 6865",
+    "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"
+  };
+  const HeaderList* requests[] = {&REQUEST1, &REQUEST2, &REQUEST3};
+  HpackEncoder encoder;
+  HpackDecoder decoder(4096, 65536);
+  for (int i = 0; i < 3; ++i) {
+    std::string block;
+    encoder.encode(*requests[i], block);
+    CHECK(block == unhex(blocks[i]));
+    check_block(decoder, blocks[i], *requests[i]);
+  }
+}
+
+// C.4: the same requests Huffman coded
+static void hpack_huffman_requests() {
+  HpackDecoder decoder(4096, 65536);
+  check_block(decoder, "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff", REQUEST1);
+  check_block(decoder, "8286 84be 5886 a8eb 1064 9cbf", REQUEST2);
+  check_block(decoder, "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b "
+              "b8e8 b4bf", REQUEST3);
+}
+
+static const HeaderList RESPONSE1 = {
+  {":status", "302"}, {"cache-control", "private"},
+  {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+  {"location", "https://www.example.com"}};
+static const HeaderList RESPONSE2 = {
+  {":status", "307"}, {"cache-control", "private"},
+  {"date", "Mon, 21 Oct 2013 20:13:21 GMT"},
+  {"location", "https://www.example.com"}};
+static const HeaderList RESPONSE3 = {
+  {":status", "200"}, {"cache-control", "private"},
+  {"date", "Mon, 21 Oct 2013 20:13:22 GMT"},
+  {"location", "https://www.example.com"}, {"content-encoding", "gzip"},
+  {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}};
+
+// C.5 and C.6: a 256 byte table, so entries get evicted along the way
+static void hpack_responses() {
+  HpackDecoder plain(256, 65536);
+  check_block(plain, "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 "
+              "3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3120 474d 546e "
+              "1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+              RESPONSE1);
+  check_block(plain, "4803 3330 37c1 c0bf", RESPONSE2);
+  check_block(plain, "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 "
+              "303a 3133 3a32 3220 474d 54c0 5a04 677a 6970 7738 666f 6f3d "
+              "4153 444a 4b48 514b 425a 584f 5157 454f 5049 5541 5851 5745 "
+              "4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 "
+              "6f6e 3d31", RESPONSE3);
+  HpackDecoder huffman(256, 65536);
+  check_block(huffman, "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 "
+              "44a8 2005 9504 0b81 66e0 82a6 2d1b ff6e 919d 29ad 1718 63c7 "
+              "8f0b 97c8 e9ae 82ae 43d3", RESPONSE1);
+  check_block(huffman, "4883 640e ffc1 c0bf", RESPONSE2);
+  check_block(huffman, "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 "
+              "e084 a62d 1bff c05a 839b d9ab 77ad 94e7 821d d7f2 e6c7 b335 "
+              "dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f 9587 3160 "
+              "65c0 03ed 4ee5 b106 3d50 07", RESPONSE3);
+}
+
+static void hpack_malformed() {
+  std::string out;
+  // padding longer than 7 bits, and padding that isn't all ones
+  CHECK(!huffman_decode("\xff\xff\xff\xff", 4, out));
+  CHECK(!huffman_decode("\x00", 1, out));
+  HeaderList headers;
+  HpackDecoder decoder(4096, 65536);
+  CHECK(!decoder.decode(unhex("be"), headers)); // empty dynamic table
+  CHECK(!decoder.decode(unhex("400a 6375 73"), headers)); // cut short
+  HpackDecoder small(4096, 40);
+  CHECK(!small.decode(unhex("400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f "
+                            "6d2d 6865 6164 6572"), headers));
+}
+
+static void translation() {
+  HeaderList headers;
+  std::string body;
+  CHECK(h2_request("POST http://example.com:81/a?b=1 HTTP/1.1\r\n"
+                   "Host: ignored\r\nConnection: close, X-Hop\r\n"
+                   "X-Hop: 1\r\nTE: gzip\r\nX-Kept: yes\r\n"
+                   "Transfer-Encoding: chunked\r\n\r\n"
+                   "3\r\nabc\r\n2\r\nde\r\n0\r\n\r\n", "dest:80",
+                   headers, body));
+  HeaderList expected = {
+    {":method", "POST"}, {":scheme", "http"}, {":authority", "example.com:81"},
+    {":path", "/a?b=1"}, {"x-kept", "yes"}};
+  CHECK(headers == expected);
+  CHECK(body == "abcde");
+  CHECK(h2_request("GET /x HTTP/1.1\r\n\r\n", "dest:80", headers, body));
+  CHECK(headers[2].second == "dest:80" && body.empty());
+  CHECK(!h2_request("GET /x HTTP/1.1\r\n", "dest:80", headers, body));
+  CHECK(h1_response_head(200, {{"content-type", "text/plain"},
+                               {"content-length", "7"}}, 5) ==
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+        "Content-Length: 5\r\n\r\n");
+}
+
+// The server side, just enough of it to serve
+//   /size/<n>  n bytes of a pattern
+//   /echo      the request body
+//   /slow      after 200ms
+//   /violate   2MB, ignoring the client's windows
+// and anything else with a 404.
+class StubServer {
+  public:
+    struct Options {
+      uint32_t max_streams;
+      uint32_t window; // our SETTINGS_INITIAL_WINDOW_SIZE
+      bool refuse; // RST_STREAM REFUSED_STREAM beyond max_streams
+      bool late_settings; // SETTINGS only after the first request
+    };
+
+    explicit StubServer(const Options& options);
+    ~StubServer();
+
+    std::string port() const { return std::to_string(listen_port); }
+
+    std::atomic<int> connections;
+    std::atomic<int> max_active;
+    std::atomic<int> refused;
+    std::atomic<int> violations;
+    std::atomic<int> goaway_error;
+
+  private:
+    void serve(int fd);
+
+    Options options;
+    int listener;
+    int listen_port;
+    std::thread acceptor;
+    std::mutex mutex;
+    std::vector<int> fds;
+    std::vector<std::thread> threads;
+};
+
+static const uint32_t FRAME = 16384;
+
+static std::string pattern(std::size_t size) {
+  std::string s(size, '\0');
+  for (std::size_t i = 0; i < size; ++i) {
+    s[i] = static_cast<char>('a' + (i * 7 + i / 251) % 26);
+  }
+  return s;
+}
+
+static uint32_t get32(const std::string& s, std::size_t pos) {
+  const unsigned char* u =
+    reinterpret_cast<const unsigned char*>(s.data() + pos);
+  return uint32_t(u[0]) << 24 | uint32_t(u[1]) << 16 | uint32_t(u[2]) << 8 |
+    u[3];
+}
+
+static std::string be32(uint32_t v) {
+  std::string s;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    s += static_cast<char>(v >> shift);
+  }
+  return s;
+}
+
+static bool read_exact(int fd, char* buffer, std::size_t length) {
+  std::size_t done = 0;
+  while (done < length) {
+    ssize_t n = recv(fd, buffer + done, length - done, 0);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+static bool read_frame(int fd, uint8_t& type, uint8_t& flags, uint32_t& id,
+                       std::string& payload) {
+  char header[9];
+  if (!read_exact(fd, header, sizeof(header))) {
+    return false;
+  }
+  const unsigned char* h = reinterpret_cast<const unsigned char*>(header);
+  uint32_t length = uint32_t(h[0]) << 16 | uint32_t(h[1]) << 8 | h[2];
+  type = h[3];
+  flags = h[4];
+  id = get32(std::string(header + 5, 4), 0) & 0x7fffffff;
+  payload.resize(length);
+  return length == 0 || read_exact(fd, &payload[0], length);
+}
+
+static bool write_frame(int fd, uint8_t type, uint8_t flags, uint32_t id,
+                        const std::string& payload) {
+  std::string frame;
+  frame += static_cast<char>(payload.size() >> 16);
+  frame += static_cast<char>(payload.size() >> 8);
+  frame += static_cast<char>(payload.size());
+  frame += static_cast<char>(type);
+  frame += static_cast<char>(flags);
+  frame += be32(id);
+  frame += payload;
+  std::size_t done = 0;
+  while (done < frame.size()) {
+    ssize_t n = send(fd, frame.data() + done, frame.size() - done,
+                     MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+StubServer::StubServer(const Options& o) :
+  connections(0), max_active(0), refused(0), violations(0), goaway_error(-1),
+  options(o) {
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(addr);
+  bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  listen(listener, 16);
+  getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length);
+  listen_port = ntohs(addr.sin_port);
+  acceptor = std::thread([this] {
+    int fd;
+    while ((fd = accept(listener, nullptr, nullptr)) >= 0) {
+      ++connections;
+      std::lock_guard<std::mutex> lock(mutex);
+      fds.push_back(fd);
+      threads.push_back(std::thread(&StubServer::serve, this, fd));
+    }
+  });
+}
+
+StubServer::~StubServer() {
+  shutdown(listener, SHUT_RDWR);
+  acceptor.join();
+  close(listener);
+  std::lock_guard<std::mutex> lock(mutex);
+  for (int fd : fds) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+void StubServer::serve(int fd) {
+  struct Response {
+    uint32_t id;
+    HeaderList headers;
+    std::string body;
+    std::size_t sent;
+    bool headers_sent;
+    bool ignore_windows;
+    Clock::time_point ready;
+  };
+  struct Request {
+    HeaderList headers;
+    std::string body;
+    int64_t granted; // what the client may still send
+  };
+  std::mutex state_mutex; // taken before write_mutex
+  std::mutex write_mutex;
+  std::condition_variable wake;
+  std::deque<Response> responses;
+  std::map<uint32_t, int64_t> windows;
+  int64_t connection_window = 65535;
+  int64_t initial_window = 65535;
+  int active = 0;
+  bool closed = false;
+  HpackEncoder encoder;
+
+  auto send_frame = [&](uint8_t type, uint8_t flags, uint32_t id,
+                        const std::string& payload) {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    return write_frame(fd, type, flags, id, payload);
+  };
+
+  std::thread writer([&] {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    while (!closed) {
+      bool progress = false;
+      for (auto it = responses.begin(); it != responses.end();) {
+        Response& r = *it;
+        if (Clock::now() < r.ready) {
+          ++it;
+          continue;
+        }
+        bool done = false;
+        if (!r.headers_sent) {
+          std::string block;
+          std::lock_guard<std::mutex> write_lock(write_mutex);
+          encoder.encode(r.headers, block);
+          write_frame(fd, 0x1, 0x4 | (r.body.empty() ? 0x1 : 0), r.id, block);
+          r.headers_sent = true;
+          done = r.body.empty();
+          progress = true;
+        }
+        else {
+          int64_t n = std::min<int64_t>(FRAME, r.body.size() - r.sent);
+          if (!r.ignore_windows) {
+            n = std::min(n, std::min(connection_window, windows[r.id]));
+          }
+          if (n > 0) {
+            bool last = r.sent + n == r.body.size();
+            send_frame(0x0, last ? 0x1 : 0, r.id, r.body.substr(r.sent, n));
+            r.sent += n;
+            connection_window -= n;
+            windows[r.id] -= n;
+            done = last;
+            progress = true;
+          }
+        }
+        if (done) {
+          --active;
+          it = responses.erase(it);
+        }
+        else {
+          ++it;
+        }
+      }
+      if (!progress) {
+        wake.wait_for(lock, std::chrono::milliseconds(10));
+      }
+    }
+  });
+
+  std::string settings;
+  settings += std::string("\x00\x03", 2) + be32(options.max_streams);
+  settings += std::string("\x00\x04", 2) + be32(options.window);
+  bool settings_sent = false;
+  char preface[24];
+  if (read_exact(fd, preface, sizeof(preface)) &&
+      std::string(preface, sizeof(preface)) ==
+      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") {
+    if (!options.late_settings) {
+      send_frame(0x4, 0, 0, settings);
+      settings_sent = true;
+    }
+    HpackDecoder decoder(4096, 1 << 20);
+    std::map<uint32_t, Request> requests;
+    int64_t connection_granted = 65535;
+    std::string block;
+    uint32_t block_id = 0;
+    bool block_end = false;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t id;
+    std::string payload;
+    while (read_frame(fd, type, flags, id, payload)) {
+      uint32_t complete = 0;
+      if (type == 0x4 && (flags & 0x1) == 0) {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        for (std::size_t i = 0; i + 6 <= payload.size(); i += 6) {
+          if (payload[i] == 0 && payload[i + 1] == 0x4) {
+            int64_t value = get32(payload, i + 2);
+            for (auto& window : windows) {
+              window.second += value - initial_window;
+            }
+            initial_window = value;
+          }
+        }
+        send_frame(0x4, 0x1, 0, std::string());
+      }
+      else if (type == 0x8) {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        (id == 0 ? connection_window : windows[id]) +=
+          get32(payload, 0) & 0x7fffffff;
+        wake.notify_all();
+      }
+      else if (type == 0x1 || type == 0x9) {
+        if (type == 0x1) {
+          block = payload;
+          block_id = id;
+          block_end = (flags & 0x1) != 0;
+        }
+        else {
+          block += payload;
+        }
+        if ((flags & 0x4) != 0) {
+          Request& request = requests[block_id];
+          decoder.decode(block, request.headers);
+          request.granted = settings_sent ? options.window : 65535;
+          {
+            std::lock_guard<std::mutex> lock(state_mutex);
+            windows[block_id] = initial_window;
+          }
+          if (block_end) {
+            complete = block_id;
+          }
+          if (!settings_sent) {
+            send_frame(0x4, 0, 0, settings);
+            settings_sent = true;
+          }
+        }
+      }
+      else if (type == 0x0) {
+        Request& request = requests[id];
+        request.body += payload;
+        request.granted -= payload.size();
+        connection_granted -= payload.size();
+        if (request.granted < 0 || connection_granted < 0) {
+          ++violations;
+        }
+        // consumed right away
+        if (!payload.empty()) {
+          send_frame(0x8, 0, id, be32(payload.size()));
+          send_frame(0x8, 0, 0, be32(payload.size()));
+          request.granted += payload.size();
+          connection_granted += payload.size();
+        }
+        if ((flags & 0x1) != 0) {
+          complete = id;
+        }
+      }
+      else if (type == 0x3) {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        for (auto it = responses.begin(); it != responses.end(); ++it) {
+          if (it->id == id) {
+            --active;
+            responses.erase(it);
+            break;
+          }
+        }
+      }
+      else if (type == 0x7) {
+        goaway_error = get32(payload, 4);
+      }
+      if (complete == 0) {
+        continue;
+      }
+      Request request = requests[complete];
+      requests.erase(complete);
+      std::string path;
+      for (auto& header : request.headers) {
+        if (header.first == ":path") {
+          path = header.second;
+        }
+      }
+      Response response;
+      response.id = complete;
+      response.sent = 0;
+      response.headers_sent = false;
+      response.ignore_windows = false;
+      response.ready = Clock::now();
+      int status = 200;
+      if (path.compare(0, 6, "/size/") == 0) {
+        response.body = pattern(std::strtoul(path.c_str() + 6, nullptr, 10));
+      }
+      else if (path == "/echo") {
+        response.body = request.body;
+      }
+      else if (path == "/slow") {
+        response.body = "slow";
+        response.ready += std::chrono::milliseconds(200);
+      }
+      else if (path == "/violate") {
+        response.body = pattern(2 << 20);
+        response.ignore_windows = true;
+      }
+      else {
+        status = 404;
+        response.body = "not found";
+      }
+      response.headers = {{":status", std::to_string(status)},
+                           {"content-type", "text/plain"},
+                           {"content-length",
+                            std::to_string(response.body.size())}};
+      std::lock_guard<std::mutex> lock(state_mutex);
+      if (options.refuse && active >= int(options.max_streams)) {
+        ++refused;
+        send_frame(0x3, 0, complete, be32(0x7));
+        continue;
+      }
+      ++active;
+      max_active = std::max<int>(max_active, active);
+      responses.push_back(response);
+      wake.notify_all();
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(state_mutex);
+    closed = true;
+  }
+  wake.notify_all();
+  writer.join();
+  close(fd);
+}
+
+static const Timeouts TIMEOUTS = {
+  std::chrono::milliseconds(2000), std::chrono::milliseconds(5000),
+  std::chrono::milliseconds(5000), std::chrono::milliseconds(5000),
+  std::chrono::milliseconds(0)
+};
+
+static std::string get(H2cClient& client, const std::string& path,
+                       bool& ok) {
+  std::string response;
+  bool timed_out;
+  ok = h2c_fetch(client, "GET " + path + " HTTP/1.1\r\nHost: stub\r\n\r\n",
+                 response, TIMEOUTS, timed_out);
+  return response;
+}
+
+static std::string body_of(const std::string& response) {
+  auto end = response.find("\r\n\r\n");
+  return end == std::string::npos ? std::string() : response.substr(end + 4);
+}
+
+static void stub_basic() {
+  StubServer stub({100, 65535, false, false});
+  H2cClient client("127.0.0.1", stub.port(), 2);
+  bool ok;
+  std::string response = get(client, "/size/100", ok);
+  CHECK(ok);
+  CHECK(response.compare(0, 17, "HTTP/1.1 200 OK\r\n") == 0);
+  CHECK(body_of(response) == pattern(100));
+  response = get(client, "/missing", ok);
+  CHECK(ok);
+  CHECK(response.compare(0, 24, "HTTP/1.1 404 Not Found\r\n") == 0);
+  CHECK(stub.connections == 1);
+}
+
+// many requests in flight at once share the connections
+static void stub_multiplexing() {
+  StubServer stub({100, 65535, false, false});
+  H2cClient client("127.0.0.1", stub.port(), 2);
+  std::atomic<int> good(0);
+  auto start = Clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 30; ++i) {
+    threads.push_back(std::thread([&] {
+      bool ok;
+      if (body_of(get(client, "/slow", ok)) == "slow" && ok) {
+        ++good;
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  CHECK(good == 30);
+  CHECK(stub.connections <= 2);
+  CHECK(stub.max_active > 1);
+  // one after the other would take 6s
+  CHECK(Clock::now() - start < std::chrono::seconds(2));
+}
+
+// streams beyond the limit, sent before the client had the settings, are
+// refused and go again
+static void stub_refused() {
+  StubServer stub({3, 65535, true, true});
+  H2cClient client("127.0.0.1", stub.port(), 2);
+  std::atomic<int> good(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 20; ++i) {
+    threads.push_back(std::thread([&] {
+      bool ok;
+      if (body_of(get(client, "/slow", ok)) == "slow" && ok) {
+        ++good;
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  CHECK(good == 20);
+  CHECK(stub.refused > 0);
+  CHECK(stub.max_active <= 3);
+  CHECK(stub.connections <= 2);
+}
+
+// more than the stream and the connection windows of the client
+static void stub_large_response() {
+  StubServer stub({100, 65535, false, false});
+  H2cClient client("127.0.0.1", stub.port(), 1);
+  bool ok;
+  std::string response = get(client, "/size/20000000", ok);
+  CHECK(ok);
+  CHECK(body_of(response) == pattern(20000000));
+  std::atomic<int> good(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.push_back(std::thread([&] {
+      bool ok;
+      if (body_of(get(client, "/size/3000000", ok)) == pattern(3000000) && ok) {
+        ++good;
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  CHECK(good == 4);
+}
+
+// a request body larger than the stub's 16K windows
+static void stub_request_body() {
+  StubServer stub({100, 16384, false, false});
+  H2cClient client("127.0.0.1", stub.port(), 1);
+  bool ok;
+  get(client, "/size/1", ok); // the client has the settings after this
+  CHECK(ok);
+  std::string body = pattern(1 << 20);
+  std::ostringstream request;
+  request << "POST /echo HTTP/1.1\r\nHost: stub\r\nContent-Length: "
+          << body.size() << "\r\n\r\n" << body;
+  std::string response;
+  bool timed_out;
+  CHECK(h2c_fetch(client, request.str(), response, TIMEOUTS, timed_out));
+  CHECK(body_of(response) == body);
+  CHECK(stub.violations == 0);
+}
+
+// a peer ignoring our window fails the connection, with other streams
+// being opened on it at the same time
+static void stub_flow_control_violation() {
+  StubServer stub({100, 65535, false, false});
+  H2cClient client("127.0.0.1", stub.port(), 1);
+  auto done = std::async(std::launch::async, [&] {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 10; ++i) {
+      threads.push_back(std::thread([&] {
+        bool ok;
+        get(client, "/slow", ok);
+      }));
+    }
+    H2cClient::Exchange exchange;
+    HeaderList headers;
+    std::string body;
+    int status;
+    HeaderList fields;
+    h2_request("GET /violate HTTP/1.1\r\n\r\n", client.authority(), headers,
+               body);
+    bool sent = client.open(exchange, TIMEOUTS.connect) &&
+      exchange.send(headers, body, TIMEOUTS.request);
+    // don't read, the stub is meant to run past the window
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    // the stream may have failed before its headers were looked at
+    std::string data;
+    if (exchange.response(status, fields, TIMEOUTS.first_byte)) {
+      while (exchange.read(data, TIMEOUTS.idle)) {
+      }
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    return sent && !exchange.complete();
+  });
+  if (done.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+    std::cerr << "flow control violation: deadlocked" << std::endl;
+    std::_Exit(1);
+  }
+  CHECK(done.get());
+  CHECK(stub.goaway_error == 0x3); // FLOW_CONTROL_ERROR
+  // the next request gets a new connection
+  bool ok;
+  CHECK(body_of(get(client, "/size/10", ok)) == pattern(10) && ok);
+}
+
+int main() {
+  // the client logs to http_caching_proxy.log in the working directory
+  char dir[] = "/tmp/h2c_test.XXXXXX";
+  if (mkdtemp(dir) == nullptr || chdir(dir) != 0) {
+    return 1;
+  }
+  struct {
+    const char* name;
+    void (*run)();
+  } tests[] = {
+    {"hpack_literals", hpack_literals},
+    {"hpack_requests", hpack_requests},
+    {"hpack_huffman_requests", hpack_huffman_requests},
+    {"hpack_responses", hpack_responses},
+    {"hpack_malformed", hpack_malformed},
+    {"translation", translation},
+    {"stub_basic", stub_basic},
+    {"stub_multiplexing", stub_multiplexing},
+    {"stub_refused", stub_refused},
+    {"stub_large_response", stub_large_response},
+    {"stub_request_body", stub_request_body},
+    {"stub_flow_control_violation", stub_flow_control_violation},
+  };
+  for (auto& test : tests) {
+    int before = failures;
+    test.run();
+    std::cout << (failures == before ? "ok   " : "FAIL ") << test.name
+              << std::endl;
+  }
+  if (system((std::string("rm -rf ") + dir).c_str()) != 0) {
+    std::cerr << "can't remove " << dir << std::endl;
+  }
+  return failures == 0 ? 0 : 1;
+}
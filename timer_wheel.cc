@@ -0,0 +1,174 @@
+#include "timer_wheel.h"
+
+#include <sys/socket.h>
+
+TimerWheel& TimerWheel::instance() {
+  static TimerWheel* wheel = new TimerWheel(std::chrono::milliseconds(10));
+  return *wheel;
+}
+
+TimerWheel::TimerWheel(std::chrono::milliseconds tick) :
+  tick_length(tick), current(0), live(0), stop(false),
+  thread(&TimerWheel::run, this) {}
+
+TimerWheel::~TimerWheel() {
+  stop = true;
+  thread.join();
+}
+
+void TimerWheel::release(uint32_t handle) {
+  handles[handle].live = false;
+  free_handles.push_back(handle);
+  --live;
+}
+
+// move the timer at it from its current slot to the one matching how far
+// away it expires
+void TimerWheel::place(Slot& from, Slot::iterator it) {
+  uint64_t delta = it->expires > current ? it->expires - current : 0;
+  Slot* slot = &overflow;
+  for (std::size_t level = 0; level < LEVELS; ++level) {
+    if (delta < (uint64_t(1) << (SLOT_BITS * (level + 1)))) {
+      std::size_t index = (it->expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+      slot = &wheels[level][index];
+      break;
+    }
+  }
+  Handle& handle = handles[it->handle];
+  slot->splice(slot->end(), from, it);
+  handle.slot = slot;
+  handle.it = it;
+}
+
+TimerWheel::TimerId TimerWheel::schedule(std::chrono::milliseconds delay,
+                                         Callback callback) {
+  std::lock_guard<std::mutex> lock(mutex);
+  uint64_t ticks = (delay.count() + tick_length.count() - 1) / tick_length.count();
+  if (spare.empty()) {
+    spare.push_back(Timer());
+  }
+  Slot staging;
+  staging.splice(staging.end(), spare, spare.begin());
+  uint32_t index;
+  if (free_handles.empty()) {
+    index = handles.size();
+    handles.push_back(Handle());
+    handles.back().generation = 0;
+  }
+  else {
+    index = free_handles.back();
+    free_handles.pop_back();
+  }
+  Handle& handle = handles[index];
+  ++handle.generation;
+  handle.live = true;
+  ++live;
+  Timer& timer = staging.front();
+  timer.handle = index;
+  timer.expires = current + (ticks == 0 ? 1 : ticks);
+  timer.callback = std::move(callback);
+  place(staging, staging.begin());
+  return (TimerId(handle.generation) << 32) | index;
+}
+
+bool TimerWheel::cancel(TimerId id) {
+  std::lock_guard<std::mutex> lock(mutex);
+  uint32_t index = static_cast<uint32_t>(id);
+  if (index >= handles.size() || !handles[index].live ||
+      handles[index].generation != static_cast<uint32_t>(id >> 32)) {
+    return false;
+  }
+  Handle& handle = handles[index];
+  handle.it->callback = nullptr;
+  spare.splice(spare.begin(), *handle.slot, handle.it);
+  release(index);
+  return true;
+}
+
+std::size_t TimerWheel::pending() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return live;
+}
+
+void TimerWheel::cascade(std::size_t level) {
+  Slot& slot = level < LEVELS ?
+    wheels[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)] : overflow;
+  while (!slot.empty()) {
+    place(slot, slot.begin());
+  }
+}
+
+void TimerWheel::tick() {
+  ++current;
+  // when a level wraps around, its next slot is redistributed downwards
+  for (std::size_t level = 1; level <= LEVELS; ++level) {
+    if ((current & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0) {
+      break;
+    }
+    cascade(level);
+  }
+  Slot& due = wheels[0][current & (SLOTS - 1)];
+  while (!due.empty()) {
+    Timer& timer = due.front();
+    if (timer.expires > current) {
+      // not due yet, happens for timers re-placed from a higher level
+      place(due, due.begin());
+      continue;
+    }
+    release(timer.handle);
+    Callback callback = std::move(timer.callback);
+    timer.callback = nullptr;
+    spare.splice(spare.begin(), due, due.begin());
+    callback();
+  }
+}
+
+void TimerWheel::run() {
+  auto next = std::chrono::steady_clock::now() + tick_length;
+  while (!stop) {
+    std::this_thread::sleep_until(next);
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    // catch up on ticks missed while the thread was not scheduled
+    while (next <= now) {
+      tick();
+      next += tick_length;
+    }
+  }
+}
+
+SocketDeadline::SocketDeadline(int f, int h, std::chrono::milliseconds timeout) :
+  fd(f), how(h), armed(false), id(0), fired(false) {
+  arm(timeout);
+}
+
+SocketDeadline::~SocketDeadline() {
+  if (armed) {
+    TimerWheel::instance().cancel(id);
+  }
+}
+
+void SocketDeadline::arm(std::chrono::milliseconds timeout) {
+  if (timeout.count() <= 0 || fd < 0) {
+    return;
+  }
+  // the destructor cancels the timer, and a cancelled callback is neither
+  // running nor going to run, so capturing this is safe; it also keeps the
+  // callback inside std::function's inline buffer
+  id = TimerWheel::instance().schedule(timeout, [this]() {
+    fired.store(true);
+    shutdown(fd, how);
+  });
+  armed = true;
+}
+
+void SocketDeadline::restart(std::chrono::milliseconds timeout) {
+  if (fired.load()) {
+    return;
+  }
+  if (armed) {
+    TimerWheel::instance().cancel(id);
+    armed = false;
+  }
+  arm(timeout);
+}
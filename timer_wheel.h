@@ -0,0 +1,105 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS slots, a slot on level
+// n spanning SLOTS^n ticks.  Scheduling and cancelling are O(1); a timer is
+// moved down a level at most LEVELS - 1 times before it fires.  Callbacks
+// run on the wheel thread with the wheel locked, so once cancel() returns
+// the callback is neither running nor going to run.  They must be short
+// and must not call back into the wheel.  Timer nodes and handles are
+// recycled, so once the wheel has held as many timers as it ever will at
+// once, scheduling no longer allocates (a callback too big for
+// std::function's inline buffer still does).
+class TimerWheel {
+  public:
+    typedef std::function<void()> Callback;
+    typedef uint64_t TimerId;
+
+    static const std::size_t SLOT_BITS = 6;
+    static const std::size_t SLOTS = 1 << SLOT_BITS;
+    static const std::size_t LEVELS = 4;
+
+    static TimerWheel& instance();
+
+    explicit TimerWheel(std::chrono::milliseconds tick);
+    ~TimerWheel();
+
+    TimerId schedule(std::chrono::milliseconds delay, Callback callback);
+    bool cancel(TimerId id);
+
+    std::size_t pending() const;
+
+  private:
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    struct Timer {
+      uint32_t handle;
+      uint64_t expires; // in ticks
+      Callback callback;
+    };
+    typedef std::list<Timer> Slot;
+    // a TimerId is a handle index in its low half and the handle's
+    // generation in its high half, so a stale id cancels nothing
+    struct Handle {
+      uint32_t generation;
+      bool live;
+      Slot* slot;
+      Slot::iterator it;
+    };
+
+    void release(uint32_t handle);
+    void place(Slot& from, Slot::iterator it);
+    void cascade(std::size_t level);
+    void tick();
+    void run();
+
+    mutable std::mutex mutex;
+    std::chrono::milliseconds tick_length;
+    uint64_t current;
+    Slot wheels[LEVELS][SLOTS];
+    Slot overflow;
+    Slot spare; // nodes of fired and cancelled timers
+    std::vector<Handle> handles;
+    std::vector<uint32_t> free_handles;
+    std::size_t live;
+    std::atomic<bool> stop;
+    std::thread thread;
+};
+
+// Shuts a socket down when its deadline passes, unblocking whatever call
+// is waiting on it.  restart() re-arms it, e.g. for an idle timeout that
+// is pushed back after every recv.  A zero timeout never fires.
+class SocketDeadline {
+  public:
+    SocketDeadline(int fd, int how, std::chrono::milliseconds timeout);
+    ~SocketDeadline();
+
+    void restart(std::chrono::milliseconds timeout);
+    bool expired() const { return fired.load(); }
+
+  private:
+    SocketDeadline(const SocketDeadline&) = delete;
+    SocketDeadline& operator=(const SocketDeadline&) = delete;
+
+    void arm(std::chrono::milliseconds timeout);
+
+    int fd;
+    int how;
+    bool armed;
+    TimerWheel::TimerId id;
+    std::atomic<bool> fired;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include "tracer.h"
+#include "http_caching_proxy.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+static int trace_pipe[2] = {-1, -1};
+
+Tracer::Tracer(std::size_t every, std::size_t max) :
+  sample_every(every == 0 ? 1 : every), max_requests(max == 0 ? 1 : max),
+  counter(0) {}
+
+bool Tracer::sample() {
+  return counter.fetch_add(1, std::memory_order_relaxed) % sample_every == 0;
+}
+
+void Tracer::publish(TraceRecord&& record) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (records.size() >= max_requests) {
+    records.pop_front();
+  }
+  records.push_back(std::move(record));
+}
+
+static void json_string(std::ostream& out, const std::string& s) {
+  out << '"';
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    }
+    else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out << escaped;
+    }
+    else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+static long long micros(TraceClock::time_point t) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    t.time_since_epoch()).count();
+}
+
+static void event(std::ostream& out, const char* name, int pid, int tid,
+                  TraceClock::time_point start, TraceClock::time_point end) {
+  out << "{\"name\":\"" << name << "\",\"cat\":\"proxy\",\"ph\":\"X\",\"pid\":"
+      << pid << ",\"tid\":" << tid << ",\"ts\":" << micros(start)
+      << ",\"dur\":" << micros(end) - micros(start);
+}
+
+// a complete ("X") event for the whole request with its path, hit number
+// and status as args, and one nested under it per phase
+std::string Tracer::json() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  int pid = getpid();
+  std::ostringstream out;
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid
+      << ",\"args\":{\"name\":\"http_caching_proxy\"}}";
+  for (auto& record : records) {
+    out << ",";
+    event(out, "request", pid, record.tid, record.start, record.end);
+    out << ",\"args\":{\"path\":";
+    json_string(out, record.path);
+    out << ",\"hit\":" << record.hit << ",\"code\":" << record.code << "}}";
+    for (auto& span : record.spans) {
+      out << ",";
+      event(out, span.phase, pid, record.tid, span.start, span.end);
+      out << "}";
+    }
+  }
+  out << "]}";
+  return out.str();
+}
+
+bool Tracer::dump(const std::string& file) const {
+  std::string temp = file + ".tmp";
+  {
+    std::ofstream out(temp, std::ios::trunc);
+    out << json();
+    if (!out) {
+      unlink(temp.c_str());
+      return false;
+    }
+  }
+  return rename(temp.c_str(), file.c_str()) == 0;
+}
+
+void RequestTrace::start(Tracer* t, int hit, TraceClock::time_point accepted) {
+  if (t == nullptr || !t->sample()) {
+    return;
+  }
+  tracer = t;
+  record.tid = syscall(SYS_gettid);
+  record.hit = hit;
+  record.code = 0;
+  record.start = accepted;
+  record.spans.reserve(16);
+  span("accept", accepted);
+}
+
+void RequestTrace::span(const char* phase, TraceClock::time_point start,
+                        TraceClock::time_point end) {
+  if (tracer != nullptr) {
+    record.spans.push_back(TraceSpan{phase, start, end});
+  }
+}
+
+void RequestTrace::finish(const std::string& path, int code) {
+  if (tracer == nullptr) {
+    return;
+  }
+  record.path = path;
+  record.code = code;
+  record.end = TraceClock::now();
+  tracer->publish(std::move(record));
+  tracer = nullptr;
+}
+
+static void on_trace_signal(int) {
+  int saved = errno;
+  char c = 1;
+  if (write(trace_pipe[1], &c, 1) < 0) {
+    // pipe full: a dump is already pending
+  }
+  errno = saved;
+}
+
+void install_trace_handler() {
+  if (trace_pipe[0] < 0 && pipe2(trace_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    logger(ERROR, "trace", "pipe", 0);
+    return;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_trace_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, nullptr);
+}
+
+int trace_fd() {
+  return trace_pipe[0];
+}
+
+bool trace_requested() {
+  char buf[16];
+  bool requested = false;
+  while (trace_pipe[0] >= 0 && read(trace_pipe[0], buf, sizeof(buf)) > 0) {
+    requested = true;
+  }
+  return requested;
+}
@@ -0,0 +1,126 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Sampled per request phase tracing.  One request in every sample_every is
+// traced: its connection thread timestamps each phase (accept, request
+// read, hash, cache lookup, connect, upstream send, first byte, last byte,
+// cache save, close) with the monotonic clock into a buffer of its own, and
+// hands the finished request to the Tracer, which keeps the last
+// max_requests of them.  json() exports them in the Chrome trace event
+// format, which chrome://tracing and Perfetto open as is.
+
+typedef std::chrono::steady_clock TraceClock;
+
+struct TraceSpan {
+  const char* phase; // a string literal
+  TraceClock::time_point start;
+  TraceClock::time_point end;
+};
+
+struct TraceRecord {
+  int tid;
+  int hit;
+  int code;
+  std::string path;
+  TraceClock::time_point start;
+  TraceClock::time_point end;
+  std::vector<TraceSpan> spans;
+};
+
+class Tracer {
+  public:
+    Tracer(std::size_t sample_every, std::size_t max_requests);
+
+    bool sample();
+
+    void publish(TraceRecord&& record);
+
+    std::string json() const;
+
+    // json() into file, through a temp file renamed into place
+    bool dump(const std::string& file) const;
+
+  private:
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    const std::size_t sample_every;
+    const std::size_t max_requests;
+    std::atomic<uint64_t> counter;
+    mutable std::mutex mutex;
+    std::deque<TraceRecord> records;
+};
+
+// The trace of one request, owned by its connection thread so recording a
+// span takes no lock.  Everything is a no-op unless start() sampled it.
+class RequestTrace {
+  public:
+    RequestTrace() : tracer(nullptr) {}
+
+    void start(Tracer* t, int hit, TraceClock::time_point accepted);
+
+    bool sampled() const { return tracer != nullptr; }
+
+    void span(const char* phase, TraceClock::time_point start,
+              TraceClock::time_point end = TraceClock::now());
+
+    void finish(const std::string& path, int code);
+
+    // spans its own lifetime, or a run of consecutive phases with next()
+    class Scope {
+      public:
+        Scope(RequestTrace& t, const char* p) : trace(t), phase(p) {
+          if (trace.sampled()) {
+            start = TraceClock::now();
+          }
+        }
+        ~Scope() {
+          if (trace.sampled() && phase != nullptr) {
+            trace.span(phase, start);
+          }
+        }
+
+        // end the current phase here and start the next one
+        void next(const char* p) {
+          if (trace.sampled() && phase != nullptr) {
+            TraceClock::time_point now = TraceClock::now();
+            trace.span(phase, start, now);
+            start = now;
+          }
+          phase = p;
+        }
+
+        void end() { next(nullptr); }
+
+      private:
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        RequestTrace& trace;
+        const char* phase;
+        TraceClock::time_point start;
+    };
+
+  private:
+    Tracer* tracer;
+    TraceRecord record;
+};
+
+// SIGUSR1 handler writing to a pipe the accept loop polls, like the upgrade
+// one; trace_requested() consumes the pending signal
+void install_trace_handler();
+
+int trace_fd();
+
+bool trace_requested();
+
+#endif
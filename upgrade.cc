@@ -0,0 +1,282 @@
+#include "upgrade.h"
+#include "http_caching_proxy.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <climits>
+#include <cerrno>
+#include <sstream>
+#include <thread>
+
+static const std::string INHERIT_OPTION = "--inherit_listener";
+
+static std::vector<std::string> command_line;
+
+static std::string start_dir;
+
+static int upgrade_pipe[2] = {-1, -1};
+
+static int stop_event = -1;
+
+static std::atomic<int> in_flight(0);
+
+void save_command_line(int argc, char** argv) {
+  command_line.clear();
+  for (int i = 0; i < argc; ++i) {
+    std::string arg = argv[i];
+    // a successor of a successor must not inherit from the first process
+    if (arg == INHERIT_OPTION && i + 1 < argc) {
+      ++i;
+      continue;
+    }
+    if (arg.compare(0, INHERIT_OPTION.size() + 1, INHERIT_OPTION + "=") == 0) {
+      continue;
+    }
+    command_line.push_back(arg);
+  }
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) != nullptr) {
+    start_dir = cwd;
+  }
+}
+
+static void on_upgrade_signal(int) {
+  int saved = errno;
+  char c = 1;
+  if (write(upgrade_pipe[1], &c, 1) < 0) {
+    // pipe full: an upgrade is already pending
+  }
+  errno = saved;
+}
+
+void install_upgrade_handler() {
+  if (upgrade_pipe[0] < 0 && pipe2(upgrade_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+    logger(ERROR, "upgrade", "pipe", 0);
+    return;
+  }
+  if (stop_event < 0 && (stop_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    logger(ERROR, "upgrade", "eventfd", 0);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_upgrade_signal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR2, &sa, nullptr);
+}
+
+int upgrade_fd() {
+  return upgrade_pipe[0];
+}
+
+bool upgrade_requested() {
+  char buf[16];
+  bool requested = false;
+  while (upgrade_pipe[0] >= 0 && read(upgrade_pipe[0], buf, sizeof(buf)) > 0) {
+    requested = true;
+  }
+  return requested;
+}
+
+int stop_fd() {
+  return stop_event;
+}
+
+void stop_accepting() {
+  uint64_t one = 1;
+  if (stop_event >= 0 && write(stop_event, &one, sizeof(one)) < 0) {
+    logger(ERROR, "upgrade", "stop_accepting", 0);
+  }
+}
+
+static bool wait_readable(int fd, std::chrono::milliseconds timeout) {
+  pollfd pfd = {fd, POLLIN, 0};
+  int rc;
+  while ((rc = poll(&pfd, 1, timeout.count())) < 0 && errno == EINTR) {}
+  return rc > 0;
+}
+
+static bool unix_address(const std::string& path, sockaddr_un& addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+static pid_t spawn_successor(const std::string& path) {
+  if (command_line.empty()) {
+    return -1;
+  }
+  std::vector<std::string> args = command_line;
+  args.push_back(INHERIT_OPTION);
+  args.push_back(path);
+  // no allocation between fork and exec, other threads may hold malloc locks
+  std::vector<char*> argv;
+  for (auto& arg : args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+  // client connections of the old process must not live on in the new one
+  for (long fd = 3; fd < max_fd; ++fd) {
+    close(fd);
+  }
+  // argv[0] (and a relative data_dir) are relative to where we were started
+  if (!start_dir.empty() && chdir(start_dir.c_str()) < 0) {
+    _exit(127);
+  }
+  execvp(argv[0], argv.data());
+  _exit(127);
+}
+
+bool hand_over_listeners(const std::vector<int>& fds,
+                         std::chrono::milliseconds timeout) {
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+    return false;
+  }
+  std::ostringstream oss;
+  oss << cwd << "/http_caching_proxy." << getpid() << ".upgrade";
+  std::string path = oss.str();
+  sockaddr_un addr;
+  if (!unix_address(path, addr)) {
+    logger(LOG, "upgrade", "socket path too long: " + path, 0);
+    return false;
+  }
+  int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (server < 0) {
+    logger(ERROR, "upgrade", "socket", 0);
+    return false;
+  }
+  unlink(path.c_str());
+  if (bind(server, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0 ||
+      listen(server, 1) < 0) {
+    logger(ERROR, "upgrade", "bind " + path, 0);
+    close(server);
+    return false;
+  }
+  bool ok = false;
+  pid_t pid = spawn_successor(path);
+  if (pid < 0) {
+    logger(ERROR, "upgrade", "fork", 0);
+  }
+  else if (!wait_readable(server, timeout)) {
+    logger(LOG, "upgrade", "successor did not connect", 0);
+  }
+  else {
+    int conn = accept(server, nullptr, nullptr);
+    if (conn >= 0) {
+      char byte = 'L';
+      iovec iov = {&byte, 1};
+      std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+      msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.data();
+      msg.msg_controllen = control.size();
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+      memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+      char ack = 0;
+      // the successor acknowledges once it owns the sockets
+      ok = sendmsg(conn, &msg, MSG_NOSIGNAL) == 1 &&
+        wait_readable(conn, timeout) && recv(conn, &ack, 1, 0) == 1 &&
+        ack == 'A';
+      close(conn);
+    }
+    if (!ok) {
+      logger(LOG, "upgrade", "hand over failed", 0);
+    }
+  }
+  close(server);
+  unlink(path.c_str());
+  if (ok) {
+    std::ostringstream done;
+    done << "listeners handed over to pid " << pid;
+    logger(LOG, "upgrade", done, 0);
+  }
+  return ok;
+}
+
+std::vector<int> take_over_listeners(const std::string& path) {
+  std::vector<int> fds;
+  sockaddr_un addr;
+  if (!unix_address(path, addr)) {
+    return fds;
+  }
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn < 0) {
+    return fds;
+  }
+  if (connect(conn, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
+    logger(ERROR, "upgrade", "connect " + path, 0);
+    close(conn);
+    return fds;
+  }
+  char byte = 0;
+  iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int) * 64)];
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) == 1) {
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+      fds.assign(received, received + n);
+    }
+  }
+  char ack = 'A';
+  if (fds.empty() || send(conn, &ack, 1, MSG_NOSIGNAL) != 1) {
+    logger(ERROR, "upgrade", "receive listeners", 0);
+    for (int fd : fds) {
+      close(fd);
+    }
+    fds.clear();
+  }
+  close(conn);
+  return fds;
+}
+
+void request_started() {
+  in_flight.fetch_add(1);
+}
+
+void request_finished() {
+  in_flight.fetch_sub(1);
+}
+
+void drain(std::chrono::milliseconds timeout) {
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (in_flight.load() > 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  std::ostringstream oss;
+  oss << "drained, " << in_flight.load() << " requests still in flight";
+  logger(LOG, "upgrade", oss, 0);
+}
@@ -0,0 +1,42 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Zero downtime restart.  SIGUSR2 makes the running process start a new
+// copy of the binary with --inherit_listener <socket>, pass its listening
+// sockets to it over that Unix socket (SCM_RIGHTS) and, once the new
+// process has them, stop accepting, drain the requests in flight and exit.
+// The kernel accept queue is shared by both, so no connection is refused.
+
+// remember the command line (and working directory) the successor runs with
+void save_command_line(int argc, char** argv);
+
+// SIGUSR2 handler writing to a pipe, so the accept loop can poll for it
+// whichever thread the signal is delivered to
+void install_upgrade_handler();
+
+int upgrade_fd();
+
+// consume the pending signal, true when one was pending
+bool upgrade_requested();
+
+// becomes readable, and stays so, once the listeners have been handed over
+int stop_fd();
+void stop_accepting();
+
+// old process: spawn the successor and pass it fds, true once it has them
+bool hand_over_listeners(const std::vector<int>& fds,
+                         std::chrono::milliseconds timeout);
+
+// new process: receive the listening sockets from the old one
+std::vector<int> take_over_listeners(const std::string& path);
+
+// requests in flight, waited for before the old process exits
+void request_started();
+void request_finished();
+void drain(std::chrono::milliseconds timeout);
+
+#endif